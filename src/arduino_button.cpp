@@ -1,6 +1,10 @@
 #include "arduino_button.h"
 
-#include <QtConcurrent/QtConcurrentRun>
+#include "metrics.h"
+#include "thread_topology.h"
+
+#include <poll.h>
+#include <stdio.h>
 
 using namespace::boost::asio;
 
@@ -11,10 +15,20 @@ serial_port_base::flow_control FLOW( serial_port_base::flow_control::none );
 serial_port_base::parity PARITY( serial_port_base::parity::none );
 serial_port_base::stop_bits STOP( serial_port_base::stop_bits::one );
 serial_port_base::character_size CHARSIZE(8U);
+
+/* how often the reader looks whether it should stop */
+const int POLL_MS = 100;
+
+const char* DEVICE = "/dev/ttyACM0";
 }
 
 ArduinoButton::ArduinoButton()
-    : port( io, "/dev/ttyACM0" ), running(false)
+    : port( io, DEVICE ), running(false)
+{
+    setOptions();
+}
+
+void ArduinoButton::setOptions()
 {
     // Setup port - base settings
     port.set_option( BAUD );
@@ -31,14 +45,44 @@ ArduinoButton::~ArduinoButton()
 
 void ArduinoButton::run()
 {
-    running = true;
+    if(running.exchange(true)) {
+        return;
+    }
+    if(reader.joinable()) {
+        // ended after a read error
+        reader.join();
+    }
+    if(!port.is_open()) {
+        boost::system::error_code ec;
+        port.open(DEVICE, ec);
+        if(ec) {
+            running = false;
+            return;
+        }
+        setOptions();
+        printf("button reconnected\n");
+    }
 
-    QtConcurrent::run([this]() {
-        char button_state;
-        int num;
+    reader = std::thread([this]() {
+        ThreadTopology::enter(ThreadTopology::INPUT);
 
+        char button_state;
         while(running){
-            num = read(port,buffer(&button_state,1));
+            pollfd fd = { port.native_handle(), POLLIN, 0 };
+            if(poll(&fd, 1, POLL_MS) <= 0) {
+                continue;
+            }
+            boost::system::error_code ec;
+            read(port, buffer(&button_state, 1), ec);
+            if(ec) {
+                fprintf(stderr, "reading the button failed: %s\n", ec.message().c_str());
+                Metrics::instance().count("button.read_errors");
+                boost::system::error_code ignored;
+                port.close(ignored);
+                // so that run() starts over
+                running = false;
+                break;
+            }
             if(button_state == '1') {
                 emit buttonPressed();
             }
@@ -49,6 +93,9 @@ void ArduinoButton::run()
 void ArduinoButton::stop()
 {
     running = false;
+    if(reader.joinable()) {
+        reader.join();
+    }
 }
 
 #include "moc_arduino_button.cpp"
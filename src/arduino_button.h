@@ -3,6 +3,8 @@
 
 #include <QObject>
 #include <boost/asio.hpp>
+#include <atomic>
+#include <thread>
 
 class ArduinoButton : public QObject
 {
@@ -12,17 +14,23 @@ public:
     ArduinoButton();
     ~ArduinoButton();
 
+    /* reads the button on a thread of its own, see ThreadTopology::INPUT;
+     * after a read error (unplugged) the thread ends and run() opens the port again */
     void run();
     void stop();
 
 signals:
     void buttonPressed();
 
+private:
+    void setOptions();
+
 private:
     boost::asio::io_service io;
     boost::asio::serial_port port;
 
-    bool running;
+    std::atomic<bool> running;
+    std::thread reader;
 };
 
 #endif // ARDUINOBUTTON_H
@@ -0,0 +1,56 @@
+#include "blur_check.h"
+
+#include "image_ops.h"
+
+#include <algorithm>
+
+namespace {
+/* the luma plane is reduced to about this width, independent of the camera */
+const int SCORE_WIDTH = 640;
+
+/* captures below this fraction of the typical score are considered blurred */
+const double RELATIVE_THRESHOLD = 0.4;
+/* until enough captures have been seen, use an absolute threshold */
+const std::size_t MIN_HISTORY = 3;
+const std::size_t MAX_HISTORY = 15;
+const double ABSOLUTE_THRESHOLD = 20.0;
+}
+
+BlurCheck::BlurCheck()
+{
+}
+
+double BlurCheck::score(const QImage& image)
+{
+    if(image.isNull()) {
+        return 0.0;
+    }
+
+    int factor = std::max(1, image.width() / SCORE_WIDTH);
+    int width = image.width() / factor;
+    int height = image.height() / factor;
+    luma.resize(width * height);
+    image_ops::downscaleLuma(ImageView(image), factor, luma.data(), width);
+
+    // the borders are often out of focus on purpose
+    ImageView view(luma.data(), width, height, width, QImage::Format_Grayscale8);
+    return image_ops::sharpness(view, width / 8, height / 8, width * 3 / 4, height * 3 / 4);
+}
+
+bool BlurCheck::isBlurred(double score)
+{
+    bool blurred;
+    if(recent.size() < MIN_HISTORY) {
+        blurred = score < ABSOLUTE_THRESHOLD;
+    } else {
+        std::vector<double> sorted(recent.begin(), recent.end());
+        std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+        blurred = score < RELATIVE_THRESHOLD * sorted[sorted.size() / 2];
+    }
+
+    recent.push_back(score);
+    if(recent.size() > MAX_HISTORY) {
+        recent.pop_front();
+    }
+    return blurred;
+}
@@ -0,0 +1,33 @@
+#ifndef BLUR_CHECK_H
+#define BLUR_CHECK_H
+
+#include <QImage>
+#include <deque>
+#include <vector>
+
+/*
+ * Tells blurred captures (guests moving, missed focus) from good ones
+ * right after the picture is shown, usually on the small preview from the camera.
+ *
+ * The score is the variance of the Laplacian on a small luma plane,
+ * so a capture costs a few milliseconds.
+ * Absolute sharpness depends a lot on the scene, so a capture is judged
+ * against the recent captures of the same event once there are some.
+ */
+class BlurCheck
+{
+public:
+    BlurCheck();
+
+    /* sharpness score of a capture, 0 for an empty image */
+    double score(const QImage& image);
+
+    /* whether the score is clearly worse than what we usually get, remembers the score */
+    bool isBlurred(double score);
+
+private:
+    std::deque<double> recent;
+    std::vector<unsigned char> luma;
+};
+
+#endif // BLUR_CHECK_H
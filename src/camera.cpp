@@ -1,25 +1,162 @@
 #include "camera.h"
+#include "preview_ring.h"
+#include "frame_pacer.h"
+#include "image_ops.h"
+#include "camera_config.h"
+#include "metrics.h"
+#include "chroma_key.h"
+#include "color_filter.h"
+#include "image_cache.h"
+#include "jpeg_decoder.h"
+#include "raw_preview.h"
+#include "thread_topology.h"
 
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <QImage>
+#include <QSettings>
+#include <QTransform>
 #include <jpeglib.h>
 
 #include <iostream>
 #include <iomanip>
 #include <ctime>
 #include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <vector>
 
 #include <libraw/libraw.h>
 
 namespace {
 
+/* what a camera event looks like in a trace: the type and, for unknown events, their text */
+std::vector<char> event_payload(CameraEventType type, void* data)
+{
+    std::vector<char> payload(sizeof(int32_t));
+    int32_t value = type;
+    std::memcpy(payload.data(), &value, sizeof(value));
+    if(type == GP_EVENT_UNKNOWN && data) {
+        const char* text = (const char*) data;
+        payload.insert(payload.end(), text, text + strlen(text) + 1);
+    }
+    return payload;
+}
+
+void replay_event(const std::vector<char>& payload, CameraEventType& type, void*& data)
+{
+    type = GP_EVENT_TIMEOUT;
+    data = NULL;
+    if(payload.size() < sizeof(int32_t)) {
+        return;
+    }
+    int32_t value;
+    std::memcpy(&value, payload.data(), sizeof(value));
+    type = CameraEventType(value);
+    if(payload.size() > sizeof(int32_t)) {
+        data = strdup(payload.data() + sizeof(int32_t));
+    }
+}
+
+#ifdef JCS_EXTENSIONS
+/* the pixel format of the screen, QPixmap::fromImage() takes it as it is */
+const QImage::Format PREVIEW_FORMAT = QImage::Format_RGB32;
+#else
+const QImage::Format PREVIEW_FORMAT = QImage::Format_RGB888;
+#endif
+/* the guests see the live view like a mirror */
+const bool PREVIEW_MIRRORED = true;
+
+/* a part of a raw file takes about 20 ms on USB 2, the live view waits no longer than that */
+const uint64_t DOWNLOAD_PART_BYTES = 512 * 1024;
+/* smaller previews, like the 160x120 ones of some bodies, are not shown for review */
+const int MIN_REVIEW_PREVIEW_WIDTH = 640;
+/* a capture has this suffix until it is complete, the gallery and the export leave it alone */
+const std::string PART_SUFFIX = ".part";
+
+/* what upright means for an EXIF orientation */
+QTransform orientation_transform(int orientation)
+{
+    QTransform transform;
+    switch(orientation) {
+    case 2:
+        return transform.scale(-1, 1);
+    case 3:
+        return transform.rotate(180);
+    case 4:
+        return transform.scale(1, -1);
+    case 5:
+        return transform.rotate(90).scale(1, -1);
+    case 6:
+        return transform.rotate(90);
+    case 7:
+        return transform.rotate(270).scale(1, -1);
+    case 8:
+        return transform.rotate(270);
+    default:
+        return transform;
+    }
+}
+
+/*
+ * For raw formats that are not TIFF inside: LibRaw reads the thumbnail only,
+ * unpack() and the development of the sensor data are for when a developed picture is wanted.
+ */
+bool libraw_thumbnail(const std::string& file, const std::string& thumb)
+{
+    LibRaw processor;
+    int ret = processor.open_file(file.c_str());
+    if(ret != LIBRAW_SUCCESS) {
+        fprintf(stderr, "Cannot open %s: %s\n", file.c_str(), libraw_strerror(ret));
+        return false;
+    }
+    ret = processor.unpack_thumb();
+    if(ret != LIBRAW_SUCCESS) {
+        fprintf(stderr, "Cannot unpack_thumb %s: %s\n", file.c_str(), libraw_strerror(ret));
+        return false;
+    }
+    if(processor.imgdata.thumbnail.tformat != LIBRAW_THUMBNAIL_JPEG) {
+        fprintf(stderr, "the thumbnail of %s is no JPEG\n", file.c_str());
+        return false;
+    }
+    ret = processor.dcraw_thumb_writer(thumb.c_str());
+    if(ret != LIBRAW_SUCCESS) {
+        fprintf(stderr, "Cannot write %s: %s\n", thumb.c_str(), libraw_strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+bool write_all(int fd, const char* data, std::size_t size)
+{
+    while(size > 0) {
+        ssize_t n = write(fd, data, size);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* where the last working camera model and port are remembered */
+const char* SETTINGS_ORGANIZATION = "photobox";
+const char* SETTINGS_APPLICATION = "photobox";
+
 static void
 ctx_error_func (GPContext *context, const char *str, void *data)
 {
@@ -68,146 +205,6 @@ capture_to_file(Camera *canon, GPContext *canoncontext, char *fn) {
 }
 
 
-/*
- * This function looks up a label or key entry of
- * a configuration widget.
- * The functions descend recursively, so you can just
- * specify the last component.
- */
-
-static int
-_lookup_widget(CameraWidget*widget, const char *key, CameraWidget **child) {
-    int ret;
-    ret = gp_widget_get_child_by_name (widget, key, child);
-    if (ret < GP_OK)
-        ret = gp_widget_get_child_by_label (widget, key, child);
-    return ret;
-}
-
-/* Gets a string configuration value.
- * This can be:
- *  - A Text widget
- *  - The current selection of a Radio Button choice
- *  - The current selection of a Menu choice
- *
- * Sample (for Canons eg):
- *   get_config_value_string (camera, "owner", &ownerstr, context);
- */
-int
-get_config_value_string (Camera *camera, const char *key, char **str, GPContext *context) {
-    CameraWidget		*widget = NULL, *child = NULL;
-    CameraWidgetType	type;
-    int			ret;
-    char			*val;
-
-    ret = gp_camera_get_config (camera, &widget, context);
-    if (ret < GP_OK) {
-        fprintf (stderr, "camera_get_config failed: %d\n", ret);
-        return ret;
-    }
-    ret = _lookup_widget (widget, key, &child);
-    if (ret < GP_OK) {
-        fprintf (stderr, "lookup widget failed: %d\n", ret);
-        goto out;
-    }
-
-    /* This type check is optional, if you know what type the label
-         * has already. If you are not sure, better check. */
-    ret = gp_widget_get_type (child, &type);
-    if (ret < GP_OK) {
-        fprintf (stderr, "widget get type failed: %d\n", ret);
-        goto out;
-    }
-    switch (type) {
-    case GP_WIDGET_MENU:
-    case GP_WIDGET_RADIO:
-    case GP_WIDGET_TEXT:
-        break;
-    default:
-        fprintf (stderr, "widget has bad type %d\n", type);
-        ret = GP_ERROR_BAD_PARAMETERS;
-        goto out;
-    }
-
-    /* This is the actual query call. Note that we just
-         * a pointer reference to the string, not a copy... */
-    ret = gp_widget_get_value (child, &val);
-    if (ret < GP_OK) {
-        fprintf (stderr, "could not query widget value: %d\n", ret);
-        goto out;
-    }
-    /* Create a new copy for our caller. */
-    *str = strdup (val);
-out:
-    gp_widget_free (widget);
-    return ret;
-}
-
-
-/* Sets a string configuration value.
- * This can set for:
- *  - A Text widget
- *  - The current selection of a Radio Button choice
- *  - The current selection of a Menu choice
- *
- * Sample (for Canons eg):
- *   get_config_value_string (camera, "owner", &ownerstr, context);
- */
-int
-set_config_value_string (Camera *camera, const char *key, const char *val, GPContext *context) {
-    CameraWidget		*widget = NULL, *child = NULL;
-    CameraWidgetType	type;
-    int			ret;
-
-    ret = gp_camera_get_config (camera, &widget, context);
-    if (ret < GP_OK) {
-        fprintf (stderr, "camera_get_config failed: %d\n", ret);
-        return ret;
-    }
-    ret = _lookup_widget (widget, key, &child);
-    if (ret < GP_OK) {
-        fprintf (stderr, "lookup widget failed: %d\n", ret);
-        goto out;
-    }
-
-    /* This type check is optional, if you know what type the label
-         * has already. If you are not sure, better check. */
-    ret = gp_widget_get_type (child, &type);
-    if (ret < GP_OK) {
-        fprintf (stderr, "widget get type failed: %d\n", ret);
-        goto out;
-    }
-    switch (type) {
-    case GP_WIDGET_MENU:
-    case GP_WIDGET_RADIO:
-    case GP_WIDGET_TEXT:
-        break;
-    default:
-        fprintf (stderr, "widget has bad type %d\n", type);
-        ret = GP_ERROR_BAD_PARAMETERS;
-        goto out;
-    }
-
-    /* This is the actual set call. Note that we keep
-         * ownership of the string and have to free it if necessary.
-         */
-    ret = gp_widget_set_value (child, val);
-    if (ret < GP_OK) {
-        fprintf (stderr, "could not set widget value: %d\n", ret);
-        goto out;
-    }
-    /* This stores it on the camera again */
-    ret = gp_camera_set_config (camera, widget, context);
-    if (ret < GP_OK) {
-        fprintf (stderr, "camera_set_config failed: %d\n", ret);
-        return ret;
-    }
-out:
-    gp_widget_free (widget);
-    return ret;
-}
-
-
 /*
  * This enables/disables the specific canon capture mode.
  *
@@ -215,105 +212,37 @@ out:
  * with an error (but without negative effects).
  */
 int
-canon_enable_capture (Camera *camera, int onoff, GPContext *context) {
-    CameraWidget		*widget = NULL, *child = NULL;
-    CameraWidgetType	type;
-    int			ret;
-
-    ret = gp_camera_get_config (camera, &widget, context);
-    if (ret < GP_OK) {
-        fprintf (stderr, "camera_get_config failed: %d\n", ret);
-        return ret;
+canon_enable_capture (CameraConfig& config, int onoff) {
+    if (config.lookup ("capture") == NULL) {
+        return GP_ERROR_NOT_SUPPORTED;
     }
-    ret = _lookup_widget (widget, "capture", &child);
-    if (ret < GP_OK) {
-        /*fprintf (stderr, "lookup widget failed: %d\n", ret);*/
-        goto out;
-    }
-
-    ret = gp_widget_get_type (child, &type);
+    int ret = config.setToggle ("capture", onoff);
     if (ret < GP_OK) {
-        fprintf (stderr, "widget get type failed: %d\n", ret);
-        goto out;
-    }
-    switch (type) {
-    case GP_WIDGET_TOGGLE:
-        break;
-    default:
-        fprintf (stderr, "widget has bad type %d\n", type);
-        ret = GP_ERROR_BAD_PARAMETERS;
-        goto out;
-    }
-    /* Now set the toggle to the wanted value */
-    ret = gp_widget_set_value (child, &onoff);
-    if (ret < GP_OK) {
-        fprintf (stderr, "toggling Canon capture to %d failed with %d\n", onoff, ret);
-        goto out;
-    }
-    /* OK */
-    ret = gp_camera_set_config (camera, widget, context);
-    if (ret < GP_OK) {
-        fprintf (stderr, "camera_set_config failed: %d\n", ret);
         return ret;
     }
-out:
-    gp_widget_free (widget);
-    return ret;
+    return config.commit ();
 }
 
 
 /* calls the Nikon DSLR or Canon DSLR autofocus method. */
 int
-camera_auto_focus(Camera *camera, GPContext *context) {
-    CameraWidget		*widget = NULL, *child = NULL;
-    CameraWidgetType	type;
-    int			ret,val;
+camera_auto_focus(CameraConfig& config) {
+    int ret, val;
 
-    ret = gp_camera_get_config (camera, &widget, context);
-    if (ret < GP_OK) {
-        fprintf (stderr, "camera_get_config failed: %d\n", ret);
-        return ret;
-    }
-    ret = _lookup_widget (widget, "autofocusdrive", &child);
+    ret = config.getToggle ("autofocusdrive", val);
     if (ret < GP_OK) {
         fprintf (stderr, "lookup 'autofocusdrive' failed: %d\n", ret);
-        goto out;
-    }
-
-    /* check that this is a toggle */
-    ret = gp_widget_get_type (child, &type);
-    if (ret < GP_OK) {
-        fprintf (stderr, "widget get type failed: %d\n", ret);
-        goto out;
-    }
-    switch (type) {
-    case GP_WIDGET_TOGGLE:
-        break;
-    default:
-        fprintf (stderr, "widget has bad type %d\n", type);
-        ret = GP_ERROR_BAD_PARAMETERS;
-        goto out;
-    }
-
-    ret = gp_widget_get_value (child, &val);
-    if (ret < GP_OK) {
-        fprintf (stderr, "could not get widget value: %d\n", ret);
-        goto out;
+        return ret;
     }
     val++;
-    ret = gp_widget_set_value (child, &val);
+    ret = config.setToggle ("autofocusdrive", val);
     if (ret < GP_OK) {
-        fprintf (stderr, "could not set widget value to 1: %d\n", ret);
-        goto out;
+        return ret;
     }
-
-    ret = gp_camera_set_config (camera, widget, context);
+    ret = config.commit ();
     if (ret < GP_OK) {
         fprintf (stderr, "could not set config tree to autofocus: %d\n", ret);
-        goto out;
     }
-out:
-    gp_widget_free (widget);
     return ret;
 }
 
@@ -322,60 +251,40 @@ out:
  * xx is -3 / -2 / -1 / 0 / 1 / 2 / 3
  */
 int
-camera_manual_focus (Camera *camera, int xx, GPContext *context) {
-    CameraWidget		*widget = NULL, *child = NULL;
+camera_manual_focus (CameraConfig& config, int xx) {
+    CameraWidget		*child = NULL;
     CameraWidgetType	type;
     int			ret;
     float			rval;
-    char			*mval;
 
-    ret = gp_camera_get_config (camera, &widget, context);
-    if (ret < GP_OK) {
-        fprintf (stderr, "camera_get_config failed: %d\n", ret);
-        return ret;
-    }
-    ret = _lookup_widget (widget, "manualfocusdrive", &child);
-    if (ret < GP_OK) {
-        fprintf (stderr, "lookup 'manualfocusdrive' failed: %d\n", ret);
-        goto out;
+    child = config.lookup ("manualfocusdrive");
+    if (child == NULL) {
+        fprintf (stderr, "lookup 'manualfocusdrive' failed\n");
+        return GP_ERROR_NOT_SUPPORTED;
     }
 
-    /* check that this is a toggle */
     ret = gp_widget_get_type (child, &type);
     if (ret < GP_OK) {
         fprintf (stderr, "widget get type failed: %d\n", ret);
-        goto out;
+        return ret;
     }
     switch (type) {
     case GP_WIDGET_RADIO: {
         int choices = gp_widget_count_choices (child);
 
-        ret = gp_widget_get_value (child, &mval);
-        if (ret < GP_OK) {
-            fprintf (stderr, "could not get widget value: %d\n", ret);
-            goto out;
-        }
         if (choices == 7) { /* see what Canon has in EOS_MFDrive */
-            ret = gp_widget_get_choice (child, xx+4, (const char**)&mval);
-            if (ret < GP_OK) {
-                fprintf (stderr, "could not get widget choice %d: %d\n", xx+2, ret);
-                goto out;
-            }
-        }
-        ret = gp_widget_set_value (child, mval);
-        if (ret < GP_OK) {
-            fprintf (stderr, "could not set widget value to 1: %d\n", ret);
-            goto out;
+            /* Near 1, Near 2, Near 3, None, Far 1, Far 2, Far 3 */
+            ret = config.setChoice ("manualfocusdrive", xx < 0 ? -xx-1 : xx+3);
+        } else {
+            /* re-send the current value */
+            std::string mval;
+            ret = config.getString ("manualfocusdrive", mval);
+            if (ret >= GP_OK)
+                ret = config.setString ("manualfocusdrive", mval);
         }
         break;
     }
     case GP_WIDGET_RANGE:
-        ret = gp_widget_get_value (child, &rval);
-        if (ret < GP_OK) {
-            fprintf (stderr, "could not get widget value: %d\n", ret);
-            goto out;
-        }
-
         switch (xx) { /* Range is on Nikon from -32768 <-> 32768 */
         case -3:	rval = -1024;break;
         case -2:	rval =  -512;break;
@@ -390,26 +299,20 @@ camera_manual_focus (Camera *camera, int xx, GPContext *context) {
 
         fprintf(stderr,"manual focus %d -> %f\n", xx, rval);
 
-        ret = gp_widget_set_value (child, &rval);
-        if (ret < GP_OK) {
-            fprintf (stderr, "could not set widget value to 1: %d\n", ret);
-            goto out;
-        }
+        ret = config.setRange ("manualfocusdrive", rval);
         break;
     default:
         fprintf (stderr, "widget has bad type %d\n", type);
-        ret = GP_ERROR_BAD_PARAMETERS;
-        goto out;
+        return GP_ERROR_BAD_PARAMETERS;
+    }
+    if (ret < GP_OK) {
+        return ret;
     }
 
-
-    ret = gp_camera_set_config (camera, widget, context);
+    ret = config.commit ();
     if (ret < GP_OK) {
-        fprintf (stderr, "could not set config tree to autofocus: %d\n", ret);
-        goto out;
+        fprintf (stderr, "could not set config tree to manual focus: %d\n", ret);
     }
-out:
-    gp_widget_free (widget);
     return ret;
 }
 
@@ -418,8 +321,19 @@ out:
 
 
 EOSCamera::EOSCamera(const std::string& output_dir)
-    : output_directory(output_dir)
+    : output_directory(output_dir), preview_ring(nullptr), frame_pacer(nullptr), chroma_key(nullptr), color_filter(nullptr),
+      image_cache(nullptr), display_width(0), display_height(0),
+      capture_prepared(false), last_orientation(1), last_sharpness(0), last_preview_file(nullptr),
+      processing(ThreadTopology::DECODE)
 {
+    download.active = false;
+    download.in_parts = false;
+    download.preview_shown = false;
+    download.fd = -1;
+    download.offset = 0;
+    download.size = 0;
+    download.transfer_ms = 0;
+
     canoncontext = gp_context_new();
     gp_context_set_error_func (canoncontext, ctx_error_func, NULL);
     gp_context_set_status_func (canoncontext, ctx_status_func, NULL);
@@ -428,35 +342,240 @@ EOSCamera::EOSCamera(const std::string& output_dir)
     gp_log_add_func(GP_LOG_ERROR, errordumper, NULL);
     gp_camera_new(&canon);
 
+    config = new CameraConfig(canon, canoncontext, camera_trace);
+}
+
+bool EOSCamera::init()
+{
+    Stopwatch init_time;
+
+    QSettings settings(SETTINGS_ORGANIZATION, SETTINGS_APPLICATION);
+    std::string model = settings.value("camera/model").toString().toStdString();
+    std::string port = settings.value("camera/port").toString().toStdString();
+
     /* When I set GP_LOG_DEBUG instead of GP_LOG_ERROR above, I noticed that the
      * init function seems to traverse the entire filesystem on the camera.  This
      * is partly why it takes so long.
      * (Marcus: the ptp2 driver does this by default currently.)
+     * Knowing model and port at least saves probing every driver and every port.
      */
-    printf("Camera init.  Takes about 10 seconds.\n");
-    int retval = gp_camera_init(canon, canoncontext);
+    // a replay has no camera to detect
+    bool replay = camera_trace.isReplaying();
+    bool cached = !replay && !model.empty() && !port.empty() && useCachedCamera(model, port);
+    if(cached) {
+        printf("Camera init (%s at %s).\n", model.c_str(), port.c_str());
+    } else {
+        printf("Camera init.  Takes about 10 seconds.\n");
+    }
+    int retval = openSession();
+
+    if (retval != GP_OK && cached) {
+        // another camera, or the same one on another USB port: start over and detect it
+        printf("  Retval: %d, detecting the camera\n", retval);
+        Metrics::instance().count("startup.camera_cache_stale");
+        settings.remove("camera");
+        delete config;
+        gp_camera_free(canon);
+        gp_camera_new(&canon);
+        config = new CameraConfig(canon, canoncontext, camera_trace);
+        cached = false;
+        retval = openSession();
+    }
     if (retval != GP_OK) {
         printf("  Retval: %d\n", retval);
-        exit (1);
+        Metrics::instance().count("camera.errors.init");
+        return false;
+    }
+
+    if(!cached && !replay) {
+        CameraAbilities abilities;
+        GPPortInfo info;
+        char* path = nullptr;
+        if(gp_camera_get_abilities(canon, &abilities) == GP_OK &&
+                gp_camera_get_port_info(canon, &info) == GP_OK &&
+                gp_port_info_get_path(info, &path) == GP_OK) {
+            settings.setValue("camera/model", QString::fromStdString(abilities.model));
+            settings.setValue("camera/port", QString::fromStdString(path));
+        }
+    }
+
+    canon_enable_capture(*config, TRUE);
+
+    double ms = init_time.elapsedMs();
+    Metrics::instance().sample("startup.camera_init_ms", ms);
+    printf("Camera ready after %.0f ms.\n", ms);
+    supervisor.connectionRestored();
+    return true;
+}
+
+bool EOSCamera::reconnect()
+{
+    // the old session is unusable, start from a fresh camera object
+    if(last_preview_file) {
+        gp_file_unref(last_preview_file);
+        last_preview_file = nullptr;
+    }
+    capture_prepared = false;
+    closeSession();
+    delete config;
+    gp_camera_free(canon);
+    gp_camera_new(&canon);
+    config = new CameraConfig(canon, canoncontext, camera_trace);
+    return init();
+}
+
+bool EOSCamera::isConnected() const
+{
+    return supervisor.isConnected();
+}
+
+int EOSCamera::openSession()
+{
+    return camera_trace.call(CameraTrace::INIT, [this]() {
+        return gp_camera_init(canon, canoncontext);
+    });
+}
+
+void EOSCamera::closeSession()
+{
+    camera_trace.call(CameraTrace::EXIT, [this]() {
+        return gp_camera_exit(canon, canoncontext);
+    });
+}
+
+bool EOSCamera::useCachedCamera(const std::string& model, const std::string& port)
+{
+    bool ok = false;
+
+    CameraAbilitiesList* abilities_list = nullptr;
+    if(gp_abilities_list_new(&abilities_list) == GP_OK &&
+            gp_abilities_list_load(abilities_list, canoncontext) == GP_OK) {
+        int index = gp_abilities_list_lookup_model(abilities_list, model.c_str());
+        CameraAbilities abilities;
+        ok = index >= 0 && gp_abilities_list_get_abilities(abilities_list, index, &abilities) == GP_OK &&
+                gp_camera_set_abilities(canon, abilities) == GP_OK;
+    }
+    if(abilities_list) {
+        gp_abilities_list_free(abilities_list);
+    }
+    if(!ok) {
+        return false;
+    }
+
+    ok = false;
+    GPPortInfoList* port_list = nullptr;
+    if(gp_port_info_list_new(&port_list) == GP_OK && gp_port_info_list_load(port_list) >= GP_OK) {
+        int index = gp_port_info_list_lookup_path(port_list, port.c_str());
+        GPPortInfo info;
+        ok = index >= 0 && gp_port_info_list_get_info(port_list, index, &info) == GP_OK &&
+                gp_camera_set_port_info(canon, info) == GP_OK;
+    }
+    if(port_list) {
+        gp_port_info_list_free(port_list);
     }
-    canon_enable_capture(canon, TRUE, canoncontext);
+    return ok;
 }
 
 EOSCamera::~EOSCamera()
 {
-    gp_camera_exit(canon, canoncontext);
+    if(download.fd >= 0) {
+        close(download.fd);
+    }
+    if(last_preview_file) {
+        gp_file_unref(last_preview_file);
+    }
+    delete config;
+    closeSession();
+    camera_trace.close();
 }
 
-void EOSCamera::autoFocus()
+CameraConfig& EOSCamera::configuration()
 {
-    CameraEventType evttype;
-    void    	*evtdata;
+    return *config;
+}
 
+CameraTrace& EOSCamera::trace()
+{
+    return camera_trace;
+}
+
+int EOSCamera::applySettings(const std::map<std::string, std::string>& settings)
+{
+    for(const auto& setting : settings) {
+        int ret = config->setString(setting.first, setting.second);
+        if(ret < GP_OK) {
+            fprintf(stderr, "cannot set %s to %s: %d\n", setting.first.c_str(), setting.second.c_str(), ret);
+        }
+    }
+    return config->commit();
+}
+
+void EOSCamera::handleEvents()
+{
+    CameraEventType evttype;
+    void *evtdata;
 
     int retval;
     do {
-        retval = gp_camera_wait_for_event (canon, 10, &evttype, &evtdata, canoncontext);
+        evtdata = NULL;
+        retval = camera_trace.call(CameraTrace::WAIT_FOR_EVENT, [&]() {
+            return gp_camera_wait_for_event (canon, 0, &evttype, &evtdata, canoncontext);
+        });
+        if(retval != GP_OK) {
+            break;
+        }
+        if(camera_trace.mode() == CameraTrace::RECORD) {
+            std::vector<char> event = event_payload(evttype, evtdata);
+            camera_trace.setPayload(event.data(), event.size());
+        } else if(camera_trace.isReplaying()) {
+            replay_event(camera_trace.payload(), evttype, evtdata);
+        }
+        if (retval == GP_OK && evttype == GP_EVENT_UNKNOWN && evtdata &&
+                strstr((const char*) evtdata, "Property") != NULL) {
+            /* e.g. "PTP Property d102 changed", our cached values are stale */
+            config->invalidate();
+            Metrics::instance().count("config.invalidations");
+        }
+        free(evtdata);
     } while ((retval == GP_OK) && (evttype != GP_EVENT_TIMEOUT));
+    supervisor.check("gp_camera_wait_for_event", retval);
+}
+
+void EOSCamera::setPreviewRing(PreviewRing* ring)
+{
+    preview_ring = ring;
+}
+
+void EOSCamera::setFramePacer(FramePacer* pacer)
+{
+    frame_pacer = pacer;
+}
+
+void EOSCamera::setChromaKey(ChromaKey* key)
+{
+    chroma_key = key;
+}
+
+void EOSCamera::setColorFilter(ColorFilter* filter)
+{
+    color_filter = filter;
+}
+
+void EOSCamera::setDisplaySize(int width, int height)
+{
+    display_width = width;
+    display_height = height;
+}
+
+void EOSCamera::setImageCache(ImageCache* cache)
+{
+    image_cache = cache;
+}
+
+void EOSCamera::autoFocus()
+{
+    // recorded and supervised like every other call to the camera
+    handleEvents();
 
     //    retval = gp_file_new(&file);
     //    if (retval != GP_OK) {
@@ -468,25 +587,76 @@ void EOSCamera::autoFocus()
 
 
     //    if (i%10 == 9) {
-    //camera_auto_focus (canon, canoncontext);
+    //camera_auto_focus (*config);
     //    } else {
-    //        camera_manual_focus (canon, (i/10-5)/2, canoncontext);
+    //        camera_manual_focus (*config, (i/10-5)/2);
     //    }
 }
 
-void EOSCamera::takePicture()
+bool EOSCamera::prepareCapture(bool auto_focus)
 {
+    if(!isConnected()) {
+        return false;
+    }
     printf("Enabling camera capture.\n");
-    gp_camera_exit(canon, canoncontext);
-    int retval = gp_camera_init(canon, canoncontext);
+    config->invalidate();
+    closeSession();
+    int retval = supervisor.call("gp_camera_init", [this]() {
+        return openSession();
+    });
     if (retval != GP_OK) {
-        printf("  Retval: %d\n", retval);
-        exit (1);
+        // the session was closed above, whatever the error
+        supervisor.connectionLost();
+        return false;
     }
-    canon_enable_capture(canon, TRUE, canoncontext);
+    canon_enable_capture(*config, TRUE);
 
+    if(auto_focus) {
+        camera_auto_focus(*config);
+    }
+
+    capture_prepared = true;
+    return true;
+}
+
+void EOSCamera::manualFocus(int step)
+{
+    camera_manual_focus(*config, step);
+}
+
+double EOSCamera::lastSharpness() const
+{
+    return last_sharpness;
+}
+
+const Histogram& EOSCamera::lastHistogram() const
+{
+    return last_histogram;
+}
+
+bool EOSCamera::isCapturePrepared() const
+{
+    return capture_prepared;
+}
+
+std::chrono::steady_clock::time_point EOSCamera::lastShutterTime() const
+{
+    return last_shutter_time;
+}
+
+bool EOSCamera::takePicture()
+{
+    if(download.active) {
+        // the previous picture is not on the disk yet, it comes first
+        finishDownload();
+    }
+    if(!capture_prepared && !prepareCapture(false)) {
+        return false;
+    }
+    capture_prepared = false;
+
+    int retval;
     int fd;
-    CameraFile *canonfile;
     CameraFilePath camera_file_path;
 
     CameraEventType evttype;
@@ -504,8 +674,20 @@ void EOSCamera::takePicture()
     strcpy(camera_file_path.folder, "/");
     strcpy(camera_file_path.name, "foo.jpg");
 
-    retval = gp_camera_capture(canon, GP_CAPTURE_IMAGE, &camera_file_path, canoncontext);
+    last_shutter_time = std::chrono::steady_clock::now();
+    // the shutter may already have fired when the driver reports an error, so no retries
+    retval = supervisor.check("gp_camera_capture", camera_trace.call(CameraTrace::CAPTURE, [&]() {
+        return gp_camera_capture(canon, GP_CAPTURE_IMAGE, &camera_file_path, canoncontext);
+    }));
     printf("  Retval: %d\n", retval);
+    if(retval < GP_OK) {
+        return false;
+    }
+    if(camera_trace.isReplaying() && camera_trace.payload().size() == sizeof(camera_file_path)) {
+        std::memcpy(&camera_file_path, camera_trace.payload().data(), sizeof(camera_file_path));
+    } else {
+        camera_trace.setPayload((const char*) &camera_file_path, sizeof(camera_file_path));
+    }
 
     printf("Pathname on the camera: %s/%s\n", camera_file_path.folder, camera_file_path.name);
     std::cout.flush();
@@ -514,194 +696,557 @@ void EOSCamera::takePicture()
 
     std::string file = output_directory + std::to_string(now) + camera_file_path.name;
     printf("creating file %s\n", file.c_str());
-    fd = open(file.c_str(), O_CREAT | O_WRONLY, 0644);
-    retval = gp_file_new_from_fd(&canonfile, fd);
-    printf("  Retval: %d\n", retval);
-    printf("Downloading file %s\n", file.c_str());
-    retval = gp_camera_file_get(canon, camera_file_path.folder, camera_file_path.name,
-                                GP_FILE_TYPE_NORMAL, canonfile, canoncontext);
-    printf("  Retval: %d\n", retval);
-    std::cout.flush();
-
-    printf("Deleting.\n");
-    std::cout.flush();
+    fd = open((file + PART_SUFFIX).c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "cannot create %s%s: %s\n", file.c_str(), PART_SUFFIX.c_str(), strerror(errno));
+        return false;
+    }
 
-    retval = gp_camera_file_delete(canon, camera_file_path.folder, camera_file_path.name,
-                                   canoncontext);
-    printf("  Retval: %d\n", retval);
-    std::cout.flush();
+    download.active = true;
+    download.in_parts = true;
+    download.path = camera_file_path;
+    download.file = file;
+    download.fd = fd;
+    download.offset = 0;
+    download.size = 0;
+    download.transfer_ms = 0;
+    CameraFileInfo info;
+    if(!camera_trace.isReplaying() &&
+            gp_camera_file_get_info(canon, camera_file_path.folder, camera_file_path.name, &info, canoncontext) == GP_OK &&
+            (info.file.fields & GP_FILE_INFO_SIZE)) {
+        download.size = info.file.size;
+    }
 
-    gp_file_free(canonfile);
+    // the guests see their picture now, the raw file follows between live view frames
+    download.preview_shown = showCameraPreview();
+    if(!download.preview_shown) {
+        // nothing to show until the file is there, so it is fetched at once
+        return finishDownload();
+    }
+    return true;
+}
 
+bool EOSCamera::showCameraPreview()
+{
+    CameraFile* preview;
+    if(gp_file_new(&preview) != GP_OK) {
+        return false;
+    }
+    int retval = supervisor.call("gp_camera_file_get", [&]() {
+        return camera_trace.call(CameraTrace::FILE_PREVIEW, [&]() {
+            return gp_camera_file_get(canon, download.path.folder, download.path.name,
+                                      GP_FILE_TYPE_PREVIEW, preview, canoncontext);
+        });
+    });
+    if(retval == GP_OK && camera_trace.isReplaying()) {
+        // the file takes over the buffer
+        const std::vector<char>& jpeg = camera_trace.payload();
+        char* copy = (char*) malloc(jpeg.size());
+        std::memcpy(copy, jpeg.data(), jpeg.size());
+        retval = gp_file_set_data_and_size(preview, copy, jpeg.size());
+    }
 
-    int  i, ret, verbose=0, output_thumbs=0;
-    char outfn[1024],thumbfn[1024];
+    QImage picture;
+    int orientation = 0;
+    const char* data;
+    unsigned long size;
+    if(retval == GP_OK && gp_file_get_data_and_size(preview, &data, &size) == GP_OK) {
+        camera_trace.setPayload(data, size);
+        picture = jpeg::decode((const unsigned char*) data, size, 1, QImage::Format_RGB32);
+        orientation = raw::jpegOrientation((const unsigned char*) data, size);
+    }
+    gp_file_unref(preview);
+    if(picture.isNull()) {
+        printf("no preview of %s/%s from the camera\n", download.path.folder, download.path.name);
+        Metrics::instance().count("capture.preview_missing");
+        return false;
+    }
+    if(picture.width() < MIN_REVIEW_PREVIEW_WIDTH) {
+        // a thumbnail blown up to the screen looks worse than the frozen live view
+        printf("preview of %s is only %dx%d, waiting for the picture\n", download.path.name,
+               picture.width(), picture.height());
+        Metrics::instance().count("capture.preview_too_small");
+        return false;
+    }
+    // turned like the picture that replaces it; previews without EXIF go by the last capture
+    if(orientation == 0) {
+        orientation = last_orientation;
+    }
+    if(orientation != 1) {
+        picture = picture.transformed(orientation_transform(orientation));
+    }
 
-    // Creation of image processing object
-    LibRaw RawProcessor;
+    // a few hundred pixels wide, keying and filtering cost nothing
+    QImage unkeyed = picture;
+    if(chroma_key && chroma_key->isEnabled()) {
+        picture = chroma_key->apply(picture);
+    }
+    if(color_filter && color_filter->selected() != ColorFilter::NONE) {
+        color_filter->apply(picture);
+    }
+    Metrics::instance().sample("capture.preview_ms", std::chrono::duration<double, std::milli>(
+                                   std::chrono::steady_clock::now() - last_shutter_time).count());
+    emit newImage(picture);
+
+    // while the guests look at the picture, not when the raw file is there;
+    // a sharp background must not hide a blurred person
+    checkBlur(unkeyed);
+    return true;
+}
 
-    // The date in TIFF is written in the local format; let us specify the timezone for compatibility with dcraw
-    putenv ((char*)"TZ=UTC");
+bool EOSCamera::isDownloading() const
+{
+    return download.active;
+}
 
-    // Let us define variables for convenient access to fields of RawProcessor
+bool EOSCamera::downloadStep()
+{
+    if(!download.active) {
+        return false;
+    }
 
-#define P1  RawProcessor.imgdata.idata
-#define S   RawProcessor.imgdata.sizes
-#define C   RawProcessor.imgdata.color
-#define T   RawProcessor.imgdata.thumbnail
-#define P2  RawProcessor.imgdata.other
-#define OUT RawProcessor.imgdata.params
+    Stopwatch part_time;
+    int retval;
+    bool complete = false;
+    if(download.in_parts) {
+        download.buffer.resize(DOWNLOAD_PART_BYTES);
+        uint64_t size = DOWNLOAD_PART_BYTES;
+        // a part can be fetched again, unlike the whole file
+        retval = supervisor.call("gp_camera_file_read", [&]() {
+            return camera_trace.call(CameraTrace::FILE_READ, [&]() {
+                if(download.size > 0 && download.offset >= download.size) {
+                    // the file ended with a full part, the replay needs the short one all the same
+                    return 0;
+                }
+                size = DOWNLOAD_PART_BYTES;
+                if(download.size > 0) {
+                    size = std::min(size, download.size - download.offset);
+                }
+                int result = gp_camera_file_read(canon, download.path.folder, download.path.name, GP_FILE_TYPE_NORMAL,
+                                                 download.offset, download.buffer.data(), &size, canoncontext);
+                return result < GP_OK ? result : int(size);
+            });
+        });
+        if(retval < GP_OK && download.offset == 0 && supervisor.isConnected()) {
+            // drivers without partial reads and traces of older builds give the whole file only
+            printf("gp_camera_file_read: %d, downloading %s in one piece\n", retval, download.path.name);
+            Metrics::instance().count("download.in_one_piece");
+            download.in_parts = false;
+            return downloadStep();
+        }
+        if(retval < GP_OK && download.size == 0 && download.offset % DOWNLOAD_PART_BYTES == 0
+                && supervisor.isConnected()) {
+            // without a known size a file of whole parts ends with a failed read past its end
+            printf("gp_camera_file_read: %d at %llu, taking it as the end of %s\n", retval,
+                   (unsigned long long) download.offset, download.path.name);
+            Metrics::instance().count("download.end_by_error");
+            retval = 0;
+            complete = true;
+            if(camera_trace.isReplaying()) {
+                const std::vector<char>& data = camera_trace.payload();
+                download.offset = data.size();
+                if(!write_all(download.fd, data.data(), data.size())) {
+                    retval = GP_ERROR_IO_WRITE;
+                }
+            }
+        } else if(retval >= GP_OK) {
+            // replayed parts carry no data, the whole file comes with the last one
+            if(!camera_trace.isReplaying() && !write_all(download.fd, download.buffer.data(), retval)) {
+                fprintf(stderr, "cannot write %s: %s\n", download.file.c_str(), strerror(errno));
+                abandonDownload();
+                return false;
+            }
+            download.offset += retval;
+            complete = uint64_t(retval) < DOWNLOAD_PART_BYTES;
+            if(complete && camera_trace.isReplaying()) {
+                const std::vector<char>& data = camera_trace.payload();
+                download.offset = data.size();
+                if(!write_all(download.fd, data.data(), data.size())) {
+                    retval = GP_ERROR_IO_WRITE;
+                }
+            }
+        }
+        Metrics::instance().sample("download.part_ms", part_time.elapsedMs());
+    } else {
+        CameraFile *canonfile;
+        gp_file_new_from_fd(&canonfile, download.fd);
+        printf("Downloading file %s\n", download.file.c_str());
+        // not retried, the part that did arrive is already in the file
+        retval = supervisor.check("gp_camera_file_get", camera_trace.call(CameraTrace::FILE_GET, [&]() {
+            return gp_camera_file_get(canon, download.path.folder, download.path.name,
+                                      GP_FILE_TYPE_NORMAL, canonfile, canoncontext);
+        }));
+        if(retval >= GP_OK && camera_trace.isReplaying()) {
+            const std::vector<char>& data = camera_trace.payload();
+            retval = gp_file_append(canonfile, data.data(), data.size());
+        }
+        printf("  Retval: %d\n", retval);
+        std::cout.flush();
+        // closes the file
+        gp_file_free(canonfile);
+        download.fd = -1;
+        complete = true;
+    }
+    download.transfer_ms += part_time.elapsedMs();
 
-    OUT.output_tiff = 1; // Let us output TIFF
+    if(retval < GP_OK) {
+        if(download.in_parts && !supervisor.isConnected()) {
+            // the picture stays on the card, the next part is fetched after the reconnect
+            return false;
+        }
+        abandonDownload();
+        return false;
+    }
+    if(!complete) {
+        return true;
+    }
 
-    // Let us open the file
-    if( (ret = RawProcessor.open_file(file.c_str())) != LIBRAW_SUCCESS)
-    {
-        fprintf(stderr,"Cannot open %s: %s\n",file.c_str(),libraw_strerror(ret));
+    if(download.fd >= 0) {
+        close(download.fd);
+        download.fd = -1;
+    }
+    if(rename((download.file + PART_SUFFIX).c_str(), download.file.c_str()) != 0) {
+        fprintf(stderr, "cannot rename %s%s: %s\n", download.file.c_str(), PART_SUFFIX.c_str(), strerror(errno));
+        abandonDownload();
+        return false;
+    }
+    if(camera_trace.wantsPayload()) {
+        std::ifstream in(download.file.c_str(), std::ios::binary);
+        std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        camera_trace.setPayload(data.data(), data.size());
+    }
+    struct stat file_stat;
+    if(stat(download.file.c_str(), &file_stat) == 0 && download.transfer_ms > 0) {
+        Metrics::instance().sample("download.mb_per_s", file_stat.st_size / (1024.0 * 1024.0) / (download.transfer_ms / 1000.0));
+    }
+    download.active = false;
+    download.buffer = std::vector<char>();
+    return completeDownload();
+}
 
-        // recycle() is needed only if we want to free the resources right now.
-        // If we process files in a cycle, the next open_file()
-        // will also call recycle(). If a fatal error has happened, it means that recycle()
-        // has already been called (repeated call will not cause any harm either).
+bool EOSCamera::finishDownload()
+{
+    bool ok = true;
+    while(ok && download.active) {
+        ok = downloadStep();
+    }
+    if(download.active) {
+        // the camera is gone, there is no waiting for it here
+        abandonDownload();
+    }
+    return ok;
+}
 
-        RawProcessor.recycle();
-        goto end;
+void EOSCamera::abandonDownload()
+{
+    fprintf(stderr, "giving up on %s/%s, it is still on the camera\n", download.path.folder, download.path.name);
+    Metrics::instance().count("download.failed");
+    if(download.fd >= 0) {
+        close(download.fd);
+        download.fd = -1;
     }
+    unlink((download.file + PART_SUFFIX).c_str());
+    download.active = false;
+    download.buffer = std::vector<char>();
+}
 
-    // Let us unpack the image
-    if( (ret = RawProcessor.unpack() ) != LIBRAW_SUCCESS)
-    {
-        fprintf(stderr,"Cannot unpack_thumb %s: %s\n",file.c_str(),libraw_strerror(ret));
+bool EOSCamera::completeDownload()
+{
+    const std::string file = download.file;
+    const CameraFilePath camera_file_path = download.path;
+    int retval;
 
-        if(LIBRAW_FATAL_ERROR(ret))
-            goto end;
-        // if there has been a non-fatal error, we will try to continue
-    }
-    // Let us unpack the thumbnail
-    if( (ret = RawProcessor.unpack_thumb() ) != LIBRAW_SUCCESS)
+    printf("Deleting.\n");
+    std::cout.flush();
+
+    retval = supervisor.call("gp_camera_file_delete", [&]() {
+        return camera_trace.call(CameraTrace::FILE_DELETE, [&]() {
+            return gp_camera_file_delete(canon, camera_file_path.folder, camera_file_path.name, canoncontext);
+        });
+    });
+    printf("  Retval: %d\n", retval);
+    std::cout.flush();
+
+
+    // the JPEG the camera embedded is all the booth shows, the sensor data is left alone
+    std::shared_ptr<Capture> capture = std::make_shared<Capture>();
+    capture->file = file;
+    capture->thumb = file + ".thumb.jpg";
+    capture->preview_shown = download.preview_shown;
+    capture->shutter_time = last_shutter_time;
     {
-        // error processing is completely similar to the previous case
-        fprintf(stderr,"Cannot unpack_thumb %s: %s\n",file.c_str(),libraw_strerror(ret));
-        if(LIBRAW_FATAL_ERROR(ret))
-            goto end;
+        Stopwatch extract_time;
+        if(!capture->mapping.open(file)) {
+            fprintf(stderr, "cannot read %s: %s\n", file.c_str(), strerror(errno));
+            return false;
+        }
+        raw::Preview& preview = capture->preview;
+        capture->found = raw::findPreview(capture->mapping.data(), capture->mapping.size(), preview);
+        if(!capture->found && capture->mapping.size() > 2 && capture->mapping.data()[0] == 0xff &&
+                capture->mapping.data()[1] == 0xd8) {
+            // the camera is set to JPEG, the capture is the picture
+            preview.data = capture->mapping.data();
+            preview.size = capture->mapping.size();
+            capture->found = true;
+        }
+        if(capture->found) {
+            FILE* out = fopen(capture->thumb.c_str(), "wb");
+            bool written = out && fwrite(preview.data, 1, preview.size, out) == preview.size;
+            if(out) {
+                written = fclose(out) == 0 && written;
+            }
+            if(!written) {
+                fprintf(stderr, "cannot write %s: %s\n", capture->thumb.c_str(), strerror(errno));
+                return false;
+            }
+        } else {
+            // raw formats that are not TIFF inside
+            Metrics::instance().count("capture.extracted_by_libraw");
+            if(!libraw_thumbnail(file, capture->thumb)) {
+                return false;
+            }
+        }
+        Metrics::instance().sample("capture.extract_ms", extract_time.elapsedMs());
     }
-    else // We have successfully unpacked the thumbnail, now let us write it to a file
-    {
-        snprintf(thumbfn,sizeof(thumbfn),"%s.%s",file.c_str(),T.tformat == LIBRAW_THUMBNAIL_JPEG ? "thumb.jpg" : "thumb.ppm");
-        if( LIBRAW_SUCCESS != (ret = RawProcessor.dcraw_thumb_writer(thumbfn)))
-        {
-            fprintf(stderr,"Cannot write %s: %s\n",thumbfn,libraw_strerror(ret));
 
-            // in the case of fatal error, we should terminate processing of the current file
-            if(LIBRAW_FATAL_ERROR(ret))
-                goto end;
-        }
+    printf("Disable camera capture.\n");
+    canon_enable_capture(*config, FALSE);
+
+    if(!capture->preview_shown) {
+        // the guests wait for this picture and the live view is stopped for it anyway
+        return processCapture(*capture);
     }
-    // Data unpacking
-//    ret = RawProcessor.dcraw_process();
+    // the full resolution decode and processing take many live view frames
+    processing.post([this, capture]() {
+        processCapture(*capture);
+    });
+    return true;
+}
 
-//    if(LIBRAW_SUCCESS != ret ) // error at the previous step
-//    {
-//        fprintf(stderr,"Cannot do postprocessing on %s: %s\n",file.c_str(),libraw_strerror(ret));
-//        if(LIBRAW_FATAL_ERROR(ret))
-//            goto end;
-//    }
-//    else  // Successful document processing
-//    {
-//        snprintf(outfn,sizeof(outfn),"%s.%s", file.c_str(), "tiff");
-//        if( LIBRAW_SUCCESS != (ret = RawProcessor.dcraw_ppm_tiff_writer(outfn)))
-//            fprintf(stderr,"Cannot write %s: error %d\n",outfn,ret);
-//    }
+bool EOSCamera::processCapture(const Capture& capture)
+{
+    Stopwatch decode_time;
+    QImage picture = capture.found ? jpeg::decodeParallel(capture.preview.data, capture.preview.size, 1, QImage::Format_RGB32)
+                                   : jpeg::decodeFileParallel(capture.thumb, 1, QImage::Format_RGB32);
+    Metrics::instance().sample("capture.decode_ms", decode_time.elapsedMs());
+    if(picture.isNull()) {
+        fprintf(stderr, "cannot decode the picture of %s\n", capture.file.c_str());
+        return false;
+    }
 
-    // we don't evoke recycle() or call the desctructor; C++ will do everything for us
+    last_orientation = capture.preview.orientation;
+    bool rotated = capture.preview.orientation != 1;
+    if(rotated) {
+        picture = picture.transformed(orientation_transform(capture.preview.orientation));
+    }
+    QImage unkeyed;
+    bool keyed = chroma_key && chroma_key->isEnabled();
+    bool filtered = color_filter && color_filter->selected() != ColorFilter::NONE;
+    if(keyed) {
+        unkeyed = picture;
+        picture = chroma_key->apply(unkeyed);
+    }
+    if(filtered) {
+        color_filter->apply(picture);
+    }
 
-    printf("Disable camera capture.\n");
-    canon_enable_capture(canon, FALSE, canoncontext);
+    // at full resolution a picture costs 70 MB in the GUI queue and again as pixmap
+    QImage on_screen = picture;
+    if(display_width > 0 && (picture.width() > display_width || picture.height() > display_height)) {
+        Stopwatch scale_time;
+        on_screen = picture.scaled(display_width, display_height, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+        Metrics::instance().sample("capture.display_scale_ms", scale_time.elapsedMs());
+    }
+    Metrics::instance().sample("capture.full_ms", std::chrono::duration<double, std::milli>(
+                                   std::chrono::steady_clock::now() - capture.shutter_time).count());
+    if(capture.preview_shown) {
+        emit newFullImage(on_screen);
+    } else {
+        emit newImage(on_screen);
+    }
 
-    {
-        QImage reimport(QString::fromStdString(file + ".thumb.jpg"));
-        emit newImage(reimport);
+    if(keyed || filtered || rotated) {
+        // guests get the processed picture, the raw file keeps the original
+        if(!picture.save(QString::fromStdString(capture.thumb), "JPEG", 95)) {
+            fprintf(stderr, "cannot write processed picture %s\n", capture.thumb.c_str());
+        }
+    }
+    if(image_cache) {
+        image_cache->insert(capture.thumb, on_screen);
+    }
+    emit newImageFile(QString::fromStdString(capture.thumb));
+
+    if(!capture.preview_shown) {
+        // only after the picture is on its way to the screen, and a sharp background must not hide a blurred person
+        checkBlur(keyed ? unkeyed : picture);
+    }
+    return true;
+}
 
+void EOSCamera::checkBlur(const QImage& picture)
+{
+    Stopwatch blur_time;
+    double score = blur_check.score(picture);
+    bool blurred = blur_check.isBlurred(score);
+    Metrics::instance().sample("capture.blur_check_ms", blur_time.elapsedMs());
+    Metrics::instance().sample("capture.sharpness", score);
+    if(blurred) {
+        printf("capture looks blurred (sharpness %.1f)\n", score);
+        Metrics::instance().count("capture.blurred");
+        emit imageBlurred(score);
     }
-    return;
-end:
-    // got here after an error
-    return;
 }
 
-void EOSCamera::takePreviewImage()
+bool EOSCamera::takePreviewImage()
 {
     static int i = 0;
 
     CameraFile *file;
     char output_file[32];
 
+    if(!isConnected()) {
+        return false;
+    }
+
     int retval = gp_file_new(&file);
     if (retval != GP_OK) {
         fprintf(stderr,"gp_file_new: %d\n", retval);
-        exit(1);
+        return false;
     }
 
-    retval = gp_camera_capture_preview(canon, file, canoncontext);
+    retval = supervisor.call("gp_camera_capture_preview", [&]() {
+        return camera_trace.call(CameraTrace::CAPTURE_PREVIEW, [&]() {
+            return gp_camera_capture_preview(canon, file, canoncontext);
+        });
+    });
+    if (retval == GP_OK && camera_trace.isReplaying()) {
+        // the file takes over the buffer
+        const std::vector<char>& jpeg = camera_trace.payload();
+        char* copy = (char*) malloc(jpeg.size());
+        std::memcpy(copy, jpeg.data(), jpeg.size());
+        retval = gp_file_set_data_and_size(file, copy, jpeg.size());
+    }
     if (retval != GP_OK) {
-        fprintf(stderr,"gp_camera_capture_preview: %d\n",retval);
-        exit(1);
+        gp_file_unref(file);
+        return false;
     }
+    auto captured = std::chrono::steady_clock::now();
 
     const char* data;
     unsigned long size;
     gp_file_get_data_and_size(file, &data, &size);
+    camera_trace.setPayload(data, size);
 
     {
-        struct jpeg_decompress_struct cinfo;
-        struct jpeg_error_mgr jerr;
-        JSAMPROW row_pointer[1];
-        int i = 0;
-        int location = 0;
         unsigned char *raw_image = NULL;
+        bool published = false;
+        int width = 0, height = 0, bytes_per_line = 0;
+
+        bool keyed = chroma_key && chroma_key->isEnabled();
+        double key_ms = 0;
+        ColorFilter::Preset filter = color_filter ? color_filter->selected() : ColorFilter::NONE;
+        ImageView view(NULL, 0, 0, 0, PREVIEW_FORMAT);
+
+        Stopwatch decode_time;
+        bool decoded = jpeg::decodeRows((const unsigned char*) data, size, PREVIEW_FORMAT, PREVIEW_MIRRORED,
+                                        [&](int w, int h, int bpl) {
+            width = w;
+            height = h;
+            bytes_per_line = bpl;
+
+            /* Decode straight into the shared preview ring if there is one,
+             * so that other views can pick up the frame without decoding again. */
+            if(preview_ring) {
+                raw_image = preview_ring->beginFrame(width, height, bytes_per_line, PREVIEW_FORMAT);
+            }
+            published = raw_image != NULL;
+            if(!published) {
+                raw_image = (unsigned char*)malloc( bytes_per_line*height );
+            }
 
-        cinfo.err = jpeg_std_error(&jerr);
-
-        jpeg_create_decompress(&cinfo);
-        jpeg_mem_src(&cinfo, (unsigned char *)data, size);
-        jpeg_read_header(&cinfo, TRUE);
-
-        //        printf( "JPEG File Information: \n" );
-        //        printf( "Image width and height: %d pixels and %d pixels.\n", cinfo.image_width, cinfo.image_height );
-        //        printf( "Color components per pixel: %d.\n", cinfo.num_components );
-        //        printf( "Color space: %d.\n", cinfo.jpeg_color_space );
-
-        jpeg_start_decompress( &cinfo );
-
-        raw_image = (unsigned char*)malloc( cinfo.output_width*cinfo.output_height*cinfo.num_components );
-        row_pointer[0] = (unsigned char *)malloc( cinfo.output_width*cinfo.num_components );
-
-        while( cinfo.output_scanline < cinfo.image_height )
-        {
-            jpeg_read_scanlines( &cinfo, row_pointer, 1 );
-            for( i=0; i<cinfo.image_width*cinfo.num_components;i++)
-                raw_image[location++] = row_pointer[0][i];
+            view = ImageView(raw_image, width, height, bytes_per_line, PREVIEW_FORMAT);
+            last_histogram.clear();
+            if(keyed) {
+                chroma_key->prepare(width, height);
+            }
+            return raw_image;
+        }, [&](int y, unsigned char* scanline) {
+            // the exposure is about what the camera sees, so before keying
+            if(y % 2 == 0) {
+                image_ops::accumulateHistogram(view, y, last_histogram);
+            }
+            if(keyed) {
+                Stopwatch key_time;
+                chroma_key->keyRow(view, y, scanline);
+                key_ms += key_time.elapsedMs();
+            }
+            if(filter != ColorFilter::NONE) {
+                color_filter->filterRow(filter, view, scanline);
+            }
+        });
+        if(keyed) {
+            Metrics::instance().sample("chroma_key.frame_ms", key_ms);
         }
 
-        jpeg_finish_decompress(&cinfo);
-        jpeg_destroy_decompress(&cinfo);
-
-        QImage* image = new QImage(raw_image, cinfo.image_width, cinfo.image_height, QImage::Format_RGB888);
+        if(!decoded) {
+            // a corrupt frame, the next one will do
+            Metrics::instance().count("preview.corrupt");
+            if(published) {
+                preview_ring->abortFrame();
+            } else {
+                free(raw_image);
+            }
+        } else {
+            Metrics::instance().sample("preview.decode_ms", decode_time.elapsedMs());
+
+            last_sharpness = image_ops::centerSharpness(view);
+
+            // the pacer and the queued signal keep the frame until the display takes it
+            QImage image;
+            if(published) {
+                // the ring writes the slot again a few frames later
+                image = QImage(raw_image, width, height, bytes_per_line, PREVIEW_FORMAT).copy();
+            } else {
+                // the image takes over the buffer, nothing is copied
+                image = QImage(raw_image, width, height, bytes_per_line, PREVIEW_FORMAT, free, raw_image);
+            }
 
-        emit newPreview(image->copy());
+            if(frame_pacer) {
+                frame_pacer->offer(image, captured);
+            } else {
+                emit newPreview(image);
+            }
 
-        free(row_pointer[0]);
-        free(raw_image);
+            if(published) {
+                preview_ring->setJpeg(data, size);
+                preview_ring->commitFrame();
+            }
+        }
     }
 
 
     sprintf(output_file, "snapshot.jpg");
     retval = gp_file_save(file, output_file);
     if (retval != GP_OK) {
-        fprintf(stderr,"gp_camera_capture_preview: %d\n", retval);
-        exit(1);
+        // only a local copy, the camera is fine
+        fprintf(stderr,"gp_file_save(%s): %d\n", output_file, retval);
+    }
+
+    // keep the JPEG around until the next frame, see lastPreviewJpeg()
+    if(last_preview_file) {
+        gp_file_unref(last_preview_file);
+    }
+    last_preview_file = file;
+    return true;
+}
+
+/* The compressed data of the newest live view frame, valid until the next takePreviewImage(). */
+bool EOSCamera::lastPreviewJpeg(const char*& data, unsigned long& size) const
+{
+    if(last_preview_file == nullptr) {
+        return false;
     }
-    gp_file_unref(file);
+    return gp_file_get_data_and_size(last_preview_file, &data, &size) == GP_OK;
 }
 
 
@@ -724,9 +1269,9 @@ void EOSCamera::testLoop()
 
         /* autofocus every 10 shots */
         if (i%10 == 9) {
-            camera_auto_focus (canon, canoncontext);
+            camera_auto_focus (*config);
         } else {
-            camera_manual_focus (canon, (i/10-5)/2, canoncontext);
+            camera_manual_focus (*config, (i/10-5)/2);
         }
 
         retval = gp_camera_capture_preview(canon, file, canoncontext);
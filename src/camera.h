@@ -2,11 +2,30 @@
 #define CAMERA_H
 
 #include <QObject>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "image_ops.h"
+#include "blur_check.h"
+#include "camera_supervisor.h"
+#include "camera_trace.h"
+#include "raw_preview.h"
+#include "task_thread.h"
 
 extern "C" {
 #include <gphoto2/gphoto2.h>
 }
 
+class PreviewRing;
+class FramePacer;
+class CameraConfig;
+class ChromaKey;
+class ColorFilter;
+class ImageCache;
+
 class EOSCamera : public QObject
 {
     Q_OBJECT
@@ -15,21 +34,126 @@ public:
     EOSCamera(const std::string& output_directory);
     ~EOSCamera();
 
+    /* connects to the camera, with the model and port that worked last time if possible */
+    bool init();
+    /* drops the session and opens the camera again, after it was lost */
+    bool reconnect();
+    bool isConnected() const;
+
+    void setPreviewRing(PreviewRing* ring);
+    /* live view frames go to the pacer instead of newPreview() */
+    void setFramePacer(FramePacer* pacer);
+    void setChromaKey(ChromaKey* key);
+    void setColorFilter(ColorFilter* filter);
+    /* captures are shown and cached at this size instead of full resolution */
+    void setDisplaySize(int width, int height);
+    void setImageCache(ImageCache* cache);
+
+    CameraConfig& configuration();
+    /* records the gphoto2 calls, or replays a recording instead of talking to a camera */
+    CameraTrace& trace();
+    int applySettings(const std::map<std::string, std::string>& settings);
+    void handleEvents();
+
     void testLoop();
 
-    void takePicture();
-    void takePreviewImage();
+    bool prepareCapture(bool auto_focus);
+    bool isCapturePrepared() const;
+
+    /* fires the shutter and shows the camera's small JPEG of the picture, see downloadStep() */
+    bool takePicture();
+    /* the raw file of the last picture is not complete yet */
+    bool isDownloading() const;
+    /* fetches the next part of the raw file, the picture is published with the last one */
+    bool downloadStep();
+    /* fetches the rest of the raw file at once */
+    bool finishDownload();
+    bool takePreviewImage();
+    bool lastPreviewJpeg(const char*& data, unsigned long& size) const;
 
     void autoFocus();
+    void manualFocus(int step);
+
+    double lastSharpness() const;
+    const Histogram& lastHistogram() const;
+
+    std::chrono::steady_clock::time_point lastShutterTime() const;
 
 signals:
     void newPreview(QImage image);
     void newImage(QImage image);
+    /* the full picture, after newImage() showed the camera's small one */
+    void newFullImage(QImage image);
+    void newImageFile(QString path);
+    void imageBlurred(double sharpness);
+
+private:
+    bool useCachedCamera(const std::string& model, const std::string& port);
+    int openSession();
+    void closeSession();
+    bool showCameraPreview();
+    void checkBlur(const QImage& picture);
+    bool completeDownload();
+    void abandonDownload();
+
+    /* a downloaded picture, for decoding and processing away from the camera thread */
+    struct Capture
+    {
+        std::string file;
+        std::string thumb;
+        raw::MappedFile mapping;
+        raw::Preview preview;   // into the mapping
+        bool found;             // otherwise LibRaw wrote the thumb
+        bool preview_shown;
+        std::chrono::steady_clock::time_point shutter_time;
+    };
+    bool processCapture(const Capture& capture);
 
 private:
     const std::string output_directory;
     Camera	*canon;
     GPContext *canoncontext;
+
+    CameraConfig* config;
+
+    PreviewRing* preview_ring;
+    FramePacer* frame_pacer;
+    ChromaKey* chroma_key;
+    ColorFilter* color_filter;
+    ImageCache* image_cache;
+    int display_width;
+    int display_height;
+
+    bool capture_prepared;
+    std::chrono::steady_clock::time_point last_shutter_time;
+    std::atomic<int> last_orientation;  // of the last raw file, the camera's previews may not say
+
+    /* the raw file of the last picture, fetched in parts between live view frames */
+    struct Download
+    {
+        bool active;
+        bool in_parts;
+        bool preview_shown;
+        CameraFilePath path;
+        std::string file;       // written as file.part until it is complete
+        int fd;
+        uint64_t offset;
+        uint64_t size;          // 0 if the camera did not say
+        double transfer_ms;
+        std::vector<char> buffer;
+    };
+    Download download;
+
+    double last_sharpness;
+    Histogram last_histogram;
+    CameraFile* last_preview_file;
+
+    BlurCheck blur_check;
+    CameraSupervisor supervisor;
+    CameraTrace camera_trace;
+
+    // last, so that it is done with the pictures before anything else goes
+    TaskThread processing;
 };
 
 #endif // CAMERA_H
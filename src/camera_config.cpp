@@ -0,0 +1,492 @@
+#include "camera_config.h"
+
+#include "camera_trace.h"
+#include "metrics.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+/* the widget tree as it goes into a camera trace: type, name, label, value, choices, children */
+void put_u32(std::vector<char>& out, uint32_t value)
+{
+    for(int i = 0; i < 4; ++i) {
+        out.push_back(char((value >> (8 * i)) & 0xff));
+    }
+}
+
+void put_string(std::vector<char>& out, const char* text)
+{
+    std::size_t size = text ? strlen(text) : 0;
+    put_u32(out, size);
+    out.insert(out.end(), text, text + size);
+}
+
+void put_float(std::vector<char>& out, float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    put_u32(out, bits);
+}
+
+void serialize(CameraWidget* widget, std::vector<char>& out)
+{
+    CameraWidgetType type = GP_WIDGET_WINDOW;
+    const char* name = NULL;
+    const char* label = NULL;
+    gp_widget_get_type(widget, &type);
+    gp_widget_get_name(widget, &name);
+    gp_widget_get_label(widget, &label);
+
+    out.push_back(char(type));
+    put_string(out, name);
+    put_string(out, label);
+
+    switch(type) {
+    case GP_WIDGET_TEXT:
+    case GP_WIDGET_RADIO:
+    case GP_WIDGET_MENU: {
+        char* value = NULL;
+        gp_widget_get_value(widget, &value);
+        put_string(out, value);
+        if(type != GP_WIDGET_TEXT) {
+            int count = std::max(0, gp_widget_count_choices(widget));
+            put_u32(out, count);
+            for(int i = 0; i < count; ++i) {
+                const char* choice = NULL;
+                gp_widget_get_choice(widget, i, &choice);
+                put_string(out, choice);
+            }
+        }
+        break;
+    }
+    case GP_WIDGET_RANGE: {
+        float value = 0, min = 0, max = 0, step = 0;
+        gp_widget_get_value(widget, &value);
+        gp_widget_get_range(widget, &min, &max, &step);
+        put_float(out, value);
+        put_float(out, min);
+        put_float(out, max);
+        put_float(out, step);
+        break;
+    }
+    case GP_WIDGET_TOGGLE:
+    case GP_WIDGET_DATE: {
+        int value = 0;
+        gp_widget_get_value(widget, &value);
+        put_u32(out, value);
+        break;
+    }
+    default:
+        break;
+    }
+
+    int children = std::max(0, gp_widget_count_children(widget));
+    put_u32(out, children);
+    for(int i = 0; i < children; ++i) {
+        CameraWidget* child = NULL;
+        if(gp_widget_get_child(widget, i, &child) == GP_OK) {
+            serialize(child, out);
+        }
+    }
+}
+
+class TreeReader
+{
+public:
+    TreeReader(const std::vector<char>& data)
+        : p(data.data()), end(data.data() + data.size()), ok(true)
+    {
+    }
+
+    uint32_t u32()
+    {
+        if(end - p < 4) {
+            ok = false;
+            return 0;
+        }
+        uint32_t value = 0;
+        for(int i = 0; i < 4; ++i) {
+            value |= uint32_t((unsigned char) p[i]) << (8 * i);
+        }
+        p += 4;
+        return value;
+    }
+
+    float f32()
+    {
+        uint32_t bits = u32();
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    std::string string()
+    {
+        uint32_t size = u32();
+        if(uint32_t(end - p) < size) {
+            ok = false;
+            return std::string();
+        }
+        std::string value(p, size);
+        p += size;
+        return value;
+    }
+
+    CameraWidget* widget()
+    {
+        if(p >= end) {
+            ok = false;
+            return NULL;
+        }
+        CameraWidgetType type = CameraWidgetType(*p++);
+        std::string name = string();
+        std::string label = string();
+
+        CameraWidget* widget = NULL;
+        if(!ok || gp_widget_new(type, label.c_str(), &widget) < GP_OK) {
+            ok = false;
+            return NULL;
+        }
+        gp_widget_set_name(widget, name.c_str());
+
+        switch(type) {
+        case GP_WIDGET_TEXT:
+        case GP_WIDGET_RADIO:
+        case GP_WIDGET_MENU: {
+            std::string value = string();
+            if(type != GP_WIDGET_TEXT) {
+                uint32_t count = u32();
+                for(uint32_t i = 0; i < count && ok; ++i) {
+                    gp_widget_add_choice(widget, string().c_str());
+                }
+            }
+            gp_widget_set_value(widget, value.c_str());
+            break;
+        }
+        case GP_WIDGET_RANGE: {
+            float value = f32();
+            float min = f32(), max = f32(), step = f32();
+            gp_widget_set_range(widget, min, max, step);
+            gp_widget_set_value(widget, &value);
+            break;
+        }
+        case GP_WIDGET_TOGGLE:
+        case GP_WIDGET_DATE: {
+            int value = u32();
+            gp_widget_set_value(widget, &value);
+            break;
+        }
+        default:
+            break;
+        }
+        // as it came from the camera, nothing to send yet
+        gp_widget_set_changed(widget, 0);
+
+        uint32_t children = u32();
+        for(uint32_t i = 0; i < children && ok; ++i) {
+            CameraWidget* child = this->widget();
+            if(child) {
+                gp_widget_append(widget, child);
+            }
+        }
+        return widget;
+    }
+
+    bool isOk() const
+    {
+        return ok;
+    }
+
+private:
+    const char* p;
+    const char* end;
+    bool ok;
+};
+
+}
+
+CameraConfig::CameraConfig(Camera* camera, GPContext* context, CameraTrace& trace)
+    : camera(camera), context(context), trace(trace), root(NULL)
+{
+}
+
+CameraConfig::~CameraConfig()
+{
+    invalidate();
+}
+
+void CameraConfig::invalidate()
+{
+    if(!dirty.empty()) {
+        fprintf(stderr, "dropping %d uncommitted configuration changes\n", int(dirty.size()));
+    }
+    if(root) {
+        gp_widget_free(root);
+        root = NULL;
+    }
+    widgets.clear();
+    dirty.clear();
+}
+
+bool CameraConfig::isValid() const
+{
+    return root != NULL;
+}
+
+int CameraConfig::refresh()
+{
+    invalidate();
+
+    Stopwatch fetch_time;
+    int ret = trace.call(CameraTrace::GET_CONFIG, [this]() {
+        return gp_camera_get_config(camera, &root, context);
+    });
+    if(ret >= GP_OK && trace.isReplaying()) {
+        TreeReader reader(trace.payload());
+        root = reader.widget();
+        if(!reader.isOk()) {
+            if(root) {
+                gp_widget_free(root);
+            }
+            ret = GP_ERROR_CORRUPTED_DATA;
+        }
+    }
+    if(ret < GP_OK) {
+        fprintf(stderr, "camera_get_config failed: %d\n", ret);
+        root = NULL;
+        return ret;
+    }
+    if(trace.mode() == CameraTrace::RECORD) {
+        std::vector<char> tree;
+        serialize(root, tree);
+        trace.setPayload(tree.data(), tree.size());
+    }
+    Metrics::instance().sample("config.fetch_ms", fetch_time.elapsedMs());
+
+    index(root);
+    return GP_OK;
+}
+
+void CameraConfig::index(CameraWidget* widget)
+{
+    const char* name = NULL;
+    const char* label = NULL;
+    if(gp_widget_get_name(widget, &name) == GP_OK && name) {
+        widgets[name] = widget;
+    }
+    // names win over labels, like gp_widget_get_child_by_name before _by_label
+    if(gp_widget_get_label(widget, &label) == GP_OK && label && widgets.find(label) == widgets.end()) {
+        widgets[label] = widget;
+    }
+
+    int children = gp_widget_count_children(widget);
+    for(int i = 0; i < children; ++i) {
+        CameraWidget* child = NULL;
+        if(gp_widget_get_child(widget, i, &child) == GP_OK) {
+            index(child);
+        }
+    }
+}
+
+/*
+ * Looks up a label or key entry of a configuration widget,
+ * the whole tree is searched so you can just specify the last component.
+ */
+CameraWidget* CameraConfig::lookup(const std::string& key)
+{
+    if(!root && refresh() < GP_OK) {
+        return NULL;
+    }
+    auto pos = widgets.find(key);
+    return pos != widgets.end() ? pos->second : NULL;
+}
+
+int CameraConfig::lookupTyped(const std::string& key, CameraWidget** child,
+                              CameraWidgetType a, CameraWidgetType b, CameraWidgetType c)
+{
+    *child = lookup(key);
+    if(*child == NULL) {
+        return GP_ERROR_BAD_PARAMETERS;
+    }
+
+    CameraWidgetType type;
+    int ret = gp_widget_get_type(*child, &type);
+    if(ret < GP_OK) {
+        fprintf(stderr, "widget get type failed: %d\n", ret);
+        return ret;
+    }
+    if(type != a && type != b && type != c) {
+        fprintf(stderr, "widget %s has bad type %d\n", key.c_str(), type);
+        return GP_ERROR_BAD_PARAMETERS;
+    }
+    return GP_OK;
+}
+
+void CameraConfig::markDirty(CameraWidget* child)
+{
+    // action widgets (focus drive etc.) have to be sent even if the value did not change
+    gp_widget_set_changed(child, 1);
+    dirty.insert(child);
+}
+
+/* Gets a string configuration value.
+ * This can be:
+ *  - A Text widget
+ *  - The current selection of a Radio Button choice
+ *  - The current selection of a Menu choice
+ */
+int CameraConfig::getString(const std::string& key, std::string& value)
+{
+    CameraWidget* child;
+    int ret = lookupTyped(key, &child, GP_WIDGET_MENU, GP_WIDGET_RADIO, GP_WIDGET_TEXT);
+    if(ret < GP_OK) {
+        return ret;
+    }
+
+    char* val;
+    ret = gp_widget_get_value(child, &val);
+    if(ret < GP_OK) {
+        fprintf(stderr, "could not query widget value: %d\n", ret);
+        return ret;
+    }
+    value = val;
+    return GP_OK;
+}
+
+/* Sets a string configuration value, see getString(). */
+int CameraConfig::setString(const std::string& key, const std::string& value)
+{
+    CameraWidget* child;
+    int ret = lookupTyped(key, &child, GP_WIDGET_MENU, GP_WIDGET_RADIO, GP_WIDGET_TEXT);
+    if(ret < GP_OK) {
+        return ret;
+    }
+
+    ret = gp_widget_set_value(child, value.c_str());
+    if(ret < GP_OK) {
+        fprintf(stderr, "could not set widget value: %d\n", ret);
+        return ret;
+    }
+    markDirty(child);
+    return GP_OK;
+}
+
+/* Selects the n-th choice of a Radio Button or Menu. */
+int CameraConfig::setChoice(const std::string& key, int choice)
+{
+    CameraWidget* child;
+    int ret = lookupTyped(key, &child, GP_WIDGET_MENU, GP_WIDGET_RADIO);
+    if(ret < GP_OK) {
+        return ret;
+    }
+
+    const char* value;
+    ret = gp_widget_get_choice(child, choice, &value);
+    if(ret < GP_OK) {
+        fprintf(stderr, "could not get widget choice %d: %d\n", choice, ret);
+        return ret;
+    }
+    ret = gp_widget_set_value(child, value);
+    if(ret < GP_OK) {
+        fprintf(stderr, "could not set widget value: %d\n", ret);
+        return ret;
+    }
+    markDirty(child);
+    return GP_OK;
+}
+
+int CameraConfig::getChoices(const std::string& key, std::vector<std::string>& choices)
+{
+    CameraWidget* child;
+    int ret = lookupTyped(key, &child, GP_WIDGET_MENU, GP_WIDGET_RADIO);
+    if(ret < GP_OK) {
+        return ret;
+    }
+
+    choices.clear();
+    int count = gp_widget_count_choices(child);
+    for(int i = 0; i < count; ++i) {
+        const char* value;
+        if(gp_widget_get_choice(child, i, &value) == GP_OK) {
+            choices.push_back(value);
+        }
+    }
+    return GP_OK;
+}
+
+int CameraConfig::getToggle(const std::string& key, int& value)
+{
+    CameraWidget* child;
+    int ret = lookupTyped(key, &child, GP_WIDGET_TOGGLE);
+    if(ret < GP_OK) {
+        return ret;
+    }
+    return gp_widget_get_value(child, &value);
+}
+
+int CameraConfig::setToggle(const std::string& key, int value)
+{
+    CameraWidget* child;
+    int ret = lookupTyped(key, &child, GP_WIDGET_TOGGLE);
+    if(ret < GP_OK) {
+        return ret;
+    }
+
+    ret = gp_widget_set_value(child, &value);
+    if(ret < GP_OK) {
+        fprintf(stderr, "toggling %s to %d failed with %d\n", key.c_str(), value, ret);
+        return ret;
+    }
+    markDirty(child);
+    return GP_OK;
+}
+
+int CameraConfig::setRange(const std::string& key, float value)
+{
+    CameraWidget* child;
+    int ret = lookupTyped(key, &child, GP_WIDGET_RANGE);
+    if(ret < GP_OK) {
+        return ret;
+    }
+
+    ret = gp_widget_set_value(child, &value);
+    if(ret < GP_OK) {
+        fprintf(stderr, "could not set %s to %f: %d\n", key.c_str(), value, ret);
+        return ret;
+    }
+    markDirty(child);
+    return GP_OK;
+}
+
+bool CameraConfig::isDirty() const
+{
+    return !dirty.empty();
+}
+
+/* Stores all changed widgets on the camera in one go. */
+int CameraConfig::commit()
+{
+    if(dirty.empty()) {
+        return GP_OK;
+    }
+
+    Stopwatch commit_time;
+    int ret = trace.call(CameraTrace::SET_CONFIG, [this]() {
+        return gp_camera_set_config(camera, root, context);
+    });
+    Metrics::instance().sample("config.commit_ms", commit_time.elapsedMs());
+    Metrics::instance().sample("config.widgets_per_commit", dirty.size());
+
+    dirty.clear();
+    if(ret < GP_OK) {
+        fprintf(stderr, "camera_set_config failed: %d\n", ret);
+        // we don't know what the camera accepted
+        invalidate();
+    }
+    return ret;
+}
@@ -0,0 +1,67 @@
+#ifndef CAMERA_CONFIG_H
+#define CAMERA_CONFIG_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <gphoto2/gphoto2.h>
+}
+
+class CameraTrace;
+
+/*
+ * Cached configuration widget tree of a camera.
+ *
+ * The tree is fetched once and indexed by widget name and label,
+ * setters only mark widgets as changed. commit() pushes all of them
+ * in a single gp_camera_set_config() call, where the driver only sends
+ * the changed widgets to the camera.
+ * The cache has to be invalidated when the camera reports property changes.
+ * When a session is recorded the tree goes into the trace, so that the replay has one as well.
+ */
+class CameraConfig
+{
+public:
+    CameraConfig(Camera* camera, GPContext* context, CameraTrace& trace);
+    ~CameraConfig();
+
+    void invalidate();
+    bool isValid() const;
+
+    CameraWidget* lookup(const std::string& key);
+
+    int getString(const std::string& key, std::string& value);
+    int setString(const std::string& key, const std::string& value);
+    int setChoice(const std::string& key, int choice);
+    int getChoices(const std::string& key, std::vector<std::string>& choices);
+    int getToggle(const std::string& key, int& value);
+    int setToggle(const std::string& key, int value);
+    int setRange(const std::string& key, float value);
+
+    bool isDirty() const;
+    int commit();
+
+private:
+    int refresh();
+    void index(CameraWidget* widget);
+    int lookupTyped(const std::string& key, CameraWidget** child,
+                    CameraWidgetType a, CameraWidgetType b = GP_WIDGET_WINDOW,
+                    CameraWidgetType c = GP_WIDGET_WINDOW);
+    void markDirty(CameraWidget* child);
+
+private:
+    Camera* camera;
+    GPContext* context;
+    CameraTrace& trace;
+
+    CameraWidget* root;
+    std::map<std::string, CameraWidget*> widgets;
+
+    // a widget set twice is still sent once
+    std::set<CameraWidget*> dirty;
+};
+
+#endif // CAMERA_CONFIG_H
@@ -0,0 +1,127 @@
+#include "camera_supervisor.h"
+
+extern "C" {
+#include <gphoto2/gphoto2.h>
+}
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace {
+/* in-line retries of a transient error, with these pauses in between */
+const int RETRY_DELAYS_MS[] = { 20, 50, 150 };
+const int RETRIES = sizeof(RETRY_DELAYS_MS) / sizeof(RETRY_DELAYS_MS[0]);
+
+/* re-enumerating the USB device after a reset takes a second or two */
+const int RECONNECT_FIRST_DELAY_MS = 500;
+const int RECONNECT_MAX_DELAY_MS = 4000;
+}
+
+CameraSupervisor::CameraSupervisor()
+    : connected(false), was_connected(false)
+{
+}
+
+CameraSupervisor::ErrorKind CameraSupervisor::classify(int result)
+{
+    switch(result) {
+    case GP_ERROR_TIMEOUT:
+    case GP_ERROR_IO_READ:
+    case GP_ERROR_IO_WRITE:
+    case GP_ERROR_IO_USB_CLEAR_HALT:
+    case GP_ERROR_CAMERA_BUSY:
+        return TRANSIENT;
+
+    case GP_ERROR_IO:
+    case GP_ERROR_IO_INIT:
+    case GP_ERROR_IO_USB_FIND:
+    case GP_ERROR_IO_USB_CLAIM:
+    case GP_ERROR_IO_LOCK:
+    case GP_ERROR_UNKNOWN_PORT:
+    case GP_ERROR_MODEL_NOT_FOUND:
+    case GP_ERROR_CAMERA_ERROR:
+        return DISCONNECTED;
+
+    default:
+        // also the generic GP_ERROR, which says nothing about whether trying again helps
+        return FAILED;
+    }
+}
+
+int CameraSupervisor::call(const char* what, const std::function<int()>& op)
+{
+    int result = op();
+    for(int attempt = 0; result < GP_OK && classify(result) == TRANSIENT && attempt < RETRIES; ++attempt) {
+        Metrics::instance().count("camera.errors.transient");
+        Metrics::instance().count("camera.retries");
+        std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_DELAYS_MS[attempt]));
+        result = op();
+    }
+    if(result < GP_OK && classify(result) == TRANSIENT) {
+        // a transient error that does not go away is as good as a lost camera
+        fprintf(stderr, "%s: %s (%d), giving up\n", what, gp_result_as_string(result), result);
+        Metrics::instance().count("camera.errors.persistent");
+        connectionLost();
+        return result;
+    }
+    return check(what, result);
+}
+
+int CameraSupervisor::check(const char* what, int result)
+{
+    if(result >= GP_OK) {
+        return result;
+    }
+
+    fprintf(stderr, "%s: %s (%d)\n", what, gp_result_as_string(result), result);
+    switch(classify(result)) {
+    case TRANSIENT:
+        Metrics::instance().count("camera.errors.transient");
+        break;
+    case DISCONNECTED:
+        Metrics::instance().count("camera.errors.disconnect");
+        connectionLost();
+        break;
+    case FAILED:
+        Metrics::instance().count("camera.errors.failed");
+        break;
+    }
+    return result;
+}
+
+bool CameraSupervisor::isConnected() const
+{
+    return connected;
+}
+
+void CameraSupervisor::connectionLost()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(connected.exchange(false)) {
+        fprintf(stderr, "lost the camera\n");
+        down_time.restart();
+    }
+}
+
+void CameraSupervisor::connectionRestored()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(connected.exchange(true)) {
+        return;
+    }
+    if(was_connected) {
+        double ms = down_time.elapsedMs();
+        Metrics::instance().count("camera.reconnects");
+        Metrics::instance().sample("camera.recovery_ms", ms);
+        printf("camera is back after %.0f ms\n", ms);
+    }
+    was_connected = true;
+}
+
+int CameraSupervisor::reconnectDelayMs(int attempt)
+{
+    return std::min(RECONNECT_MAX_DELAY_MS, RECONNECT_FIRST_DELAY_MS << std::min(attempt, 4));
+}
@@ -0,0 +1,52 @@
+#ifndef CAMERA_SUPERVISOR_H
+#define CAMERA_SUPERVISOR_H
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+#include "metrics.h"
+
+/*
+ * Decides what to do about a failed gphoto2 call.
+ *
+ * Transient errors (camera busy, a USB timeout) are retried in-line a few times.
+ * If they persist, or the camera is gone (USB device not found, port not claimable),
+ * the connection is marked as lost; the director then re-opens the session
+ * in the background while the live view waits.
+ */
+class CameraSupervisor
+{
+public:
+    enum ErrorKind {
+        TRANSIENT,      // try the same call again
+        DISCONNECTED,   // the session is gone, the camera has to be opened again
+        FAILED          // this call did not work, but the camera is fine
+    };
+
+public:
+    CameraSupervisor();
+
+    static ErrorKind classify(int result);
+
+    /* runs op, retrying transient errors, and returns its last result */
+    int call(const char* what, const std::function<int()>& op);
+    /* for calls that must not be repeated: only a disconnect marks the connection as lost */
+    int check(const char* what, int result);
+
+    bool isConnected() const;
+    void connectionLost();
+    void connectionRestored();
+
+    /* how long to wait before the next attempt to open the camera again */
+    static int reconnectDelayMs(int attempt);
+
+private:
+    std::atomic<bool> connected;
+    // the camera thread loses the camera, the director's reconnect restores it
+    std::mutex mutex;
+    bool was_connected;
+    Stopwatch down_time;
+};
+
+#endif // CAMERA_SUPERVISOR_H
@@ -0,0 +1,346 @@
+#include "camera_trace.h"
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <thread>
+
+namespace {
+const char MAGIC[8] = { 'P', 'B', 'T', 'R', 'A', 'C', 'E', '1' };
+const std::size_t HEADER_BYTES = 1 + 1 + 4 + 8 + 4 + 4;
+
+/* one live view frame every this many ms is enough to decode something realistic */
+const uint64_t PREVIEW_KEYFRAME_MS = 2000;
+
+/* returned once the trace has no more calls of a kind, the director reconnects until the end */
+const int END_OF_TRACE = -52;   // GP_ERROR_IO_USB_FIND
+/* for calls that the recording did not make at all, the camera code falls back */
+const int NOT_RECORDED = -6;    // GP_ERROR_NOT_SUPPORTED
+
+void put(std::vector<char>& out, uint64_t value, int bytes)
+{
+    for(int i = 0; i < bytes; ++i) {
+        out.push_back(char((value >> (8 * i)) & 0xff));
+    }
+}
+
+uint64_t get(const unsigned char* in, int bytes)
+{
+    uint64_t value = 0;
+    for(int i = 0; i < bytes; ++i) {
+        value |= uint64_t(in[i]) << (8 * i);
+    }
+    return value;
+}
+}
+
+CameraTrace::CameraTrace()
+    : current_mode(OFF), replay_speed(1.0), file(NULL), has_pending(false)
+{
+    std::fill(last_kept_us, last_kept_us + CALL_COUNT, 0);
+    std::fill(kept, kept + CALL_COUNT, false);
+    std::fill(has_last, has_last + CALL_COUNT, false);
+}
+
+CameraTrace::~CameraTrace()
+{
+    close();
+}
+
+bool CameraTrace::startRecording(const std::string& path)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    file = fopen(path.c_str(), "wb");
+    if(file == NULL) {
+        fprintf(stderr, "cannot write the trace %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    fwrite(MAGIC, 1, sizeof(MAGIC), file);
+    start = std::chrono::steady_clock::now();
+    current_mode = RECORD;
+    return true;
+}
+
+bool CameraTrace::startReplay(const std::string& path, double speed)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    FILE* in = fopen(path.c_str(), "rb");
+    if(in == NULL) {
+        fprintf(stderr, "cannot read the trace %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    char magic[sizeof(MAGIC)];
+    bool ok = fread(magic, 1, sizeof(magic), in) == sizeof(magic) && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+    if(!ok) {
+        fprintf(stderr, "%s is not a camera trace\n", path.c_str());
+        fclose(in);
+        return false;
+    }
+
+    long records = 0;
+    unsigned char header[HEADER_BYTES];
+    while(fread(header, 1, HEADER_BYTES, in) == HEADER_BYTES) {
+        Record record;
+        record.call = Call(header[0]);
+        record.flags = header[1];
+        record.result = int32_t(get(header + 2, 4));
+        record.start_us = get(header + 6, 8);
+        record.duration_us = get(header + 14, 4);
+        record.payload.resize(get(header + 18, 4));
+        if(!record.payload.empty() &&
+                fread(record.payload.data(), 1, record.payload.size(), in) != record.payload.size()) {
+            fprintf(stderr, "the trace %s is cut off after %ld records\n", path.c_str(), records);
+            break;
+        }
+        if(record.call < INIT || record.call >= CALL_COUNT) {
+            fprintf(stderr, "unknown call %d in the trace %s\n", int(record.call), path.c_str());
+            break;
+        }
+        queues[record.call].push_back(std::move(record));
+        ++records;
+    }
+    fclose(in);
+
+    printf("replaying %ld camera calls from %s at %.1fx\n", records, path.c_str(), speed);
+    replay_speed = speed > 0 ? speed : 1.0;
+    start = std::chrono::steady_clock::now();
+    current_mode = REPLAY;
+    return true;
+}
+
+void CameraTrace::close()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(file) {
+        flush();
+        if(fclose(file) != 0) {
+            fprintf(stderr, "writing the trace failed\n");
+        }
+        file = NULL;
+    }
+    current_mode = OFF;
+}
+
+CameraTrace::Mode CameraTrace::mode() const
+{
+    return current_mode;
+}
+
+bool CameraTrace::isReplaying() const
+{
+    return current_mode == REPLAY;
+}
+
+bool CameraTrace::isFinished() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(current_mode != REPLAY) {
+        return false;
+    }
+    // the live view runs until the camera is put away, its frames are the last calls of a session
+    return queues[CAPTURE_PREVIEW].empty();
+}
+
+double CameraTrace::speed() const
+{
+    return replay_speed;
+}
+
+int CameraTrace::call(Call call, const std::function<int()>& op)
+{
+    if(current_mode == OFF) {
+        return op();
+    }
+
+    if(current_mode == REPLAY) {
+        Record record;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if(queues[call].empty()) {
+                // this build asks more often than the recorded one
+                Metrics::instance().count("trace.exhausted");
+                replayed.clear();
+                if(call == WAIT_FOR_EVENT) {
+                    // nothing happens any more
+                    return 0;
+                }
+                if(!has_last[call] && (call == FILE_PREVIEW || call == FILE_READ)) {
+                    return NOT_RECORDED;
+                }
+                if(call == CAPTURE_PREVIEW || !has_last[call]) {
+                    return END_OF_TRACE;
+                }
+                record = last[call];
+            } else {
+                record = std::move(queues[call].front());
+                queues[call].pop_front();
+                if(record.flags & REPEAT) {
+                    record.payload = stored[call];
+                } else if(!record.payload.empty()) {
+                    // the parts of a download come without, they must not replace the file
+                    stored[call] = record.payload;
+                }
+                last[call] = record;
+                has_last[call] = true;
+            }
+            replayed.swap(record.payload);
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(uint64_t(record.duration_us / replay_speed)));
+        Metrics::instance().count("trace.replayed");
+        return record.result;
+    }
+
+    uint64_t start_us = nowUs();
+    int result = op();
+    uint64_t end_us = nowUs();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    flush();
+    pending.call = call;
+    pending.flags = 0;
+    pending.result = result;
+    pending.start_us = start_us;
+    pending.duration_us = uint32_t(std::min<uint64_t>(end_us - start_us, UINT32_MAX));
+    pending.payload.clear();
+    has_pending = true;
+    return result;
+}
+
+bool CameraTrace::wantsPayload() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return current_mode == RECORD && has_pending && keepPayload(pending.call, pending.start_us);
+}
+
+void CameraTrace::setPayload(const char* data, std::size_t size)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(current_mode != RECORD || !has_pending) {
+        return;
+    }
+    if(keepPayload(pending.call, pending.start_us)) {
+        kept[pending.call] = true;
+        last_kept_us[pending.call] = pending.start_us;
+        pending.payload.assign(data, data + size);
+    } else {
+        pending.flags |= REPEAT;
+    }
+}
+
+const std::vector<char>& CameraTrace::payload() const
+{
+    return replayed;
+}
+
+void CameraTrace::mark(Call what, int32_t value)
+{
+    if(current_mode != RECORD) {
+        return;
+    }
+    // from the director thread: the camera call that is pending may still get its payload,
+    // the mark is complete and written at once, the replay sorts the records by call anyway
+    Record record;
+    record.call = what;
+    record.flags = 0;
+    record.result = value;
+    record.start_us = nowUs();
+    record.duration_us = 0;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    write(record);
+}
+
+std::vector<CameraTrace::Record> CameraTrace::marks(Call what) const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return std::vector<Record>(queues[what].begin(), queues[what].end());
+}
+
+const char* CameraTrace::name(Call call)
+{
+    switch(call) {
+    case INIT:
+        return "init";
+    case EXIT:
+        return "exit";
+    case CAPTURE_PREVIEW:
+        return "capture_preview";
+    case CAPTURE:
+        return "capture";
+    case FILE_GET:
+        return "file_get";
+    case FILE_DELETE:
+        return "file_delete";
+    case GET_CONFIG:
+        return "get_config";
+    case SET_CONFIG:
+        return "set_config";
+    case WAIT_FOR_EVENT:
+        return "wait_for_event";
+    case PREARM:
+        return "prearm";
+    case FILE_PREVIEW:
+        return "file_preview";
+    case FILE_READ:
+        return "file_read";
+    default:
+        return "unknown";
+    }
+}
+
+void CameraTrace::flush()
+{
+    if(!has_pending) {
+        return;
+    }
+    has_pending = false;
+    write(pending);
+}
+
+void CameraTrace::write(const Record& record)
+{
+    if(file == NULL) {
+        return;
+    }
+
+    std::vector<char> header;
+    header.reserve(HEADER_BYTES);
+    put(header, record.call, 1);
+    put(header, record.flags, 1);
+    put(header, uint32_t(record.result), 4);
+    put(header, record.start_us, 8);
+    put(header, record.duration_us, 4);
+    put(header, record.payload.size(), 4);
+
+    bool ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+    if(!record.payload.empty()) {
+        ok = fwrite(record.payload.data(), 1, record.payload.size(), file) == record.payload.size() && ok;
+    }
+    if(!ok) {
+        Metrics::instance().count("trace.write_errors");
+    }
+    Metrics::instance().count("trace.bytes", header.size() + record.payload.size());
+}
+
+bool CameraTrace::keepPayload(Call call, uint64_t now_us) const
+{
+    switch(call) {
+    case CAPTURE_PREVIEW:
+        return !kept[call] || now_us - last_kept_us[call] >= PREVIEW_KEYFRAME_MS * 1000;
+    case FILE_GET:
+    case FILE_READ:
+        // a raw file is tens of MB, its content does not change the timing
+        return !kept[call];
+    default:
+        return true;
+    }
+}
+
+uint64_t CameraTrace::nowUs() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,134 @@
+#ifndef CAMERA_TRACE_H
+#define CAMERA_TRACE_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Records the gphoto2 calls of a session, or plays them back without a camera.
+ *
+ * While recording every call is logged with its result, how long it took and what it delivered
+ * (the live view JPEG, the downloaded file, the configuration tree, the event). During replay
+ * the same calls do not touch USB: each one waits as long as the recorded call did, divided
+ * by the speed, and returns what the camera returned then. The rest of the pipeline runs for real,
+ * so two builds can be compared on the timing of one venue.
+ *
+ * The file is a header and a sequence of records:
+ *
+ *   "PBTRACE1"
+ *   u8 call, u8 flags, i32 result, u64 start_us, u32 duration_us, u32 size, size bytes of payload
+ *
+ * little endian, start_us counted from the start of the recording. To keep traces small, live view
+ * frames are stored every PREVIEW_KEYFRAME_MS only and only the first download in full; the other
+ * records have the REPEAT flag and replay the last stored payload of their call. A download in parts
+ * stores nothing with its parts, the whole file is attached to its last part.
+ * A replay that makes more calls of a kind than the recording repeats the last one, or reports
+ * no events; only the end of the live view frames ends the session. Calls that the recording
+ * never made (traces of older builds) fail as not supported.
+ *
+ * Camera calls are serialized by the director, the trace is only locked for bookkeeping.
+ * Marks come from the director thread in between and never touch the pending call.
+ */
+class CameraTrace
+{
+public:
+    enum Mode {
+        OFF,
+        RECORD,
+        REPLAY
+    };
+
+    enum Call {
+        INIT = 1,
+        EXIT,
+        CAPTURE_PREVIEW,
+        CAPTURE,
+        FILE_GET,
+        FILE_DELETE,
+        GET_CONFIG,
+        SET_CONFIG,
+        WAIT_FOR_EVENT,
+        PREARM,         // not a camera call: a countdown started, the payload is its duration
+        FILE_PREVIEW,   // the camera's small JPEG of a capture
+        FILE_READ,      // a part of a capture, the result is its size
+        CALL_COUNT
+    };
+
+    struct Record
+    {
+        Call call;
+        uint8_t flags;
+        int32_t result;
+        uint64_t start_us;
+        uint32_t duration_us;
+        std::vector<char> payload;
+    };
+
+    static const uint8_t REPEAT = 1;
+
+public:
+    CameraTrace();
+    ~CameraTrace();
+
+    bool startRecording(const std::string& path);
+    bool startReplay(const std::string& path, double speed);
+    void close();
+
+    Mode mode() const;
+    bool isReplaying() const;
+    /* every recorded camera call was played back */
+    bool isFinished() const;
+    double speed() const;
+
+    /* runs op, or replays it; returns the result of the call */
+    int call(Call call, const std::function<int()>& op);
+
+    /* recording: whether the data of the last call would be stored, see setPayload() */
+    bool wantsPayload() const;
+    /* recording: attaches data to the last call */
+    void setPayload(const char* data, std::size_t size);
+    /* replay: what the last replayed call delivered */
+    const std::vector<char>& payload() const;
+
+    /* recording: notes an event of the booth that the replay has to repeat */
+    void mark(Call what, int32_t value);
+    /* replay: the marks of one kind, in order */
+    std::vector<Record> marks(Call what) const;
+
+    static const char* name(Call call);
+
+private:
+    void flush();
+    void write(const Record& record);
+    bool keepPayload(Call call, uint64_t now_us) const;
+    uint64_t nowUs() const;
+
+private:
+    Mode current_mode;
+    double replay_speed;
+
+    mutable std::mutex mutex;
+    FILE* file;
+    std::chrono::steady_clock::time_point start;
+
+    // recording: the last call, written when the next one starts
+    Record pending;
+    bool has_pending;
+    uint64_t last_kept_us[CALL_COUNT];
+    bool kept[CALL_COUNT];
+
+    // replay: the records of each call in order, and the last one that was played
+    std::deque<Record> queues[CALL_COUNT];
+    Record last[CALL_COUNT];
+    bool has_last[CALL_COUNT];
+    std::vector<char> stored[CALL_COUNT];
+    std::vector<char> replayed;
+};
+
+#endif // CAMERA_TRACE_H
@@ -0,0 +1,361 @@
+#include "chroma_key.h"
+
+#include "image_ops.h"
+#include "memory_budget.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_DISPATCH 1
+#endif
+
+namespace {
+
+/* the frame sizes we keep a scaled background for: live view, the camera's preview and the capture */
+const std::size_t MAX_SCALED_BACKGROUNDS = 3;
+
+typedef ChromaKey::Params Params;
+
+typedef void (*BlendFunction)(const unsigned char* fr, const unsigned char* fg, const unsigned char* fb,
+                              const unsigned char* br, const unsigned char* bg, const unsigned char* bb,
+                              unsigned char* outr, unsigned char* outg, unsigned char* outb,
+                              int n, const Params& p);
+
+inline int cb_of(int r, int g, int b)
+{
+    return (-43 * r - 85 * g + 128 * b) >> 8;
+}
+
+inline int cr_of(int r, int g, int b)
+{
+    return (128 * r - 107 * g - 21 * b) >> 8;
+}
+
+/* foreground weight 0 .. 128 */
+inline int alpha_of(int r, int g, int b, const Params& p)
+{
+    int distance = std::abs(cb_of(r, g, b) - p.key_cb) + std::abs(cr_of(r, g, b) - p.key_cr);
+    int t = std::min(std::max(distance - p.tolerance, 0), p.softness);
+    return std::min(t * p.gain, 128);
+}
+
+void blend_scalar(const unsigned char* fr, const unsigned char* fg, const unsigned char* fb,
+                  const unsigned char* br, const unsigned char* bg, const unsigned char* bb,
+                  unsigned char* outr, unsigned char* outg, unsigned char* outb,
+                  int n, const Params& p)
+{
+    for(int i = 0; i < n; ++i) {
+        int a = alpha_of(fr[i], fg[i], fb[i], p);
+        outr[i] = br[i] + (((fr[i] - br[i]) * a) >> 7);
+        outg[i] = bg[i] + (((fg[i] - bg[i]) * a) >> 7);
+        outb[i] = bb[i] + (((fb[i] - bb[i]) * a) >> 7);
+    }
+}
+
+#ifdef __SSE2__
+/*
+ * Everything in 16 bit lanes: the CbCr products stay within +-32640,
+ * (fg - bg) * alpha within +-32640 because alpha is at most 128.
+ */
+void blend_sse2(const unsigned char* fr, const unsigned char* fg, const unsigned char* fb,
+                const unsigned char* br, const unsigned char* bg, const unsigned char* bb,
+                unsigned char* outr, unsigned char* outg, unsigned char* outb,
+                int n, const Params& p)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i key_cb = _mm_set1_epi16(p.key_cb);
+    const __m128i key_cr = _mm_set1_epi16(p.key_cr);
+    const __m128i tolerance = _mm_set1_epi16(p.tolerance);
+    const __m128i softness = _mm_set1_epi16(p.softness);
+    const __m128i gain = _mm_set1_epi16(p.gain);
+    const __m128i opaque = _mm_set1_epi16(128);
+
+    int i = 0;
+    for(; i + 8 <= n; i += 8) {
+#define LOAD8(ptr) _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(ptr + i)), zero)
+        __m128i r = LOAD8(fr), g = LOAD8(fg), b = LOAD8(fb);
+        __m128i rb = LOAD8(br), gb = LOAD8(bg), bb8 = LOAD8(bb);
+#undef LOAD8
+
+        __m128i cb = _mm_srai_epi16(_mm_add_epi16(_mm_sub_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(-43)),
+                                                                _mm_mullo_epi16(g, _mm_set1_epi16(85))),
+                                                  _mm_slli_epi16(b, 7)), 8);
+        __m128i cr = _mm_srai_epi16(_mm_sub_epi16(_mm_sub_epi16(_mm_slli_epi16(r, 7),
+                                                                _mm_mullo_epi16(g, _mm_set1_epi16(107))),
+                                                  _mm_mullo_epi16(b, _mm_set1_epi16(21))), 8);
+
+        __m128i dcb = _mm_sub_epi16(cb, key_cb);
+        __m128i dcr = _mm_sub_epi16(cr, key_cr);
+        dcb = _mm_max_epi16(dcb, _mm_sub_epi16(zero, dcb));
+        dcr = _mm_max_epi16(dcr, _mm_sub_epi16(zero, dcr));
+
+        __m128i t = _mm_sub_epi16(_mm_add_epi16(dcb, dcr), tolerance);
+        t = _mm_min_epi16(_mm_max_epi16(t, zero), softness);
+        __m128i a = _mm_min_epi16(_mm_mullo_epi16(t, gain), opaque);
+
+#define BLEND(f, back) _mm_add_epi16(back, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(f, back), a), 7))
+        __m128i or_ = BLEND(r, rb), og = BLEND(g, gb), ob = BLEND(b, bb8);
+#undef BLEND
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(outr + i), _mm_packus_epi16(or_, zero));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(outg + i), _mm_packus_epi16(og, zero));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(outb + i), _mm_packus_epi16(ob, zero));
+    }
+    blend_scalar(fr + i, fg + i, fb + i, br + i, bg + i, bb + i, outr + i, outg + i, outb + i, n - i, p);
+}
+#endif
+
+#ifdef HAVE_AVX2_DISPATCH
+/* same as blend_sse2, 16 pixels at a time */
+__attribute__((target("avx2")))
+void blend_avx2(const unsigned char* fr, const unsigned char* fg, const unsigned char* fb,
+                const unsigned char* br, const unsigned char* bg, const unsigned char* bb,
+                unsigned char* outr, unsigned char* outg, unsigned char* outb,
+                int n, const Params& p)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i key_cb = _mm256_set1_epi16(p.key_cb);
+    const __m256i key_cr = _mm256_set1_epi16(p.key_cr);
+    const __m256i tolerance = _mm256_set1_epi16(p.tolerance);
+    const __m256i softness = _mm256_set1_epi16(p.softness);
+    const __m256i gain = _mm256_set1_epi16(p.gain);
+    const __m256i opaque = _mm256_set1_epi16(128);
+
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+#define LOAD16(ptr) _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i)))
+        __m256i r = LOAD16(fr), g = LOAD16(fg), b = LOAD16(fb);
+        __m256i rb = LOAD16(br), gb = LOAD16(bg), bb16 = LOAD16(bb);
+#undef LOAD16
+
+        __m256i cb = _mm256_srai_epi16(_mm256_add_epi16(_mm256_sub_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(-43)),
+                                                                         _mm256_mullo_epi16(g, _mm256_set1_epi16(85))),
+                                                        _mm256_slli_epi16(b, 7)), 8);
+        __m256i cr = _mm256_srai_epi16(_mm256_sub_epi16(_mm256_sub_epi16(_mm256_slli_epi16(r, 7),
+                                                                         _mm256_mullo_epi16(g, _mm256_set1_epi16(107))),
+                                                        _mm256_mullo_epi16(b, _mm256_set1_epi16(21))), 8);
+
+        __m256i d = _mm256_add_epi16(_mm256_abs_epi16(_mm256_sub_epi16(cb, key_cb)),
+                                     _mm256_abs_epi16(_mm256_sub_epi16(cr, key_cr)));
+        __m256i t = _mm256_min_epi16(_mm256_max_epi16(_mm256_sub_epi16(d, tolerance), zero), softness);
+        __m256i a = _mm256_min_epi16(_mm256_mullo_epi16(t, gain), opaque);
+
+#define BLEND(f, back) _mm256_add_epi16(back, _mm256_srai_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(f, back), a), 7))
+        __m256i or_ = BLEND(r, rb), og = BLEND(g, gb), ob = BLEND(b, bb16);
+#undef BLEND
+
+        // packus works within 128 bit lanes, so fix the order of the 64 bit halves
+#define STORE16(ptr, v) _mm_storeu_si128(reinterpret_cast<__m128i*>(ptr + i), \
+        _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(v, zero), 0xd8)))
+        STORE16(outr, or_);
+        STORE16(outg, og);
+        STORE16(outb, ob);
+#undef STORE16
+    }
+    blend_scalar(fr + i, fg + i, fb + i, br + i, bg + i, bb + i, outr + i, outg + i, outb + i, n - i, p);
+}
+#endif
+
+BlendFunction select_blend()
+{
+#ifdef HAVE_AVX2_DISPATCH
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        return blend_avx2;
+    }
+#endif
+#ifdef __SSE2__
+    return blend_sse2;
+#else
+    return blend_scalar;
+#endif
+}
+
+const BlendFunction blend = select_blend();
+
+}
+
+ChromaKey::ChromaKey()
+{
+    setKeyColor(qRgb(0, 177, 64));
+    setTolerance(30, 20);
+}
+
+void ChromaKey::setKeyColor(QRgb color)
+{
+    params.key_cb = cb_of(qRed(color), qGreen(color), qBlue(color));
+    params.key_cr = cr_of(qRed(color), qGreen(color), qBlue(color));
+}
+
+void ChromaKey::setTolerance(int tolerance, int softness)
+{
+    params.tolerance = std::max(0, tolerance);
+    params.softness = std::max(1, softness);
+    params.gain = (128 + params.softness - 1) / params.softness;
+}
+
+bool ChromaKey::setBackground(const QImage& background)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    source = background;
+    scaled.clear();
+    recently_used.clear();
+    return !source.isNull();
+}
+
+bool ChromaKey::isEnabled() const
+{
+    return !source.isNull();
+}
+
+void ChromaKey::prepare(int width, int height)
+{
+    scaledBackground(width, height);
+}
+
+std::shared_ptr<const ChromaKey::Planes> ChromaKey::scaledBackground(int width, int height)
+{
+    std::pair<int, int> size(width, height);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto pos = std::find(recently_used.begin(), recently_used.end(), size);
+        if(pos != recently_used.end()) {
+            recently_used.erase(pos);
+            recently_used.push_back(size);
+            return scaled[size];
+        }
+    }
+
+    // without the lock, the live view must not wait while a capture sized background is scaled
+    Stopwatch scale_time;
+
+    // fill the frame, cut off what sticks out
+    QImage image = source.scaled(width, height, Qt::KeepAspectRatioByExpanding, Qt::SmoothTransformation);
+    image = image.copy((image.width() - width) / 2, (image.height() - height) / 2, width, height)
+                 .convertToFormat(QImage::Format_RGB888);
+
+    std::shared_ptr<Planes> planes = std::make_shared<Planes>();
+    planes->width = width;
+    planes->height = height;
+    planes->red.resize(width * height);
+    planes->green.resize(width * height);
+    planes->blue.resize(width * height);
+    for(int y = 0; y < height; ++y) {
+        const unsigned char* p = image.constScanLine(y);
+        for(int x = 0; x < width; ++x, p += 3) {
+            planes->red[y * width + x] = p[0];
+            planes->green[y * width + x] = p[1];
+            planes->blue[y * width + x] = p[2];
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if(std::find(recently_used.begin(), recently_used.end(), size) == recently_used.end()) {
+        scaled[size] = planes;
+        recently_used.push_back(size);
+        if(recently_used.size() > MAX_SCALED_BACKGROUNDS) {
+            scaled.erase(recently_used.front());
+            recently_used.erase(recently_used.begin());
+        }
+    }
+
+    std::size_t bytes = std::size_t(source.bytesPerLine()) * source.height();
+    for(const auto& entry : scaled) {
+        bytes += 3 * std::size_t(entry.second->width) * entry.second->height;
+    }
+    MemoryBudget::instance().set("chroma_key", bytes);
+
+    Metrics::instance().sample("chroma_key.scale_background_ms", scale_time.elapsedMs());
+    return planes;
+}
+
+std::shared_ptr<const ChromaKey::Planes> ChromaKey::background(int width, int height) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto pos = scaled.find(std::make_pair(width, height));
+    return pos != scaled.end() ? pos->second : nullptr;
+}
+
+void ChromaKey::keyRows(const ImageView& frame, int first, int last, unsigned char* out, int out_bytes_per_line,
+                        const Planes& bg, Scratch& s) const
+{
+    const int width = frame.width;
+    const int bpp = frame.bytes_per_pixel;
+    const int r = frame.red, g = frame.green, b = frame.blue;
+    s.red.resize(width);
+    s.green.resize(width);
+    s.blue.resize(width);
+
+    for(int y = first; y < last; ++y) {
+        const unsigned char* in = frame.data + y * frame.bytes_per_line;
+        for(int x = 0; x < width; ++x, in += bpp) {
+            s.red[x] = in[r];
+            s.green[x] = in[g];
+            s.blue[x] = in[b];
+        }
+
+        const int offset = y * bg.width;
+        blend(s.red.data(), s.green.data(), s.blue.data(),
+              bg.red.data() + offset, bg.green.data() + offset, bg.blue.data() + offset,
+              s.red.data(), s.green.data(), s.blue.data(), width, params);
+
+        // the input may be the output, so only write back when all of it was read
+        unsigned char* o = out + (y - first) * out_bytes_per_line;
+        for(int x = 0; x < width; ++x, o += bpp) {
+            o[r] = s.red[x];
+            o[g] = s.green[x];
+            o[b] = s.blue[x];
+        }
+        if(bpp == 4) {
+            // the fourth byte of RGB32 has to be 0xff
+            const int alpha = 6 - r - g - b;
+            o = out + (y - first) * out_bytes_per_line;
+            for(int x = 0; x < width; ++x, o += 4) {
+                o[alpha] = 0xff;
+            }
+        }
+    }
+}
+
+void ChromaKey::keyRow(const ImageView& frame, int y, unsigned char* out)
+{
+    std::shared_ptr<const Planes> bg = background(frame.width, frame.height);
+    if(!bg) {
+        return;
+    }
+    keyRows(frame, y, y + 1, out, frame.bytes_per_line, *bg, scratch);
+}
+
+QImage ChromaKey::apply(const QImage& image)
+{
+    if(!isEnabled() || image.isNull()) {
+        return image;
+    }
+
+    Stopwatch key_time;
+    QImage input = image;
+    if(input.format() != QImage::Format_RGB888 && input.format() != QImage::Format_RGB32) {
+        input = input.convertToFormat(QImage::Format_RGB32);
+    }
+
+    std::shared_ptr<const Planes> bg = scaledBackground(input.width(), input.height());
+
+    QImage output(input.width(), input.height(), input.format());
+    unsigned char* bits = output.bits();
+    const int bytes_per_line = output.bytesPerLine();
+    ImageView frame(input);
+
+    image_ops::forEachBand(input.height(), [this, &frame, bits, bytes_per_line, &bg](int first, int last) {
+        Scratch local;
+        keyRows(frame, first, last, bits + first * bytes_per_line, bytes_per_line, *bg, local);
+    });
+
+    Metrics::instance().sample("chroma_key.capture_ms", key_time.elapsedMs());
+    return output;
+}
@@ -0,0 +1,92 @@
+#ifndef CHROMA_KEY_H
+#define CHROMA_KEY_H
+
+#include <QImage>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+struct ImageView;
+
+/*
+ * Green screen: replaces everything close to the key color by a background image.
+ *
+ * Pixels are compared in the CbCr plane, so shadows on the screen are keyed as well.
+ * Pixels within the tolerance are replaced, the next softness steps are blended.
+ *
+ * The background is scaled once for every frame size and kept planar,
+ * so that the per frame work is a single pass over the decoded scanlines.
+ * The blending runs on AVX2 or SSE2, whatever the CPU has.
+ * The live view (keyRow) and the captures (apply) may be keyed on different threads.
+ */
+class ChromaKey
+{
+public:
+    ChromaKey();
+
+    void setKeyColor(QRgb color);
+    void setTolerance(int tolerance, int softness);
+    bool setBackground(const QImage& background);
+
+    bool isEnabled() const;
+
+    /* Scales the background for frames of this size, unless that was done before. */
+    void prepare(int width, int height);
+
+    /*
+     * Keys scanline y of a frame of the prepared size into out (may be the scanline itself).
+     * Meant to be called right after the scanline was decoded.
+     */
+    void keyRow(const ImageView& frame, int y, unsigned char* out);
+
+    /* Keys a whole image, split over all cores. */
+    QImage apply(const QImage& image);
+
+public:
+    struct Planes
+    {
+        int width;
+        int height;
+        std::vector<unsigned char> red;
+        std::vector<unsigned char> green;
+        std::vector<unsigned char> blue;
+    };
+
+    struct Params
+    {
+        int key_cb;
+        int key_cr;
+        int tolerance;
+        int softness;
+        int gain;
+    };
+
+private:
+    struct Scratch
+    {
+        std::vector<unsigned char> red;
+        std::vector<unsigned char> green;
+        std::vector<unsigned char> blue;
+    };
+
+    /* the background for this frame size, scaled if it is not there yet */
+    std::shared_ptr<const Planes> scaledBackground(int width, int height);
+    std::shared_ptr<const Planes> background(int width, int height) const;
+    void keyRows(const ImageView& frame, int first, int last, unsigned char* out, int out_bytes_per_line,
+                 const Planes& bg, Scratch& scratch) const;
+
+private:
+    QImage source;
+
+    // a capture is keyed while the live view goes on, an evicted background lives until both are done
+    mutable std::mutex mutex;
+    std::map<std::pair<int, int>, std::shared_ptr<const Planes> > scaled;
+    std::vector<std::pair<int, int> > recently_used;
+
+    Params params;
+    Scratch scratch;    // for keyRow(), only the live view calls it
+};
+
+#endif // CHROMA_KEY_H
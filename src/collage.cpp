@@ -0,0 +1,234 @@
+#include "collage.h"
+
+#include "image_cache.h"
+#include "image_ops.h"
+#include "jpeg_decoder.h"
+#include "metrics.h"
+
+#include <QPainter>
+#include <QFont>
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+namespace {
+const double INCH_PER_METER = 39.3700787;
+}
+
+int CollageLayout::photos() const
+{
+    int count = 0;
+    for(const Cell& cell : cells) {
+        count = std::max(count, cell.photo + 1);
+    }
+    return count;
+}
+
+CollageLayout CollageLayout::strip()
+{
+    CollageLayout layout;
+    layout.name = "strip";
+    layout.width = 4.0;
+    layout.height = 6.0;
+    layout.dpi = 300;
+    layout.background = Qt::white;
+
+    // each strip: 0.1" border, four 3:2 pictures, the text below
+    const double border = 0.1;
+    const double photo_width = 2.0 - 2 * border;
+    const double photo_height = photo_width * 2.0 / 3.0;
+    for(int strip = 0; strip < 2; ++strip) {
+        for(int i = 0; i < 4; ++i) {
+            Cell cell;
+            cell.rect = QRectF(strip * 2.0 + border, border + i * (photo_height + border), photo_width, photo_height);
+            cell.photo = i;
+            layout.cells.push_back(cell);
+        }
+    }
+
+    double text_top = border + 4 * (photo_height + border);
+    layout.text_area = QRectF(border, text_top, photo_width, 6.0 - text_top - border);
+    layout.logo_area = QRectF(2.0 + border, text_top, photo_width, 6.0 - text_top - border);
+    return layout;
+}
+
+CollageLayout CollageLayout::fourUp()
+{
+    CollageLayout layout;
+    layout.name = "four";
+    layout.width = 6.0;
+    layout.height = 4.0;
+    layout.dpi = 300;
+    layout.background = Qt::white;
+
+    const double border = 0.1;
+    const double text_height = 0.4;
+    const double photo_height = (4.0 - 3 * border - text_height) / 2;
+    const double photo_width = photo_height * 3.0 / 2.0;
+    const double left = (6.0 - 2 * photo_width - border) / 2;
+    for(int i = 0; i < 4; ++i) {
+        Cell cell;
+        cell.rect = QRectF(left + (i % 2) * (photo_width + border), border + (i / 2) * (photo_height + border),
+                           photo_width, photo_height);
+        cell.photo = i;
+        layout.cells.push_back(cell);
+    }
+
+    double text_top = 4.0 - border - text_height;
+    layout.text_area = QRectF(left, text_top, photo_width * 2 + border - 1.0, text_height);
+    layout.logo_area = QRectF(6.0 - left - 1.0, text_top, 1.0, text_height);
+    return layout;
+}
+
+Collage::Collage(const CollageLayout& layout)
+    : layout(layout), image_cache(nullptr)
+{
+}
+
+QRect Collage::toPixels(const QRectF& inches) const
+{
+    int left = std::round(inches.left() * layout.dpi);
+    int top = std::round(inches.top() * layout.dpi);
+    int right = std::round(inches.right() * layout.dpi);
+    int bottom = std::round(inches.bottom() * layout.dpi);
+    return QRect(left, top, right - left, bottom - top);
+}
+
+void Collage::setImageCache(ImageCache* cache)
+{
+    image_cache = cache;
+}
+
+QImage Collage::compose(const std::vector<std::vector<char> >& jpegs)
+{
+    return compose(jpegs.size(), [&jpegs](int photo, const QSize& target) {
+        return decode(jpegs[photo], target);
+    });
+}
+
+QImage Collage::compose(const std::vector<std::string>& paths)
+{
+    return compose(paths.size(), [this, &paths](int photo, const QSize& target) {
+        // the screen sized copy is usually large enough for a cell
+        QImage cached;
+        if(image_cache && image_cache->find(paths[photo], cached) &&
+                cached.width() >= target.width() && cached.height() >= target.height()) {
+            return cached;
+        }
+
+        std::ifstream in(paths[photo].c_str(), std::ios::binary);
+        if(!in) {
+            fprintf(stderr, "cannot open %s\n", paths[photo].c_str());
+            return QImage();
+        }
+        std::vector<char> jpeg((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        return decode(jpeg, target);
+    });
+}
+
+QImage Collage::decode(const std::vector<char>& jpeg, const QSize& target)
+{
+    if(jpeg.empty()) {
+        return QImage();
+    }
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(jpeg.data());
+    int scale = jpeg::scaleFor(data, jpeg.size(), target.width(), target.height());
+    return jpeg::decode(data, jpeg.size(), scale, QImage::Format_RGB32);
+}
+
+QImage Collage::compose(int count, const std::function<QImage(int, const QSize&)>& load)
+{
+    Stopwatch compose_time;
+
+    QImage page(std::round(layout.width * layout.dpi), std::round(layout.height * layout.dpi), QImage::Format_RGB32);
+    page.fill(layout.background);
+    page.setDotsPerMeterX(std::round(layout.dpi * INCH_PER_METER));
+    page.setDotsPerMeterY(std::round(layout.dpi * INCH_PER_METER));
+
+    // cells never overlap, so every picture can be put onto the page on its own core
+    unsigned char* bits = page.bits();
+    const int bytes_per_line = page.bytesPerLine();
+    count = std::min(count, layout.photos());
+
+    image_ops::forEachBand(count, [this, &load, bits, bytes_per_line](int first, int last) {
+        for(int photo = first; photo < last; ++photo) {
+            QSize target;
+            for(const CollageLayout::Cell& cell : layout.cells) {
+                if(cell.photo == photo) {
+                    target = target.expandedTo(toPixels(cell.rect).size());
+                }
+            }
+
+            QImage decoded = load(photo, target);
+            if(decoded.isNull()) {
+                continue;
+            }
+            if(decoded.format() != QImage::Format_RGB32) {
+                decoded = decoded.convertToFormat(QImage::Format_RGB32);
+            }
+
+            // fill the cell, cut off what sticks out
+            QImage scaled = decoded.scaled(target, Qt::KeepAspectRatioByExpanding, Qt::SmoothTransformation);
+            QImage fitted = scaled.copy((scaled.width() - target.width()) / 2, (scaled.height() - target.height()) / 2,
+                                        target.width(), target.height());
+
+            for(const CollageLayout::Cell& cell : layout.cells) {
+                if(cell.photo != photo) {
+                    continue;
+                }
+                QRect rect = toPixels(cell.rect);
+                for(int y = 0; y < rect.height(); ++y) {
+                    std::memcpy(bits + (rect.top() + y) * bytes_per_line + rect.left() * 4,
+                                fitted.constScanLine(y), rect.width() * 4);
+                }
+            }
+        }
+    });
+    Metrics::instance().sample("collage.pictures_ms", compose_time.elapsedMs());
+
+    QPainter painter(&page);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform);
+
+    if(!layout.logo.isEmpty()) {
+        QImage logo(layout.logo);
+        if(logo.isNull()) {
+            fprintf(stderr, "cannot load logo %s\n", layout.logo.toStdString().c_str());
+        } else {
+            QRect area = toPixels(layout.logo_area);
+            QImage fitted = logo.scaled(area.size(), Qt::KeepAspectRatio, Qt::SmoothTransformation);
+            painter.drawImage(area.left() + (area.width() - fitted.width()) / 2,
+                              area.top() + (area.height() - fitted.height()) / 2, fitted);
+        }
+    }
+
+    if(!layout.text.isEmpty()) {
+        QRect area = toPixels(layout.text_area);
+        QFont font("Arial");
+        font.setPixelSize(area.height() / 3);
+        painter.setFont(font);
+        painter.setPen(Qt::black);
+        painter.drawText(area, Qt::AlignCenter | Qt::TextWordWrap, layout.text);
+    }
+    painter.end();
+
+    Metrics::instance().sample("collage.compose_ms", compose_time.elapsedMs());
+    return page;
+}
+
+bool Collage::save(const QImage& page, const std::string& path) const
+{
+    Stopwatch save_time;
+    // the page carries the print resolution, Qt writes it into the JFIF header
+    bool ok = page.save(QString::fromStdString(path), "JPEG", 95);
+    if(!ok) {
+        fprintf(stderr, "cannot write %s\n", path.c_str());
+    }
+    Metrics::instance().sample("collage.save_ms", save_time.elapsedMs());
+    return ok;
+}
@@ -0,0 +1,80 @@
+#ifndef COLLAGE_H
+#define COLLAGE_H
+
+#include <QColor>
+#include <QImage>
+#include <QRectF>
+#include <QString>
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+ * A print layout: where the pictures, the logo and the text go on the page.
+ * All positions are in inches, the resolution is chosen by dpi.
+ */
+struct CollageLayout
+{
+    struct Cell
+    {
+        QRectF rect;
+        int photo;      // index of the picture shown in this cell
+    };
+
+    std::string name;
+    double width;
+    double height;
+    int dpi;
+    QColor background;
+
+    std::vector<Cell> cells;
+
+    QRectF text_area;
+    QString text;
+
+    QRectF logo_area;
+    QString logo;
+
+    int photos() const;
+
+    /* two 2x6 inch strips with four pictures each, side by side on 4x6 paper */
+    static CollageLayout strip();
+    /* four pictures in a 2x2 grid on 6x4 paper */
+    static CollageLayout fourUp();
+};
+
+/*
+ * Lays out captures for printing.
+ *
+ * Each capture is decoded with libjpeg's DCT scaling to just above the size of its cell,
+ * and scaled and placed into its cells on its own core.
+ */
+class ImageCache;
+
+class Collage
+{
+public:
+    Collage(const CollageLayout& layout);
+
+    /* screen sized captures are used instead of decoding the file when they are large enough */
+    void setImageCache(ImageCache* cache);
+
+    /* compressed captures, from memory */
+    QImage compose(const std::vector<std::vector<char> >& jpegs);
+    /* captures in the output directory */
+    QImage compose(const std::vector<std::string>& paths);
+
+    /* saves a page with the resolution of the layout */
+    bool save(const QImage& page, const std::string& path) const;
+
+private:
+    QImage compose(int count, const std::function<QImage(int photo, const QSize& target)>& load);
+    static QImage decode(const std::vector<char>& jpeg, const QSize& target);
+    QRect toPixels(const QRectF& inches) const;
+
+private:
+    CollageLayout layout;
+    ImageCache* image_cache;
+};
+
+#endif // COLLAGE_H
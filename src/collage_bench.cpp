@@ -0,0 +1,89 @@
+#include "collage.h"
+#include "metrics.h"
+
+#include <QDir>
+#include <QGuiApplication>
+#include <QStringList>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+/*
+ * Lays out the captures in a folder with every print layout and reports how long it takes.
+ *
+ *   QT_QPA_PLATFORM=offscreen ./collage_bench folder-with-captures [runs]
+ */
+int main(int argc, char *argv[])
+{
+    if(argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " capture-directory [runs]" << std::endl;
+        return 1;
+    }
+    QGuiApplication app(argc, argv);
+
+    const QString directory = argv[1];
+    const int runs = argc > 2 ? std::max(1, atoi(argv[2])) : 5;
+
+    QStringList files = QDir(directory).entryList(QStringList() << "*.jpg" << "*.JPG", QDir::Files, QDir::Name);
+    if(files.isEmpty()) {
+        std::cerr << "no captures in " << directory.toStdString() << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> paths;
+    std::vector<std::vector<char> > jpegs;
+    for(const QString& file : files) {
+        std::string path = QDir(directory).filePath(file).toStdString();
+        std::ifstream in(path.c_str(), std::ios::binary);
+        paths.push_back(path);
+        jpegs.push_back(std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()));
+    }
+
+    std::vector<CollageLayout> layouts;
+    layouts.push_back(CollageLayout::strip());
+    layouts.push_back(CollageLayout::fourUp());
+
+    for(CollageLayout& layout : layouts) {
+        layout.text = "Photobox Benchmark";
+        const int photos = layout.photos();
+
+        double memory_ms = 0, disk_ms = 0, save_ms = 0, slowest_ms = 0;
+        for(int run = 0; run < runs; ++run) {
+            // cycle through the folder, so that every run decodes other pictures
+            std::vector<std::vector<char> > from_memory;
+            std::vector<std::string> from_disk;
+            for(int i = 0; i < photos; ++i) {
+                std::size_t index = (run * photos + i) % jpegs.size();
+                from_memory.push_back(jpegs[index]);
+                from_disk.push_back(paths[index]);
+            }
+
+            Collage collage(layout);
+            Stopwatch memory_time;
+            QImage page = collage.compose(from_memory);
+            memory_ms += memory_time.elapsedMs();
+
+            // what a guest waits for after the last shot
+            Stopwatch disk_time;
+            page = collage.compose(from_disk);
+            disk_ms += disk_time.elapsedMs();
+
+            Stopwatch save_time;
+            collage.save(page, "/tmp/collage_bench." + layout.name + ".jpg");
+            save_ms += save_time.elapsedMs();
+            slowest_ms = std::max(slowest_ms, disk_time.elapsedMs());
+        }
+
+        printf("%-6s %4dx%-4d  compose from memory %7.1f ms  from files %7.1f ms  save %6.1f ms"
+               "  slowest page %7.1f ms  (%d runs)\n",
+               layout.name.c_str(), int(layout.width * layout.dpi), int(layout.height * layout.dpi),
+               memory_ms / runs, disk_ms / runs, save_ms / runs, slowest_ms, runs);
+    }
+
+    Metrics::instance().print();
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include "collage_builder.h"
+
+#include "memory_budget.h"
+#include "metrics.h"
+#include "thread_topology.h"
+
+#include <stdio.h>
+
+#include <chrono>
+
+CollageBuilder::CollageBuilder(const std::string& output_directory, const CollageLayout& layout)
+    : output_directory(output_directory), layout(layout), image_cache(nullptr), running(true)
+{
+    worker = std::thread(&CollageBuilder::run, this);
+}
+
+void CollageBuilder::setImageCache(ImageCache* cache)
+{
+    image_cache = cache;
+}
+
+CollageBuilder::~CollageBuilder()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+        cond_page.notify_all();
+    }
+    if(worker.joinable()) {
+        worker.join();
+    }
+}
+
+void CollageBuilder::addImage(QString path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.push_back(path.toStdString());
+    if(int(pending.size()) < layout.photos()) {
+        return;
+    }
+    pages.push_back(std::vector<std::string>());
+    pages.back().swap(pending);
+    cond_page.notify_all();
+}
+
+void CollageBuilder::setGuestsPresent(bool present)
+{
+    if(!present) {
+        // the last picture of the session may still be on its way from the camera
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if(!pending.empty()) {
+        Metrics::instance().count("collage.incomplete_sessions");
+        pending.clear();
+    }
+}
+
+void CollageBuilder::run()
+{
+    ThreadTopology::enter(ThreadTopology::BACKGROUND);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        while(running && pages.empty()) {
+            cond_page.wait(lock);
+        }
+        if(pages.empty()) {
+            break;
+        }
+        std::vector<std::string> paths = std::move(pages.front());
+        pages.pop_front();
+
+        lock.unlock();
+        build(paths);
+        lock.lock();
+    }
+}
+
+void CollageBuilder::build(const std::vector<std::string>& paths)
+{
+    Stopwatch build_time;
+    Collage collage(layout);
+    collage.setImageCache(image_cache);
+    QImage page = collage.compose(paths);
+    MemoryBudget::instance().set("collage", std::size_t(page.bytesPerLine()) * page.height());
+
+    long now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    std::string path = output_directory + std::to_string(now) + "." + layout.name + ".jpg";
+    bool written = collage.save(page, path);
+    page = QImage();
+    MemoryBudget::instance().set("collage", 0);
+
+    double ms = build_time.elapsedMs();
+    Metrics::instance().sample("collage.build_ms", ms);
+    printf("laid out %s in %.0f ms\n", path.c_str(), ms);
+
+    if(written) {
+        emit collageAvailable(QString::fromStdString(path));
+    }
+}
+
+#include "moc_collage_builder.cpp"
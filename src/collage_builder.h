@@ -0,0 +1,56 @@
+#ifndef COLLAGE_BUILDER_H
+#define COLLAGE_BUILDER_H
+
+#include <QObject>
+#include <QString>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "collage.h"
+
+/*
+ * Collects the captures of a session and lays out a print page as soon as there are enough.
+ *
+ * The page is composed on a background thread of its own (with one helper per picture),
+ * the camera thread only hands over the file name and never waits for a page.
+ * A page only holds the pictures of one session: what is left over is dropped when the next guests come.
+ */
+class CollageBuilder : public QObject
+{
+    Q_OBJECT
+
+public:
+    CollageBuilder(const std::string& output_directory, const CollageLayout& layout);
+    ~CollageBuilder();
+
+    void setImageCache(ImageCache* cache);
+
+signals:
+    void collageAvailable(QString path);
+
+public slots:
+    void addImage(QString path);
+    void setGuestsPresent(bool present);
+
+private:
+    void run();
+    void build(const std::vector<std::string>& paths);
+
+private:
+    const std::string output_directory;
+    const CollageLayout layout;
+    ImageCache* image_cache;
+
+    std::mutex mutex;
+    std::condition_variable cond_page;
+    std::vector<std::string> pending;
+    std::deque<std::vector<std::string> > pages;
+    bool running;
+    std::thread worker;
+};
+
+#endif // COLLAGE_BUILDER_H
@@ -0,0 +1,164 @@
+#include "color_filter.h"
+
+#include "image_ops.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+typedef void (*RowKernel)(const ColorFilter::Lut& lut, unsigned char* row, int width);
+
+template<int BPP, int R, int G, int B, bool MONOCHROME>
+void filter_row(const ColorFilter::Lut& lut, unsigned char* p, int width)
+{
+    for(int x = 0; x < width; ++x, p += BPP) {
+        if(MONOCHROME) {
+            int y = (77 * p[R] + 150 * p[G] + 29 * p[B]) >> 8;
+            p[R] = lut.red[y];
+            p[G] = lut.green[y];
+            p[B] = lut.blue[y];
+        } else {
+            p[R] = lut.red[p[R]];
+            p[G] = lut.green[p[G]];
+            p[B] = lut.blue[p[B]];
+        }
+    }
+}
+
+RowKernel kernel_for(const ImageView& frame, bool monochrome)
+{
+    if(frame.bytes_per_pixel == 4 && frame.red == 2 && frame.green == 1 && frame.blue == 0) {
+        return monochrome ? filter_row<4, 2, 1, 0, true> : filter_row<4, 2, 1, 0, false>;
+    }
+    if(frame.bytes_per_pixel == 3 && frame.red == 0 && frame.green == 1 && frame.blue == 2) {
+        return monochrome ? filter_row<3, 0, 1, 2, true> : filter_row<3, 0, 1, 2, false>;
+    }
+    return nullptr;
+}
+
+unsigned char clamp_byte(double value)
+{
+    return (unsigned char) std::min(255.0, std::max(0.0, std::round(value)));
+}
+
+/* gentle S curve around mid grey, 0 .. 1 in and out */
+double contrast(double x, double amount)
+{
+    return x + amount * x * (1.0 - x) * (2.0 * x - 1.0);
+}
+
+void make_identity(ColorFilter::Lut& lut)
+{
+    lut.monochrome = false;
+    for(int i = 0; i < 256; ++i) {
+        lut.red[i] = lut.green[i] = lut.blue[i] = i;
+    }
+}
+
+void make_black_white(ColorFilter::Lut& lut)
+{
+    lut.monochrome = true;
+    for(int i = 0; i < 256; ++i) {
+        lut.red[i] = lut.green[i] = lut.blue[i] = clamp_byte(255.0 * contrast(i / 255.0, 0.6));
+    }
+}
+
+void make_sepia(ColorFilter::Lut& lut)
+{
+    lut.monochrome = true;
+    // from dark brown in the shadows to cream in the highlights
+    const double dark[3] = { 38, 22, 10 };
+    const double light[3] = { 255, 240, 200 };
+    for(int i = 0; i < 256; ++i) {
+        double t = contrast(i / 255.0, 0.3);
+        lut.red[i] = clamp_byte(dark[0] + t * (light[0] - dark[0]));
+        lut.green[i] = clamp_byte(dark[1] + t * (light[1] - dark[1]));
+        lut.blue[i] = clamp_byte(dark[2] + t * (light[2] - dark[2]));
+    }
+}
+
+void make_vintage(ColorFilter::Lut& lut)
+{
+    lut.monochrome = false;
+    // faded blacks, soft highlights, warm mid tones and a touch of blue in the shadows
+    for(int i = 0; i < 256; ++i) {
+        double x = i / 255.0;
+        lut.red[i] = clamp_byte(22 + 225 * contrast(x, 0.4));
+        lut.green[i] = clamp_byte(18 + 210 * std::pow(x, 1.05));
+        lut.blue[i] = clamp_byte(45 + 160 * std::pow(x, 1.2));
+    }
+}
+
+}
+
+ColorFilter::ColorFilter()
+    : preset(NONE)
+{
+    make_identity(luts[NONE]);
+    make_black_white(luts[BLACK_WHITE]);
+    make_sepia(luts[SEPIA]);
+    make_vintage(luts[VINTAGE]);
+}
+
+void ColorFilter::select(Preset p)
+{
+    preset = p;
+}
+
+ColorFilter::Preset ColorFilter::selected() const
+{
+    return Preset(preset.load());
+}
+
+const char* ColorFilter::name(Preset preset)
+{
+    switch(preset) {
+    case BLACK_WHITE:
+        return "Schwarzweiß";
+    case SEPIA:
+        return "Sepia";
+    case VINTAGE:
+        return "Vintage";
+    default:
+        return "Original";
+    }
+}
+
+void ColorFilter::filterRow(Preset p, const ImageView& frame, unsigned char* row) const
+{
+    if(p == NONE) {
+        return;
+    }
+    const Lut& lut = luts[p];
+    RowKernel kernel = kernel_for(frame, lut.monochrome);
+    if(kernel) {
+        kernel(lut, row, frame.width);
+    }
+}
+
+void ColorFilter::apply(QImage& image) const
+{
+    Preset p = selected();
+    if(p == NONE || image.isNull()) {
+        return;
+    }
+    if(image.format() != QImage::Format_RGB888 && image.format() != QImage::Format_RGB32) {
+        image = image.convertToFormat(QImage::Format_RGB32);
+    }
+
+    Stopwatch filter_time;
+    unsigned char* bits = image.bits();
+    const int bytes_per_line = image.bytesPerLine();
+    ImageView frame(image);
+    RowKernel kernel = kernel_for(frame, luts[p].monochrome);
+    const Lut& lut = luts[p];
+
+    image_ops::forEachBand(image.height(), [&](int first, int last) {
+        for(int y = first; y < last; ++y) {
+            kernel(lut, bits + y * bytes_per_line, frame.width);
+        }
+    });
+    Metrics::instance().sample("filter.capture_ms", filter_time.elapsedMs());
+}
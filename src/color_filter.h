@@ -0,0 +1,60 @@
+#ifndef COLOR_FILTER_H
+#define COLOR_FILTER_H
+
+#include <QImage>
+#include <atomic>
+
+struct ImageView;
+
+/*
+ * Looks the guests can pick: black and white, sepia and vintage.
+ *
+ * Every preset is a set of lookup tables, either indexed by the luma of a pixel
+ * (monochrome looks) or by each channel (color grading). The tables are computed
+ * once, the per pixel work is done by kernels that are specialized
+ * for the pixel layout and the kind of table at compile time.
+ *
+ * select() may be called from the GUI thread while frames are filtered.
+ */
+class ColorFilter
+{
+public:
+    enum Preset {
+        NONE,
+        BLACK_WHITE,
+        SEPIA,
+        VINTAGE,
+        PRESET_COUNT
+    };
+
+    struct Lut
+    {
+        bool monochrome;
+        unsigned char red[256];
+        unsigned char green[256];
+        unsigned char blue[256];
+    };
+
+public:
+    ColorFilter();
+
+    void select(Preset preset);
+    Preset selected() const;
+
+    static const char* name(Preset preset);
+
+    /*
+     * Filters one scanline of frame in place.
+     * Meant to be called right after the scanline was decoded.
+     */
+    void filterRow(Preset preset, const ImageView& frame, unsigned char* row) const;
+
+    /* Filters a whole image in place, split over all cores. */
+    void apply(QImage& image) const;
+
+private:
+    Lut luts[PRESET_COUNT];
+    std::atomic<int> preset;
+};
+
+#endif // COLOR_FILTER_H
@@ -0,0 +1,92 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC 1
+#endif
+
+namespace {
+const uint32_t POLYNOMIAL = 0x82f63b78;     // reversed 0x1edc6f41
+
+struct Table
+{
+    uint32_t entries[256];
+
+    Table()
+    {
+        for(uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for(int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (POLYNOMIAL & (0u - (crc & 1)));
+            }
+            entries[i] = crc;
+        }
+    }
+};
+
+uint32_t extend_table(uint32_t crc, const unsigned char* p, std::size_t size)
+{
+    static const Table table;
+    for(std::size_t i = 0; i < size; ++i) {
+        crc = table.entries[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+uint32_t extend_sse42(uint32_t crc, const unsigned char* p, std::size_t size)
+{
+    while(size > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        --size;
+    }
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for(; size >= 8; size -= 8, p += 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = uint32_t(crc64);
+#endif
+    for(; size >= 4; size -= 4, p += 4) {
+        uint32_t word;
+        std::memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    while(size-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+
+const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+#else
+const bool has_sse42 = false;
+#endif
+}
+
+namespace crc32c
+{
+
+uint32_t extend(uint32_t crc, const void* data, std::size_t size)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+#if HAVE_SSE42_CRC
+    if(has_sse42) {
+        return ~extend_sse42(crc, p, size);
+    }
+#endif
+    return ~extend_table(crc, p, size);
+}
+
+bool isAccelerated()
+{
+    return has_sse42;
+}
+
+}
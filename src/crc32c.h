@@ -0,0 +1,21 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * CRC-32C (Castagnoli), as used by iSCSI and ext4.
+ *
+ * With the SSE 4.2 crc32 instruction where the CPU has it, 8 bytes per instruction,
+ * otherwise with a table. Both give the same values.
+ */
+namespace crc32c
+{
+/* continues crc (0 for a new one) over the data */
+uint32_t extend(uint32_t crc, const void* data, std::size_t size);
+
+bool isAccelerated();
+}
+
+#endif // CRC32C_H
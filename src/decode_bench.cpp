@@ -0,0 +1,105 @@
+#include "jpeg_decoder.h"
+#include "metrics.h"
+#include "thread_topology.h"
+#include "worker_pool.h"
+
+#include <QDir>
+#include <QGuiApplication>
+#include <QStringList>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+
+/*
+ * Decodes the captures in a folder the way the booth used to and with the parallel decoder
+ * and reports how long each took, at full size and at the size of the screen.
+ *
+ *   QT_QPA_PLATFORM=offscreen ./decode_bench folder-with-captures [runs]
+ *
+ * Only JPEGs with restart markers at MCU rows are split, the others show what the fallback costs.
+ */
+namespace {
+const int SCREEN_WIDTH = 1920;
+const int SCREEN_HEIGHT = 1080;
+
+double time_ms(int runs, const std::function<QImage()>& decode)
+{
+    double total = 0;
+    for(int run = 0; run < runs; ++run) {
+        Stopwatch time;
+        QImage image = decode();
+        total += time.elapsedMs();
+        if(image.isNull()) {
+            return -1;
+        }
+    }
+    return total / runs;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " capture-directory [runs]" << std::endl;
+        return 1;
+    }
+    QGuiApplication app(argc, argv);
+
+    const QString directory = argv[1];
+    const int runs = argc > 2 ? std::max(1, atoi(argv[2])) : 5;
+
+    QStringList files = QDir(directory).entryList(QStringList() << "*.jpg" << "*.JPG", QDir::Files, QDir::Name);
+    if(files.isEmpty()) {
+        std::cerr << "no captures in " << directory.toStdString() << std::endl;
+        return 1;
+    }
+
+    printf("%d threads, %d runs each, times in ms\n",
+           ThreadTopology::instance().workers(ThreadTopology::DECODE).concurrency(), runs);
+    printf("%-28s %-5s %9s %9s %9s | %9s %9s\n", "", "split", "QImage", "one", "parallel", "scaled", "parallel");
+
+    double sums[5] = { 0, 0, 0, 0, 0 };
+    for(const QString& file : files) {
+        std::string path = QDir(directory).filePath(file).toStdString();
+        std::ifstream in(path.c_str(), std::ios::binary);
+        std::vector<unsigned char> jpeg((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        const unsigned char* data = jpeg.data();
+        const std::size_t size = jpeg.size();
+        const int scale = jpeg::scaleFor(data, size, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+        double times[5];
+        // what showImage() and the gallery did before
+        times[0] = time_ms(runs, [&]() {
+            return QImage::fromData(data, size, "JPG");
+        });
+        times[1] = time_ms(runs, [&]() {
+            return jpeg::decode(data, size, 1, QImage::Format_RGB32);
+        });
+        times[2] = time_ms(runs, [&]() {
+            return jpeg::decodeParallel(data, size, 1, QImage::Format_RGB32);
+        });
+        times[3] = time_ms(runs, [&]() {
+            return jpeg::decode(data, size, scale, QImage::Format_RGB32);
+        });
+        times[4] = time_ms(runs, [&]() {
+            return jpeg::decodeParallel(data, size, scale, QImage::Format_RGB32);
+        });
+
+        printf("%-28s %-5s %9.1f %9.1f %9.1f | %9.1f %9.1f  (1/%d)\n", file.toStdString().c_str(),
+               jpeg::isSplittable(data, size) ? "yes" : "no",
+               times[0], times[1], times[2], times[3], times[4], scale);
+        for(int i = 0; i < 5; ++i) {
+            sums[i] += times[i];
+        }
+    }
+
+    const int count = files.size();
+    printf("%-28s %-5s %9.1f %9.1f %9.1f | %9.1f %9.1f\n", "average", "",
+           sums[0] / count, sums[1] / count, sums[2] / count, sums[3] / count, sums[4] / count);
+    return 0;
+}
@@ -1,71 +1,487 @@
 #include "director.h"
 
 #include "camera.h"
+#include "camera_config.h"
+#include "camera_supervisor.h"
+#include "frame_pacer.h"
+#include "metrics.h"
+#include "memory_budget.h"
+#include "loop_encoder.h"
+#include "timelapse_writer.h"
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <iostream>
 #include <thread>
 
+namespace {
+/* the shutter should fire at most this long after the countdown is over */
+const double SHUTTER_BOUND_MS = 100.0;
+/* safety margin on top of the expected prearm duration */
+const double PREARM_MARGIN_MS = 300.0;
+/* camera events (property changes) are polled every this many preview frames */
+const int EVENT_POLL_FRAMES = 10;
+/* the histogram is shown every this many preview frames */
+const int EXPOSURE_INFO_FRAMES = 5;
+/* live view frames kept for loops, about three seconds */
+const int LOOP_FRAMES = 30;
+const std::size_t LOOP_FRAME_BYTES = 512 * 1024;
+/* parts of a raw file fetched between two live view frames at least, so that it always arrives */
+const int MIN_DOWNLOAD_PARTS_PER_FRAME = 1;
+}
+
 Director::Director(EOSCamera& cam)
-    : cam(cam), running(true), is_preview_running(false), is_picture_requested(false)
+    : cam(cam), running(true), is_preview_running(false), is_connecting(false), is_picture_requested(false),
+      auto_focus_on_prearm(false), is_prearmed(false), expected_prearm_ms(1500.0),
+      focus_assist(false), focus_requested(false),
+      auto_exposure(false), exposure_frames(0),
+      loop_encoder(nullptr), boomerang(false), loop_frames(LOOP_FRAMES, LOOP_FRAME_BYTES),
+      was_connected(false), frame_pacer(nullptr), expected_part_ms(20.0),
+      timelapse(nullptr), timelapse_interval(0), timelapse_deferred(false), guests_present(false)
 {
 
 }
 
 void Director::stop()
 {
+    std::unique_lock<std::mutex> lock(mutex);
     running = false;
+    cond_stopped.notify_all();
+    cond_preview_possible.notify_all();
+}
+
+void Director::setAutoFocusOnPrearm(bool auto_focus)
+{
+    auto_focus_on_prearm = auto_focus;
+}
+
+void Director::setFocusAssist(bool assist)
+{
+    focus_assist = assist;
+}
+
+void Director::setAutoExposure(bool enabled)
+{
+    auto_exposure = enabled;
+}
+
+void Director::setLoopEncoder(LoopEncoder* encoder, bool as_boomerang)
+{
+    loop_encoder = encoder;
+    boomerang = as_boomerang;
+    // the ring fills within the first seconds of live view
+    MemoryBudget::instance().set("loop_frames", encoder ? LOOP_FRAMES * LOOP_FRAME_BYTES : 0);
+}
+
+void Director::setFramePacer(FramePacer* pacer)
+{
+    frame_pacer = pacer;
+}
+
+void Director::setTimelapse(TimelapseWriter* writer, int interval_ms)
+{
+    timelapse = writer;
+    timelapse_interval = std::chrono::milliseconds(interval_ms);
+    next_timelapse = std::chrono::steady_clock::now() + timelapse_interval;
+}
+
+void Director::setGuestsPresent(bool present)
+{
+    guests_present = present;
+}
+
+void Director::focus()
+{
+    focus_requested = true;
+}
+
+void Director::recordLoop()
+{
+    if(loop_encoder == nullptr) {
+        return;
+    }
+    loop_encoder->encode(loop_frames.snapshot(), boomerang);
+}
+
+void Director::keepLoopFrame()
+{
+    const char* data;
+    unsigned long size;
+    if(cam.lastPreviewJpeg(data, size)) {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        loop_frames.add(data, size, std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+    }
+}
+
+void Director::keepTimelapseFrame()
+{
+    if(last_fetch < next_timelapse) {
+        return;
+    }
+    if(guests_present) {
+        // taken as soon as the guests are done, or skipped if that is too late
+        timelapse_deferred = true;
+        return;
+    }
+
+    // the ticks stay on their grid, ticks that passed while guests were there are left out
+    long missed = (last_fetch - next_timelapse) / timelapse_interval;
+    auto tick = next_timelapse + missed * timelapse_interval;
+    next_timelapse = tick + timelapse_interval;
+    if(missed > 0) {
+        Metrics::instance().count("timelapse.skipped", missed);
+    }
+    if(timelapse_deferred && missed == 0) {
+        Metrics::instance().count("timelapse.deferred");
+    } else {
+        // how precisely the frames are spaced, the live view was asked for a frame at the tick
+        Metrics::instance().sample("timelapse.late_ms",
+                                   std::chrono::duration<double, std::milli>(last_fetch - tick).count());
+    }
+    timelapse_deferred = false;
+
+    const char* data;
+    unsigned long size;
+    if(cam.lastPreviewJpeg(data, size) && timelapse->add(data, size)) {
+        Metrics::instance().count("timelapse.frames");
+    }
 }
 
-void Director::takePicture()
+bool Director::acquireCamera()
 {
+    std::unique_lock<std::mutex> lock(mutex);
     is_picture_requested = true;
+    cond_stopped.notify_all();
+    while(is_preview_running) {
+        if(is_connecting) {
+            // the reconnect backoff takes seconds, the guests learn now that there is no picture
+            is_picture_requested = false;
+            cond_preview_possible.notify_all();
+            return false;
+        }
+        cond_picture_possible.wait(lock);
+    }
+    return true;
+}
+
+void Director::releaseCamera()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    is_picture_requested = false;
+    cond_preview_possible.notify_all();
+}
+
+void Director::flushDownload()
+{
+    if(!cam.isDownloading()) {
+        return;
+    }
+    // the next guests are there before the last picture is, it has to be done now
+    Metrics::instance().count("download.flushed");
+    Stopwatch flush_time;
+    cam.finishDownload();
+    Metrics::instance().sample("download.flush_ms", flush_time.elapsedMs());
+}
+
+void Director::prearm(int countdown_ms)
+{
+    // the window says so only with its next tick
+    guests_present = true;
 
+    // a replay of this session starts the countdown at the same moment
+    cam.trace().mark(CameraTrace::PREARM, countdown_ms);
+
+    // Prepare as late as possible, so that the guests see themselves for most of the countdown,
+    // but early enough that only the shutter command is left once it is over.
+    double lead_ms = expected_prearm_ms + PREARM_MARGIN_MS;
+    auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(std::max(0, countdown_ms - (int) lead_ms));
     {
         std::unique_lock<std::mutex> lock(mutex);
-        while(is_preview_running) {
-            cond_picture_possible.wait(lock);
+        cond_stopped.wait_until(lock, deadline, [this]() { return !running; });
+    }
+
+    if(!cam.isConnected() || !acquireCamera()) {
+        // takePicture() gives up just as quickly
+        Metrics::instance().count("capture.camera_missing");
+        return;
+    }
+    flushDownload();
+
+    Stopwatch prearm_time;
+    if(!cam.prepareCapture(auto_focus_on_prearm)) {
+        // takePicture() finds the camera gone and gives up
+        is_prearmed = true;
+        return;
+    }
+    double duration = prearm_time.elapsedMs();
+
+    Metrics::instance().sample("capture.prearm_ms", duration);
+    // follow slower cameras immediately, faster ones gradually
+    expected_prearm_ms = std::max(duration, 0.8 * expected_prearm_ms + 0.2 * duration);
+
+    is_prearmed = true;
+}
+
+void Director::takePicture(qint64 countdown_end_us)
+{
+    const std::chrono::steady_clock::time_point countdown_over{std::chrono::microseconds(countdown_end_us)};
+
+    if(!is_prearmed) {
+        if(!cam.isConnected() || !acquireCamera()) {
+            Metrics::instance().count("capture.failed");
+            std::cout << "no picture, the camera is not connected" << std::endl;
+            emit doneTakingPicture();
+            return;
         }
+        flushDownload();
     }
+    is_prearmed = false;
 
-    cam.takePicture();
+    if(!cam.takePicture()) {
+        Metrics::instance().count("capture.failed");
+        std::cout << "no picture, the camera did not take or deliver it" << std::endl;
+        releaseCamera();
+        emit doneTakingPicture();
+        return;
+    }
 
-    is_picture_requested = false;
-    cond_preview_possible.notify_all();
+    double shutter_delay = std::chrono::duration<double, std::milli>(cam.lastShutterTime() - countdown_over).count();
+    Metrics::instance().sample("capture.shutter_delay_ms", shutter_delay);
+    if(shutter_delay > SHUTTER_BOUND_MS) {
+        Metrics::instance().count("capture.shutter_late");
+        std::cout << "shutter fired " << shutter_delay << " ms after the countdown (bound "
+                  << SHUTTER_BOUND_MS << " ms)" << std::endl;
+    }
+
+    if(focus_assist) {
+        // refocus between guests
+        focus_requested = true;
+    }
+
+    releaseCamera();
 
     emit doneTakingPicture();
 }
 
-void Director::setPreview(bool preview_requested)
+void Director::connectCamera()
+{
+    // the window is up already, guests see that the booth waits for the camera
+    if(!setPreview(true)) {
+        // the capture fails without a camera and gives it back, then we try again
+        return;
+    }
+    if(was_connected) {
+        emit cameraLost();
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        is_connecting = true;
+        cond_picture_possible.notify_all();
+    }
+
+    for(int attempt = 0; running; ++attempt) {
+        bool connected = was_connected ? cam.reconnect() : cam.init();
+        if(connected) {
+            break;
+        }
+        Metrics::instance().count("camera.connect_attempts");
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cond_stopped.wait_for(lock, std::chrono::milliseconds(CameraSupervisor::reconnectDelayMs(attempt)),
+                              [this]() { return !running; });
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        is_connecting = false;
+    }
+    setPreview(false);
+
+    if(cam.isConnected()) {
+        // focus steps of the old session are lost
+        focus_engine.cancel();
+        if(was_connected) {
+            emit cameraReconnected();
+        }
+        was_connected = true;
+    }
+}
+
+void Director::waitForNextFrame()
+{
+    if(frame_pacer == nullptr) {
+        // frames as fast as the camera delivers them, every tick is met within a frame
+        last_fetch = std::chrono::steady_clock::now();
+        return;
+    }
+    // the camera is free meanwhile, a picture does not wait for the pacing
+    auto next = frame_pacer->nextFetch(last_fetch);
+    if(timelapse && !guests_present) {
+        // an idle booth fetches slowly, the timelapse tick must not wait for the next frame
+        next = std::min(next, next_timelapse);
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond_stopped.wait_until(lock, next, [this]() { return !running || is_picture_requested; });
+    }
+    last_fetch = std::chrono::steady_clock::now();
+}
+
+void Director::downloadBetweenFrames()
+{
+    // the time until the next live view frame is due goes to the download
+    auto next = frame_pacer ? frame_pacer->nextFetch(last_fetch) : std::chrono::steady_clock::now();
+    auto part = std::chrono::microseconds(long(expected_part_ms * 1000));
+    int parts = 0;
+    while(cam.isDownloading() && running && !is_picture_requested &&
+          (parts < MIN_DOWNLOAD_PARTS_PER_FRAME || std::chrono::steady_clock::now() + part <= next)) {
+        Stopwatch part_time;
+        if(!cam.downloadStep()) {
+            break;
+        }
+        expected_part_ms = 0.8 * expected_part_ms + 0.2 * part_time.elapsedMs();
+        part = std::chrono::microseconds(long(expected_part_ms * 1000));
+        ++parts;
+    }
+    Metrics::instance().sample("download.parts_per_frame", parts);
+}
+
+bool Director::setPreview(bool preview_requested)
 {
     std::unique_lock<std::mutex> lock(mutex);
+    if(preview_requested && is_picture_requested) {
+        // acquireCamera() may already have returned
+        return false;
+    }
     is_preview_running = preview_requested;
 
     if(is_picture_requested && !preview_requested) {
         cond_picture_possible.notify_all();
     }
+    return true;
 }
 
 
+void Director::updateFocus()
+{
+    if(focus_requested.exchange(false)) {
+        focus_engine.start();
+    }
+    if(!focus_engine.isActive()) {
+        return;
+    }
+    if(is_picture_requested) {
+        // a guest is waiting, the camera's own AF has to do
+        focus_engine.cancel();
+        return;
+    }
+
+    int step = focus_engine.update(cam.lastSharpness());
+    if(step != 0) {
+        cam.manualFocus(step);
+    }
+
+    if(!focus_engine.isActive()) {
+        Metrics::instance().sample("focus.frames", focus_engine.framesUsed());
+        Metrics::instance().sample("focus.sharpness", focus_engine.bestSharpness());
+    }
+}
+
+void Director::updateExposure()
+{
+    const Histogram& histogram = cam.lastHistogram();
+
+    Metrics::instance().set("exposure.mean_luma", histogram.meanLuma());
+    Metrics::instance().set("exposure.clipped_percent", 100.0 * histogram.fractionAbove(250));
+
+    if(++exposure_frames % EXPOSURE_INFO_FRAMES == 0) {
+        emit exposureInfo(ExposureController::plot(histogram), QString::fromStdString(exposure.describe()));
+    }
+
+    // never change settings while a guest is being photographed
+    if(!auto_exposure || is_picture_requested || focus_engine.isActive()) {
+        return;
+    }
+    if(!exposure.update(histogram)) {
+        return;
+    }
+
+    // read the choices and the current values from the cached configuration,
+    // somebody might have turned a dial in the meantime
+    CameraConfig& config = cam.configuration();
+    const char* keys[] = { "iso", "shutterspeed", "aperture" };
+    for(const char* key : keys) {
+        std::vector<std::string> choices;
+        std::string current;
+        if(config.getChoices(key, choices) >= GP_OK && config.getString(key, current) >= GP_OK) {
+            exposure.setChoices(key, choices, current);
+        }
+    }
+
+    std::map<std::string, std::string> settings;
+    if(exposure.plan(settings)) {
+        Stopwatch apply_time;
+        cam.applySettings(settings);
+        Metrics::instance().sample("exposure.apply_ms", apply_time.elapsedMs());
+        Metrics::instance().sample("exposure.error_ev", exposure.exposureError());
+        Metrics::instance().count("exposure.adjustments");
+        std::cout << "exposure " << exposure.describe() << std::endl;
+    }
+}
+
 void Director::run()
 {
+    long frame = 0;
+
     //    cam.testLoop();
     //    cam.autoFocus();
     while(running) {
         {
             std::unique_lock<std::mutex> lock(mutex);
-            while(is_picture_requested) {
+            while(is_picture_requested && running) {
                 cond_preview_possible.wait(lock);
             }
         }
 
+        if(!cam.isConnected()) {
+            connectCamera();
+            continue;
+        }
+
+        waitForNextFrame();
+        if(!running || is_picture_requested) {
+            continue;
+        }
 
-        setPreview(true);
+        if(!setPreview(true)) {
+            continue;
+        }
 //        cam.autoFocus();
-//        cam.handleEvents();
-        cam.takePreviewImage();
+        if(++frame % EVENT_POLL_FRAMES == 0) {
+            cam.handleEvents();
+        }
+        if(cam.takePreviewImage()) {
+            if(loop_encoder) {
+                keepLoopFrame();
+            }
+            if(timelapse) {
+                keepTimelapseFrame();
+            }
+            updateFocus();
+            updateExposure();
+        }
+        if(cam.isDownloading()) {
+            downloadBetweenFrames();
+        }
 
         setPreview(false);
     }
+
+    // the guests' last picture must not stay on the camera
+    if(cam.isDownloading()) {
+        cam.finishDownload();
+    }
 }
 
 #include "moc_director.cpp"
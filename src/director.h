@@ -2,10 +2,19 @@
 #define DIRECTOR_H
 
 #include <QObject>
+#include <atomic>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 
+#include "focus_engine.h"
+#include "exposure_controller.h"
+#include "jpeg_ring.h"
+
 class EOSCamera;
+class LoopEncoder;
+class FramePacer;
+class TimelapseWriter;
 
 class Director : public QObject
 {
@@ -17,14 +26,42 @@ public:
     void run();
     void stop();
 
+    void setAutoFocusOnPrearm(bool auto_focus);
+    void setFocusAssist(bool focus_assist);
+    void setAutoExposure(bool auto_exposure);
+    void setLoopEncoder(LoopEncoder* encoder, bool boomerang);
+    /* live view frames are fetched only as fast as the display shows them */
+    void setFramePacer(FramePacer* pacer);
+    /* a live view frame every interval_ms, while no guests are there */
+    void setTimelapse(TimelapseWriter* writer, int interval_ms);
+
 private:
-    void setPreview(bool p);
+    /* false if a picture was requested, the camera is not free for the preview then */
+    bool setPreview(bool p);
+    void updateFocus();
+    void updateExposure();
+    void keepLoopFrame();
+    void keepTimelapseFrame();
+    void connectCamera();
+    void waitForNextFrame();
+    void downloadBetweenFrames();
+    void flushDownload();
+
+    bool acquireCamera();
+    void releaseCamera();
 
 public slots:
-    void takePicture();
+    void prearm(int countdown_ms);
+    void takePicture(qint64 countdown_end_us);
+    void focus();
+    void recordLoop();
+    void setGuestsPresent(bool present);
 
 signals:
     void doneTakingPicture();
+    void exposureInfo(QImage histogram, QString settings);
+    void cameraLost();
+    void cameraReconnected();
 
 private:
     EOSCamera& cam;
@@ -32,11 +69,41 @@ private:
     std::mutex mutex;
     std::condition_variable cond_picture_possible;
     std::condition_variable cond_preview_possible;
+    std::condition_variable cond_stopped;
 
     bool running;
 
     bool is_preview_running;
-    bool is_picture_requested;
+    bool is_connecting;                       // the camera thread waits for the camera to come back
+    std::atomic<bool> is_picture_requested;   // also read by the camera thread between frames
+
+    bool auto_focus_on_prearm;
+    bool is_prearmed;
+    double expected_prearm_ms;
+
+    bool focus_assist;
+    std::atomic<bool> focus_requested;
+    FocusEngine focus_engine;
+
+    bool auto_exposure;
+    long exposure_frames;
+    ExposureController exposure;
+
+    LoopEncoder* loop_encoder;
+    bool boomerang;
+    JpegRing loop_frames;
+
+    bool was_connected;
+
+    FramePacer* frame_pacer;
+    std::chrono::steady_clock::time_point last_fetch;
+    double expected_part_ms;
+
+    TimelapseWriter* timelapse;
+    std::chrono::milliseconds timelapse_interval;
+    std::chrono::steady_clock::time_point next_timelapse;
+    bool timelapse_deferred;
+    std::atomic<bool> guests_present;
 };
 
 #endif // DIRECTOR_H
@@ -0,0 +1,560 @@
+#include "exporter.h"
+
+#include "crc32c.h"
+#include "metrics.h"
+#include "thread_topology.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <set>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+namespace {
+/* USB sticks want big sequential writes, four blocks keep the reader and the writer busy */
+const std::size_t BLOCK_BYTES = 4 * 1024 * 1024;
+const int BLOCKS = 4;
+const std::size_t ALIGNMENT = 4096;
+/* how much is lost at most when the stick is pulled */
+const uint64_t CHECKPOINT_BYTES = 64ull * 1024 * 1024;
+const double REPORT_INTERVAL_S = 1.0;
+const std::string MANIFEST_NAME = ".photobox-export";
+const std::string PART_SUFFIX = ".part";
+
+bool ends_with(const std::string& str, const std::string& suffix)
+{
+    return str.size() >= suffix.size() &&
+            str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/* the files this process is still writing; the booth names its own with PART_SUFFIX until they are complete */
+std::set<std::string> open_files()
+{
+    std::set<std::string> paths;
+    DIR* fds = opendir("/proc/self/fd");
+    if(!fds) {
+        return paths;
+    }
+    while(struct dirent* entry = readdir(fds)) {
+        char target[PATH_MAX];
+        ssize_t length = readlink((std::string("/proc/self/fd/") + entry->d_name).c_str(), target, sizeof(target) - 1);
+        if(length > 0) {
+            paths.insert(std::string(target, length));
+        }
+    }
+    closedir(fds);
+    return paths;
+}
+
+void set_idle_io_priority()
+{
+#ifdef SYS_ioprio_set
+    // for the calling thread: the stick only gets what the camera and the gallery leave
+    const int IOPRIO_WHO_PROCESS = 1;
+    const int IOPRIO_CLASS_IDLE = 3;
+    const int IOPRIO_CLASS_SHIFT = 13;
+    if(syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0) {
+        fprintf(stderr, "cannot lower the I/O priority of the export: %s\n", strerror(errno));
+    }
+#endif
+}
+
+ssize_t read_full(int fd, unsigned char* data, std::size_t size)
+{
+    std::size_t done = 0;
+    while(done < size) {
+        ssize_t n = read(fd, data + done, size - done);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0) {
+            return -1;
+        }
+        if(n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+bool write_full(int fd, const unsigned char* data, std::size_t size)
+{
+    std::size_t done = 0;
+    while(done < size) {
+        ssize_t n = write(fd, data + done, size - done);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/* /proc/mounts writes spaces and tabs in paths as \040 and \011 */
+std::string unescape_mount_path(const std::string& path)
+{
+    std::string result;
+    for(std::size_t i = 0; i < path.size(); ++i) {
+        if(path[i] == '\\' && i + 3 < path.size()) {
+            result += char(strtol(path.substr(i + 1, 3).c_str(), NULL, 8));
+            i += 3;
+        } else {
+            result += path[i];
+        }
+    }
+    return result;
+}
+
+std::string directory_name(const std::string& path)
+{
+    std::string trimmed = path;
+    while(trimmed.size() > 1 && trimmed.back() == '/') {
+        trimmed.pop_back();
+    }
+    std::size_t slash = trimmed.rfind('/');
+    return slash == std::string::npos ? trimmed : trimmed.substr(slash + 1);
+}
+
+/* reads the file back from the stick, not from the page cache */
+bool verify(const std::string& path, uint64_t size, uint32_t expected, unsigned char* buffer)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+    // the pages are clean after fdatasync(), so this drops them
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    uint32_t crc = 0;
+    uint64_t total = 0;
+    ssize_t n;
+    while((n = read_full(fd, buffer, BLOCK_BYTES)) > 0) {
+        crc = crc32c::extend(crc, buffer, n);
+        total += n;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return n == 0 && total == size && crc == expected;
+}
+}
+
+Exporter::Result::Result()
+    : copied(0), skipped(0), failed(0), bytes(0), seconds(0)
+{
+}
+
+Exporter::Exporter(const std::string& output_directory)
+    : output_directory(output_directory), busy(false), cancelled(false), manifest_fd(-1), last_report_s(0)
+{
+}
+
+Exporter::~Exporter()
+{
+    cancel();
+    if(worker.joinable()) {
+        worker.join();
+    }
+}
+
+bool Exporter::isBusy() const
+{
+    return busy;
+}
+
+bool Exporter::start(const std::string& target)
+{
+    bool expected = false;
+    if(!busy.compare_exchange_strong(expected, true)) {
+        fprintf(stderr, "the export is still running\n");
+        return false;
+    }
+    if(worker.joinable()) {
+        worker.join();
+    }
+    cancelled = false;
+    worker = std::thread([this, target]() {
+        ThreadTopology::enter(ThreadTopology::BACKGROUND);
+        run(target);
+        busy = false;
+    });
+    return true;
+}
+
+void Exporter::cancel()
+{
+    cancelled = true;
+}
+
+void Exporter::exportToRemovableMedia()
+{
+    std::string target = findRemovableMedia();
+    if(target.empty()) {
+        emit finished("Kein USB-Stick gefunden");
+        return;
+    }
+    start(target);
+}
+
+std::string Exporter::findRemovableMedia()
+{
+    std::ifstream mounts("/proc/mounts");
+    std::string line;
+    while(std::getline(mounts, line)) {
+        std::istringstream fields(line);
+        std::string device, mount_point;
+        fields >> device >> mount_point;
+        mount_point = unescape_mount_path(mount_point);
+        // where udisks and usbmount put sticks and cards
+        bool removable = mount_point.compare(0, 7, "/media/") == 0 || mount_point.compare(0, 11, "/run/media/") == 0;
+        if(removable && access(mount_point.c_str(), W_OK) == 0) {
+            return mount_point;
+        }
+    }
+    return std::string();
+}
+
+Exporter::Result Exporter::run(const std::string& target)
+{
+    set_idle_io_priority();
+    Stopwatch export_time;
+    Result result;
+
+    std::string destination = target + "/" + directory_name(output_directory) + "/";
+    if(mkdir(destination.c_str(), 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "cannot create %s: %s\n", destination.c_str(), strerror(errno));
+        emit finished("Export fehlgeschlagen");
+        ++result.failed;
+        return result;
+    }
+    manifest_path = destination + MANIFEST_NAME;
+    loadManifest();
+    manifest_fd = open(manifest_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(manifest_fd < 0) {
+        fprintf(stderr, "cannot write %s: %s\n", manifest_path.c_str(), strerror(errno));
+    }
+
+    std::vector<std::string> names;
+    DIR* directory = opendir(output_directory.c_str());
+    if(directory) {
+        while(struct dirent* entry = readdir(directory)) {
+            std::string name = entry->d_name;
+            // hidden files and files that are still being written
+            if(name[0] != '.' && !ends_with(name, PART_SUFFIX)) {
+                names.push_back(name);
+            }
+        }
+        closedir(directory);
+    }
+    // the pictures are named by time, the oldest are the most important ones to have
+    std::sort(names.begin(), names.end());
+    char* resolved = realpath(output_directory.c_str(), NULL);
+    const std::string real_directory = resolved ? std::string(resolved) + "/" : output_directory;
+    free(resolved);
+    printf("exporting %d files from %s to %s (CRC-32C %s)\n", int(names.size()), output_directory.c_str(),
+           destination.c_str(), crc32c::isAccelerated() ? "SSE 4.2" : "table");
+
+    last_report_s = 0;
+    int done = 0;
+    for(const std::string& name : names) {
+        if(cancelled) {
+            break;
+        }
+        struct stat source;
+        if(stat((output_directory + name).c_str(), &source) != 0 || !S_ISREG(source.st_mode)) {
+            ++done;
+            continue;
+        }
+
+        if(open_files().count(real_directory + name) > 0) {
+            // still being written, the next export takes it
+            printf("%s is still open, not exported\n", name.c_str());
+            Metrics::instance().count("export.still_open");
+            ++done;
+            continue;
+        }
+
+        auto known = manifest.find(name);
+        struct stat copy;
+        bool exported = known != manifest.end() && known->second.done &&
+                known->second.size == uint64_t(source.st_size) && known->second.mtime == source.st_mtime &&
+                stat((destination + name).c_str(), &copy) == 0 && copy.st_size == source.st_size;
+        if(exported) {
+            ++result.skipped;
+        } else if(copyFile(name, source.st_size, source.st_mtime, destination, result)) {
+            ++result.copied;
+        } else if(!cancelled) {
+            ++result.failed;
+        }
+        ++done;
+
+        result.seconds = export_time.elapsedMs() / 1000.0;
+        if(result.seconds - last_report_s >= REPORT_INTERVAL_S) {
+            last_report_s = result.seconds;
+            report(result, names.size() - done, false);
+        }
+    }
+
+    if(manifest_fd >= 0) {
+        close(manifest_fd);
+        manifest_fd = -1;
+    }
+    result.seconds = export_time.elapsedMs() / 1000.0;
+    report(result, names.size() - done, true);
+    return result;
+}
+
+bool Exporter::copyFile(const std::string& name, uint64_t size, int64_t mtime, const std::string& destination, Result& result)
+{
+    const std::string source_path = output_directory + name;
+    const std::string target_path = destination + name;
+    const std::string part_path = target_path + PART_SUFFIX;
+
+    // continue an interrupted copy of the same file at its last checkpoint
+    uint64_t offset = 0;
+    uint32_t crc = 0;
+    auto known = manifest.find(name);
+    struct stat part;
+    if(known != manifest.end() && !known->second.done && known->second.size == size && known->second.mtime == mtime &&
+            stat(part_path.c_str(), &part) == 0 && uint64_t(part.st_size) >= known->second.offset) {
+        offset = known->second.offset;
+        crc = known->second.crc;
+        Metrics::instance().count("export.resumed");
+    }
+
+    int in = open(source_path.c_str(), O_RDONLY);
+    if(in < 0) {
+        fprintf(stderr, "cannot read %s: %s\n", source_path.c_str(), strerror(errno));
+        return false;
+    }
+    int out = open(part_path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if(out < 0 || ftruncate(out, offset) != 0 || lseek(out, offset, SEEK_SET) < 0 || lseek(in, offset, SEEK_SET) < 0) {
+        fprintf(stderr, "cannot write %s: %s\n", part_path.c_str(), strerror(errno));
+        close(in);
+        if(out >= 0) {
+            close(out);
+        }
+        return false;
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // aligned for the page cache and for sticks with 4k erase pages
+    std::vector<unsigned char*> blocks(BLOCKS);
+    for(unsigned char*& block : blocks) {
+        void* memory = nullptr;
+        if(posix_memalign(&memory, ALIGNMENT, BLOCK_BYTES) != 0) {
+            memory = nullptr;
+        }
+        block = static_cast<unsigned char*>(memory);
+    }
+
+    // the reader fills free blocks while the writer empties full ones
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<int> free_blocks;
+    std::deque<std::pair<int, ssize_t> > full_blocks;
+    bool stop = false;
+    for(int i = 0; i < BLOCKS; ++i) {
+        if(blocks[i]) {
+            free_blocks.push_back(i);
+        }
+    }
+    bool ok = free_blocks.size() == std::size_t(BLOCKS);
+    if(!ok) {
+        fprintf(stderr, "cannot allocate the export buffers\n");
+        // let the reader end at once, the writer does not wait for it
+        stop = true;
+    }
+
+    std::thread reader([&]() {
+        ThreadTopology::enter(ThreadTopology::BACKGROUND);
+        set_idle_io_priority();
+        uint64_t read_offset = offset;
+        while(true) {
+            int block;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while(free_blocks.empty() && !stop) {
+                    cond.wait(lock);
+                }
+                if(stop) {
+                    return;
+                }
+                block = free_blocks.front();
+                free_blocks.pop_front();
+            }
+            ssize_t n = read_full(in, blocks[block], BLOCK_BYTES);
+            if(n > 0) {
+                // guests' pictures stay in the cache, the export does not need them again
+                posix_fadvise(in, read_offset, n, POSIX_FADV_DONTNEED);
+                read_offset += n;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            full_blocks.push_back(std::make_pair(block, n));
+            cond.notify_all();
+            if(n <= 0) {
+                return;
+            }
+        }
+    });
+
+    uint64_t written = offset;
+    uint64_t checkpoint = offset;
+    while(ok) {
+        std::pair<int, ssize_t> full;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while(full_blocks.empty()) {
+                cond.wait(lock);
+            }
+            full = full_blocks.front();
+            full_blocks.pop_front();
+        }
+        if(full.second < 0) {
+            fprintf(stderr, "cannot read %s: %s\n", source_path.c_str(), strerror(errno));
+            ok = false;
+            break;
+        }
+        if(full.second == 0) {
+            break;
+        }
+        crc = crc32c::extend(crc, blocks[full.first], full.second);
+        if(!write_full(out, blocks[full.first], full.second)) {
+            fprintf(stderr, "cannot write %s: %s\n", part_path.c_str(), strerror(errno));
+            ok = false;
+            break;
+        }
+        written += full.second;
+        result.bytes += full.second;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            free_blocks.push_back(full.first);
+            cond.notify_all();
+        }
+
+        if(written - checkpoint >= CHECKPOINT_BYTES && fdatasync(out) == 0) {
+            checkpoint = written;
+            Entry entry = { false, size, mtime, written, crc };
+            record(name, entry);
+        }
+        if(cancelled) {
+            ok = false;
+            break;
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stop = true;
+        cond.notify_all();
+    }
+    reader.join();
+    close(in);
+
+    ok = ok && written == size && fdatasync(out) == 0;
+    ok = close(out) == 0 && ok;
+
+    if(ok && !verify(part_path, size, crc, blocks[0])) {
+        fprintf(stderr, "%s differs on the stick, it is copied again next time\n", name.c_str());
+        Metrics::instance().count("export.verify_failed");
+        unlink(part_path.c_str());
+        Entry entry = { false, size, mtime, 0, 0 };
+        record(name, entry);
+        ok = false;
+    }
+    for(unsigned char* block : blocks) {
+        free(block);
+    }
+    if(!ok) {
+        return false;
+    }
+
+    // the copy keeps the time of the capture
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    utimensat(AT_FDCWD, part_path.c_str(), times, 0);
+    if(rename(part_path.c_str(), target_path.c_str()) != 0) {
+        fprintf(stderr, "cannot rename %s: %s\n", part_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    Entry entry = { true, size, mtime, size, crc };
+    record(name, entry);
+    return true;
+}
+
+void Exporter::loadManifest()
+{
+    manifest.clear();
+    std::ifstream in(manifest_path.c_str());
+    std::string line;
+    // later lines replace earlier ones of the same file
+    while(std::getline(in, line)) {
+        char state[8];
+        unsigned long long size, offset;
+        long long mtime;
+        unsigned int crc;
+        int name_at = 0;
+        if(sscanf(line.c_str(), "%7s %llu %lld %llu %x %n", state, &size, &mtime, &offset, &crc, &name_at) != 5 ||
+                name_at == 0 || name_at >= (int) line.size()) {
+            continue;
+        }
+        Entry entry = { strcmp(state, "done") == 0, size, mtime, offset, crc };
+        manifest[line.substr(name_at)] = entry;
+    }
+}
+
+void Exporter::record(const std::string& name, const Entry& entry)
+{
+    manifest[name] = entry;
+    if(manifest_fd < 0) {
+        return;
+    }
+    char line[128];
+    int length = snprintf(line, sizeof(line), "%s %llu %lld %llu %08x ", entry.done ? "done" : "part",
+                          (unsigned long long) entry.size, (long long) entry.mtime,
+                          (unsigned long long) entry.offset, entry.crc);
+    std::string text = std::string(line, length) + name + "\n";
+    // the manifest must never claim more than the stick has
+    if(!write_full(manifest_fd, (const unsigned char*) text.data(), text.size()) || fdatasync(manifest_fd) != 0) {
+        fprintf(stderr, "cannot update %s: %s\n", manifest_path.c_str(), strerror(errno));
+    }
+}
+
+void Exporter::report(const Result& result, int left, bool done)
+{
+    double mb_per_s = result.seconds > 0 ? result.bytes / (1024.0 * 1024.0) / result.seconds : 0;
+    if(done) {
+        Metrics::instance().sample("export.mb_per_s", mb_per_s);
+        Metrics::instance().count("export.files", result.copied);
+        printf("export %s: %d copied, %d already there, %d failed, %.1f MB in %.1f s (%.1f MB/s)\n",
+               cancelled ? "cancelled" : "done", result.copied, result.skipped, result.failed,
+               result.bytes / (1024.0 * 1024.0), result.seconds, mb_per_s);
+        QString message = result.failed > 0 || cancelled ?
+                QString("Export unvollständig: %1 kopiert, %2 fehlgeschlagen").arg(result.copied).arg(result.failed) :
+                QString("Export fertig: %1 kopiert, %2 schon vorhanden").arg(result.copied).arg(result.skipped);
+        emit finished(message);
+    } else {
+        emit progress(QString("Export: noch %1 Dateien, %2 MB/s").arg(left).arg(mb_per_s, 0, 'f', 1));
+    }
+}
+
+#include "moc_exporter.cpp"
@@ -0,0 +1,90 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <QObject>
+#include <QString>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <thread>
+
+/*
+ * Copies the output directory to a USB stick or SD card, only what is not there yet.
+ *
+ * Each file is read and written at the same time in large aligned blocks, written as name.part,
+ * synced, read back from the stick past the page cache and compared by CRC-32C before it gets
+ * its name. A manifest on the stick (.photobox-export) records the finished files and, every
+ * CHECKPOINT_BYTES, how far the current one got, so an interrupted export continues there.
+ *
+ * The copy runs on a background thread at the idle I/O priority and keeps its files out of
+ * the page cache, so it can run while guests use the booth.
+ */
+class Exporter : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Result
+    {
+        Result();
+
+        int copied;
+        int skipped;
+        int failed;
+        uint64_t bytes;
+        double seconds;
+    };
+
+public:
+    Exporter(const std::string& output_directory);
+    ~Exporter();
+
+    bool isBusy() const;
+    /* exports in the background, see progress() and finished() */
+    bool start(const std::string& target);
+    /* exports in the calling thread */
+    Result run(const std::string& target);
+    /* stops after the current block, the next export resumes */
+    void cancel();
+
+    /* the mount point of a USB stick or SD card, empty if there is none */
+    static std::string findRemovableMedia();
+
+public slots:
+    void exportToRemovableMedia();
+
+signals:
+    void progress(QString message);
+    void finished(QString message);
+
+private:
+    struct Entry
+    {
+        bool done;
+        uint64_t size;
+        int64_t mtime;
+        uint64_t offset;
+        uint32_t crc;
+    };
+
+    bool copyFile(const std::string& name, uint64_t size, int64_t mtime, const std::string& target, Result& result);
+    void loadManifest();
+    void record(const std::string& name, const Entry& entry);
+    void report(const Result& result, int total, bool done);
+
+private:
+    const std::string output_directory;
+
+    std::thread worker;
+    std::atomic<bool> busy;
+    std::atomic<bool> cancelled;
+
+    // only touched by the exporting thread
+    std::string manifest_path;
+    std::map<std::string, Entry> manifest;
+    int manifest_fd;
+    double last_report_s;
+};
+
+#endif // EXPORTER_H
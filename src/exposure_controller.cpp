@@ -0,0 +1,228 @@
+#include "exposure_controller.h"
+
+#include "image_ops.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <sstream>
+
+namespace {
+/* mid grey in the live view */
+const double TARGET_LUMA = 110.0;
+/* the live view is gamma encoded, one stop changes the luma by about 2^(1/2.2) */
+const double GAMMA = 2.2;
+/* errors below this are left alone */
+const double DEAD_BAND_EV = 0.5;
+/* the error has to persist this many frames before we act */
+const int STABLE_FRAMES = 15;
+/* frames to wait after a change until the live view shows it */
+const int HOLD_FRAMES = 30;
+/* protect highlights: at most this fraction of the picture may clip */
+const int CLIP_LEVEL = 250;
+const double MAX_CLIPPED = 0.02;
+
+/* limits for people pictures: no motion blur, not too much noise */
+const double SLOWEST_SHUTTER = 1.0 / 30.0;
+const double FASTEST_SHUTTER = 1.0 / 250.0;
+const double HIGHEST_ISO = 3200.0;
+
+const double NOT_AN_EV = std::numeric_limits<double>::quiet_NaN();
+}
+
+ExposureController::ExposureController()
+    : error(0), stable_frames(0), hold_frames(0)
+{
+}
+
+double ExposureController::parseEv(const std::string& key, const std::string& value)
+{
+    const char* str = value.c_str();
+    if(key == "iso") {
+        double iso = strtod(str, NULL);
+        return iso > 0 ? std::log2(iso / 100.0) : NOT_AN_EV;
+
+    } else if(key == "shutterspeed") {
+        char* end;
+        double seconds = strtod(str, &end);
+        if(*end == '/') {
+            double denominator = strtod(end + 1, NULL);
+            seconds = denominator > 0 ? seconds / denominator : 0;
+        }
+        return seconds > 0 ? std::log2(seconds) : NOT_AN_EV;
+
+    } else if(key == "aperture") {
+        if(value.compare(0, 2, "f/") == 0) {
+            str += 2;
+        }
+        double f_number = strtod(str, NULL);
+        return f_number > 0 ? -2.0 * std::log2(f_number) : NOT_AN_EV;
+    }
+    return NOT_AN_EV;
+}
+
+void ExposureController::setChoices(const std::string& key, const std::vector<std::string>& choices,
+                                    const std::string& current)
+{
+    Axis* a = axis(key);
+    if(a == nullptr) {
+        axes.push_back(Axis());
+        a = &axes.back();
+        a->key = key;
+    }
+
+    a->choices = choices;
+    a->ev.clear();
+    a->current = -1;
+    for(std::size_t i = 0; i < choices.size(); ++i) {
+        a->ev.push_back(parseEv(key, choices[i]));
+        if(choices[i] == current) {
+            a->current = i;
+        }
+    }
+
+    a->min_ev = -std::numeric_limits<double>::infinity();
+    a->max_ev = std::numeric_limits<double>::infinity();
+    if(key == "shutterspeed") {
+        a->min_ev = std::log2(FASTEST_SHUTTER);
+        a->max_ev = std::log2(SLOWEST_SHUTTER);
+    } else if(key == "iso") {
+        a->max_ev = std::log2(HIGHEST_ISO / 100.0);
+    }
+}
+
+bool ExposureController::hasChoices() const
+{
+    return !axes.empty();
+}
+
+ExposureController::Axis* ExposureController::axis(const std::string& key)
+{
+    for(Axis& a : axes) {
+        if(a.key == key) {
+            return &a;
+        }
+    }
+    return nullptr;
+}
+
+bool ExposureController::update(const Histogram& histogram)
+{
+    if(hold_frames > 0) {
+        --hold_frames;
+        return false;
+    }
+
+    double mean = std::max(1.0, histogram.meanLuma());
+    error = GAMMA * std::log2(TARGET_LUMA / mean);
+    if(histogram.fractionAbove(CLIP_LEVEL) > MAX_CLIPPED) {
+        // a lamp or a window in the frame must not push the guests into the dark:
+        // darker only while the picture is bright anyway, otherwise hold
+        error = mean > TARGET_LUMA ? std::min(error, -DEAD_BAND_EV) : 0.0;
+    }
+
+    if(std::fabs(error) < DEAD_BAND_EV) {
+        stable_frames = 0;
+        return false;
+    }
+    if(++stable_frames < STABLE_FRAMES) {
+        return false;
+    }
+    stable_frames = 0;
+    return true;
+}
+
+double ExposureController::adjust(Axis& a, double delta, std::map<std::string, std::string>& settings)
+{
+    if(a.current < 0 || std::isnan(a.ev[a.current])) {
+        return 0.0;
+    }
+
+    // only move in the wanted direction, and not beyond the limits
+    double now = a.ev[a.current];
+    double target = delta > 0 ? std::max(now, std::min(now + delta, a.max_ev))
+                              : std::min(now, std::max(now + delta, a.min_ev));
+
+    int best = a.current;
+    for(std::size_t i = 0; i < a.ev.size(); ++i) {
+        if(!std::isnan(a.ev[i]) && std::fabs(a.ev[i] - target) < std::fabs(a.ev[best] - target)) {
+            best = i;
+        }
+    }
+    if(best == a.current) {
+        return 0.0;
+    }
+
+    settings[a.key] = a.choices[best];
+    a.current = best;
+    return a.ev[best] - now;
+}
+
+bool ExposureController::plan(std::map<std::string, std::string>& settings)
+{
+    settings.clear();
+
+    // brighter: longer exposure first, then more gain; darker: less gain first
+    const char* brighter[] = { "shutterspeed", "iso", "aperture" };
+    const char* darker[] = { "iso", "shutterspeed", "aperture" };
+    const char** order = error > 0 ? brighter : darker;
+
+    double remaining = error;
+    for(int i = 0; i < 3 && std::fabs(remaining) >= DEAD_BAND_EV / 2; ++i) {
+        Axis* a = axis(order[i]);
+        if(a) {
+            remaining -= adjust(*a, remaining, settings);
+        }
+    }
+
+    if(!settings.empty()) {
+        hold_frames = HOLD_FRAMES;
+    }
+    return !settings.empty();
+}
+
+double ExposureController::exposureError() const
+{
+    return error;
+}
+
+std::string ExposureController::describe() const
+{
+    std::ostringstream out;
+    for(const Axis& a : axes) {
+        if(a.current < 0) {
+            continue;
+        }
+        if(a.key == "iso") {
+            out << "ISO " << a.choices[a.current] << "  ";
+        } else if(a.key == "aperture") {
+            out << "f/" << a.choices[a.current] << "  ";
+        } else {
+            out << a.choices[a.current] << "  ";
+        }
+    }
+    out << (error >= 0 ? "+" : "") << std::round(error * 10) / 10 << " EV";
+    return out.str();
+}
+
+QImage ExposureController::plot(const Histogram& histogram)
+{
+    const int height = 100;
+    QImage image(256, height, QImage::Format_ARGB32);
+    image.fill(qRgba(0, 0, 0, 128));
+
+    uint32_t max = 1;
+    for(int i = 0; i < 256; ++i) {
+        max = std::max(max, histogram.luma[i]);
+    }
+
+    for(int x = 0; x < 256; ++x) {
+        int bar = histogram.luma[x] * height / max;
+        QRgb color = x >= CLIP_LEVEL ? qRgb(255, 0, 0) : qRgb(255, 255, 255);
+        for(int y = height - bar; y < height; ++y) {
+            reinterpret_cast<QRgb*>(image.scanLine(y))[x] = color;
+        }
+    }
+    return image;
+}
@@ -0,0 +1,69 @@
+#ifndef EXPOSURE_CONTROLLER_H
+#define EXPOSURE_CONTROLLER_H
+
+#include <QImage>
+#include <map>
+#include <string>
+#include <vector>
+
+struct Histogram;
+
+/*
+ * Keeps the live view (and thus the captures) well exposed by adjusting
+ * shutter speed, ISO and aperture from the live view histogram.
+ *
+ * Only reacts to errors that are larger than a dead band and persist for a while,
+ * then waits for the camera to settle, so that it does not flood the USB link
+ * with settings while people walk through the picture.
+ */
+class ExposureController
+{
+public:
+    ExposureController();
+
+    /* available and current values of one setting, as the camera reports them */
+    void setChoices(const std::string& key, const std::vector<std::string>& choices, const std::string& current);
+    bool hasChoices() const;
+
+    /*
+     * Feed the histogram of the newest frame.
+     * Returns true if the exposure should be changed, call plan() then.
+     */
+    bool update(const Histogram& histogram);
+
+    /*
+     * The settings that correct the current exposure error,
+     * empty if there is nothing the camera can do.
+     */
+    bool plan(std::map<std::string, std::string>& settings);
+
+    double exposureError() const;
+    std::string describe() const;
+
+    static QImage plot(const Histogram& histogram);
+
+private:
+    struct Axis
+    {
+        std::string key;
+        std::vector<std::string> choices;
+        std::vector<double> ev;  // brightness of each choice, higher is brighter
+        int current;
+        double min_ev;
+        double max_ev;
+    };
+
+    static double parseEv(const std::string& key, const std::string& value);
+
+    Axis* axis(const std::string& key);
+    double adjust(Axis& axis, double delta, std::map<std::string, std::string>& settings);
+
+private:
+    std::vector<Axis> axes;
+
+    double error;
+    int stable_frames;
+    int hold_frames;
+};
+
+#endif // EXPOSURE_CONTROLLER_H
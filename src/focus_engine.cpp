@@ -0,0 +1,127 @@
+#include "focus_engine.h"
+
+#include <algorithm>
+
+namespace {
+/* frames to skip after a step, the lens moves while the next frame is exposed */
+const int SETTLE_FRAMES = 1;
+/* relative improvement that is not just noise */
+const double MIN_GAIN = 0.02;
+const int COARSE_STEP = 2;
+}
+
+FocusEngine::FocusEngine(int max_frames)
+    : max_frames(max_frames), active(false), has_reference(false), climbed(false),
+      frames(0), settle(0), returning(0), steps_since_peak(0),
+      direction(1), step(COARSE_STEP), peak(0), best(0)
+{
+}
+
+void FocusEngine::start()
+{
+    active = true;
+    has_reference = false;
+    climbed = false;
+    frames = 0;
+    returning = 0;
+    steps_since_peak = 0;
+    settle = 0;
+    direction = 1;
+    step = COARSE_STEP;
+    peak = 0;
+    best = 0;
+}
+
+void FocusEngine::cancel()
+{
+    active = false;
+}
+
+bool FocusEngine::isActive() const
+{
+    return active;
+}
+
+int FocusEngine::framesUsed() const
+{
+    return frames;
+}
+
+double FocusEngine::bestSharpness() const
+{
+    return best;
+}
+
+int FocusEngine::move()
+{
+    ++steps_since_peak;
+    settle = SETTLE_FRAMES;
+    return direction * step;
+}
+
+int FocusEngine::update(double sharpness)
+{
+    if(!active) {
+        return 0;
+    }
+
+    ++frames;
+    if(frames > max_frames) {
+        active = false;
+        return 0;
+    }
+
+    if(returning > 0) {
+        // walking back onto the peak, no need to look at the frames
+        if(--returning == 0) {
+            active = false;
+        }
+        return direction;
+    }
+
+    if(settle > 0) {
+        --settle;
+        return 0;
+    }
+
+    best = std::max(best, sharpness);
+
+    if(!has_reference || sharpness > peak * (1.0 + MIN_GAIN)) {
+        // still climbing, keep going
+        climbed = has_reference;
+        has_reference = true;
+        peak = sharpness;
+        steps_since_peak = 0;
+        return move();
+    }
+
+    if(sharpness >= peak * (1.0 - MIN_GAIN)) {
+        // flat within the noise, keep going until it clearly drops
+        if(sharpness > peak) {
+            peak = sharpness;
+            steps_since_peak = 0;
+        }
+        return move();
+    }
+
+    direction = -direction;
+
+    if(!climbed || step > 1) {
+        // either the first step went the wrong way or we overshot with a coarse step:
+        // turn around, refining the step once we know which side the peak is on
+        if(climbed) {
+            --step;
+        }
+        climbed = true;
+        peak = sharpness;
+        steps_since_peak = 0;
+        return move();
+    }
+
+    // already at the finest step: go back onto the peak and stop
+    returning = steps_since_peak - 1;
+    if(returning == 0) {
+        active = false;
+    }
+    return direction;
+}
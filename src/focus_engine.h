@@ -0,0 +1,51 @@
+#ifndef FOCUS_ENGINE_H
+#define FOCUS_ENGINE_H
+
+/*
+ * Contrast detection focus: hill-climbs the sharpness of the live view
+ * by driving the lens in manual focus steps.
+ *
+ * Steps follow the Canon manualfocusdrive convention,
+ * -3 .. -1 move towards near, 1 .. 3 towards far, larger is coarser.
+ */
+class FocusEngine
+{
+public:
+    FocusEngine(int max_frames = 60);
+
+    void start();
+    void cancel();
+    bool isActive() const;
+
+    /*
+     * Feed the sharpness of the newest live view frame.
+     * Returns the focus step to drive next, 0 if the lens should stay.
+     */
+    int update(double sharpness);
+
+    int framesUsed() const;
+    double bestSharpness() const;
+
+private:
+    int move();
+
+private:
+    const int max_frames;
+
+    bool active;
+    bool has_reference;
+    bool climbed;
+
+    int frames;
+    int settle;
+    int returning;
+    int steps_since_peak;
+
+    int direction;
+    int step;
+
+    double peak;
+    double best;
+};
+
+#endif // FOCUS_ENGINE_H
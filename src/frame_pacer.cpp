@@ -0,0 +1,114 @@
+#include "frame_pacer.h"
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+/* the camera never has to wait longer than this for the next fetch, 5 fps */
+const double MAX_FETCH_INTERVAL_MS = 200.0;
+/* without guests for this long the live view runs at IDLE_FETCH_INTERVAL_MS */
+const int IDLE_AFTER_MS = 120 * 1000;
+const double IDLE_FETCH_INTERVAL_MS = 100.0;
+/* frames wait for the next refresh, up to one period off is the timer's rounding and no judder */
+const double JUDDER_REFRESHES = 1.0;
+
+double ms(FramePacer::Clock::duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+}
+
+FramePacer::FramePacer(double refresh_rate)
+    : refresh_ms(1000.0 / (refresh_rate > 0 ? refresh_rate : 60.0)),
+      has_pending(false), has_presented(false),
+      last_activity(Clock::now()), fetch_interval_ms(0)
+{
+}
+
+double FramePacer::refreshIntervalMs() const
+{
+    return refresh_ms;
+}
+
+void FramePacer::offer(const QImage& frame, Clock::time_point captured)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(has_pending) {
+        if(captured < pending_captured) {
+            return;
+        }
+        // the display never saw the one before
+        Metrics::instance().count("pacing.frames_wasted");
+        adapt(true);
+    }
+    pending = frame;
+    pending_captured = captured;
+    has_pending = true;
+}
+
+bool FramePacer::take(Clock::time_point now, QImage& frame)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(last_refresh != Clock::time_point() && ms(now - last_refresh) > 1.5 * refresh_ms) {
+        // the GUI thread was busy and missed a refresh
+        Metrics::instance().count("pacing.refresh_late");
+    }
+    last_refresh = now;
+
+    if(!has_pending) {
+        return false;
+    }
+    frame = pending;
+    pending = QImage();
+    has_pending = false;
+
+    Metrics::instance().count("pacing.frames_presented");
+    Metrics::instance().sample("pacing.latency_ms", ms(now - pending_captured));
+
+    // judder: the frames are shown at other intervals than the camera took them
+    if(has_presented) {
+        double judder = std::abs(ms(now - last_presented) - ms(pending_captured - last_presented_captured));
+        Metrics::instance().sample("pacing.judder_ms", judder);
+        if(judder > JUDDER_REFRESHES * refresh_ms) {
+            Metrics::instance().count("pacing.judder");
+        }
+    }
+    has_presented = true;
+    last_presented = now;
+    last_presented_captured = pending_captured;
+
+    adapt(false);
+    return true;
+}
+
+void FramePacer::markActivity(Clock::time_point now)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    last_activity = now;
+}
+
+FramePacer::Clock::time_point FramePacer::nextFetch(Clock::time_point last_fetch) const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    double interval = fetch_interval_ms;
+    if(ms(last_fetch - last_activity) > IDLE_AFTER_MS) {
+        interval = std::max(interval, IDLE_FETCH_INTERVAL_MS);
+    }
+    return last_fetch + std::chrono::microseconds((long) (interval * 1000));
+}
+
+void FramePacer::adapt(bool wasted)
+{
+    // back off quickly while frames are thrown away, speed up slowly while all are shown
+    if(wasted) {
+        fetch_interval_ms = std::min(MAX_FETCH_INTERVAL_MS, std::max(refresh_ms, fetch_interval_ms * 1.2));
+    } else {
+        fetch_interval_ms *= 0.95;
+        if(fetch_interval_ms < 1.0) {
+            fetch_interval_ms = 0;
+        }
+    }
+    Metrics::instance().set("pacing.fetch_interval_ms", fetch_interval_ms);
+}
@@ -0,0 +1,62 @@
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <QImage>
+#include <chrono>
+#include <mutex>
+
+/*
+ * Hands live view frames from the camera thread to the display at the refresh rate.
+ *
+ * The camera offers every decoded frame with the time it was fetched. On every refresh
+ * the window takes the newest frame, if there is one it has not shown yet; frames that are
+ * replaced before a refresh came were decoded for nothing and are counted as wasted.
+ *
+ * From that the pacer also tells the director how often to fetch a frame: slower while
+ * frames are wasted (the camera is faster than the display, or the GUI thread is busy),
+ * faster again while every frame is shown, and slow while nobody uses the booth.
+ */
+class FramePacer
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+public:
+    FramePacer(double refresh_rate);
+
+    double refreshIntervalMs() const;
+
+    /* camera thread */
+    void offer(const QImage& frame, Clock::time_point captured);
+
+    /* GUI thread, once per refresh; returns false if there is nothing new to show */
+    bool take(Clock::time_point now, QImage& frame);
+
+    /* a guest is there, the live view has to be fluid */
+    void markActivity(Clock::time_point now);
+
+    /* director thread: the earliest time for the next live view frame */
+    Clock::time_point nextFetch(Clock::time_point last_fetch) const;
+
+private:
+    void adapt(bool wasted);
+
+private:
+    const double refresh_ms;
+
+    mutable std::mutex mutex;
+
+    QImage pending;
+    bool has_pending;
+    Clock::time_point pending_captured;
+
+    bool has_presented;
+    Clock::time_point last_presented;
+    Clock::time_point last_presented_captured;
+    Clock::time_point last_refresh;
+
+    Clock::time_point last_activity;
+    double fetch_interval_ms;
+};
+
+#endif // FRAME_PACER_H
@@ -0,0 +1,510 @@
+#include "gallery_server.h"
+
+#include "jpeg_decoder.h"
+#include "memory_budget.h"
+#include "metrics.h"
+#include "thread_topology.h"
+
+#include <QImage>
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <ifaddrs.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+namespace {
+
+const int WEB_IMAGE_SIZE = 1600;
+const std::string WEB_SUFFIX = ".web.jpg";
+/* the web copies are named after random bytes, a guest gets their own picture and no one else's */
+const int WEB_NAME_BYTES = 16;
+
+/* anybody on the booth network can connect, a phone must not hold a connection or memory forever */
+const std::size_t MAX_REQUEST_BYTES = 8 * 1024;
+const int REQUEST_TIMEOUT_S = 15;
+const int RESPONSE_TIMEOUT_S = 60;
+
+bool ends_with(const std::string& str, const std::string& suffix)
+{
+    return str.size() >= suffix.size() &&
+            str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+std::string local_address()
+{
+    std::string result = "127.0.0.1";
+
+    struct ifaddrs* addresses;
+    if(getifaddrs(&addresses) != 0) {
+        return result;
+    }
+    for(struct ifaddrs* it = addresses; it != nullptr; it = it->ifa_next) {
+        if(it->ifa_addr == nullptr || it->ifa_addr->sa_family != AF_INET) {
+            continue;
+        }
+        char buffer[INET_ADDRSTRLEN];
+        const struct sockaddr_in* in = reinterpret_cast<const struct sockaddr_in*>(it->ifa_addr);
+        inet_ntop(AF_INET, &in->sin_addr, buffer, sizeof(buffer));
+        if(std::string(buffer).compare(0, 4, "127.") != 0) {
+            result = buffer;
+            break;
+        }
+    }
+    freeifaddrs(addresses);
+
+    return result;
+}
+
+std::string random_web_name()
+{
+    static const char digits[] = "0123456789abcdef";
+    std::random_device random;
+    std::string name;
+    for(int i = 0; i < WEB_NAME_BYTES; ++i) {
+        unsigned int byte = random() & 0xff;
+        name += digits[byte >> 4];
+        name += digits[byte & 0xf];
+    }
+    return name + WEB_SUFFIX;
+}
+
+bool is_web_name(const std::string& name)
+{
+    std::size_t length = 2 * WEB_NAME_BYTES;
+    return name.size() == length + WEB_SUFFIX.size() && ends_with(name, WEB_SUFFIX) &&
+            name.find_first_not_of("0123456789abcdef") == length;
+}
+
+
+/*
+ * One client connection. Requests are handled one after the other (keep-alive),
+ * file bodies are pushed with sendfile() whenever the socket is writable.
+ * A deadline closes the connection if a request or a response takes too long,
+ * the handlers run on a strand so that it never gets in between.
+ */
+class HttpSession : public std::enable_shared_from_this<HttpSession>
+{
+public:
+    HttpSession(boost::asio::io_service& io, const std::string& directory, bool with_index)
+        : socket(io), directory(directory), with_index(with_index), strand(io), deadline(io), request_buffer(MAX_REQUEST_BYTES),
+          fd(-1), offset(0), remaining(0), keep_alive(false)
+    {
+    }
+
+    ~HttpSession()
+    {
+        closeFile();
+    }
+
+    void start()
+    {
+        readRequest();
+    }
+
+    tcp::socket socket;
+
+private:
+    void readRequest()
+    {
+        // also how long an idle keep-alive connection stays open
+        startDeadline(REQUEST_TIMEOUT_S);
+        auto self = shared_from_this();
+        boost::asio::async_read_until(socket, request_buffer, "\r\n\r\n",
+                                      strand.wrap([this, self](const boost::system::error_code& ec, std::size_t bytes) {
+            deadline.cancel();
+            if(ec == boost::asio::error::not_found) {
+                // the headers do not fit into MAX_REQUEST_BYTES
+                Metrics::instance().count("gallery.request_too_large");
+            }
+            if(!ec) {
+                handleRequest(bytes);
+            }
+        }));
+    }
+
+    void startDeadline(int seconds)
+    {
+        auto self = shared_from_this();
+        deadline.expires_from_now(std::chrono::seconds(seconds));
+        deadline.async_wait(strand.wrap([this, self](const boost::system::error_code& ec) {
+            // a handler that was already queued when the deadline was moved or cancelled
+            if(ec == boost::asio::error::operation_aborted ||
+                    deadline.expires_at() > boost::asio::steady_timer::clock_type::now()) {
+                return;
+            }
+            Metrics::instance().count("gallery.timeouts");
+            boost::system::error_code ignored;
+            socket.close(ignored);
+        }));
+    }
+
+    void handleRequest(std::size_t header_bytes)
+    {
+        auto begin = boost::asio::buffers_begin(request_buffer.data());
+        std::string head(begin, begin + header_bytes);
+        request_buffer.consume(header_bytes);
+
+        std::istringstream lines(head);
+        std::string method, target, version;
+        lines >> method >> target >> version;
+
+        std::string if_none_match;
+        std::string connection;
+        std::string line;
+        std::getline(lines, line);
+        while(std::getline(lines, line) && line != "\r") {
+            std::size_t colon = line.find(':');
+            if(colon == std::string::npos) {
+                continue;
+            }
+            std::string key = line.substr(0, colon);
+            std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+            std::string value = line.substr(colon + 1);
+            value.erase(0, value.find_first_not_of(' '));
+            value.erase(value.find_last_not_of("\r ") + 1);
+
+            if(key == "if-none-match") {
+                if_none_match = value;
+            } else if(key == "connection") {
+                std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+                connection = value;
+            }
+        }
+
+        keep_alive = (version == "HTTP/1.1" && connection != "close") || connection == "keep-alive";
+
+        bool head_only = method == "HEAD";
+        if(method != "GET" && !head_only) {
+            sendResponse("405 Method Not Allowed", "text/plain", "", head_only);
+            return;
+        }
+
+        std::string name = target.substr(0, target.find('?'));
+        if(name == "/" && with_index) {
+            sendResponse("200 OK", "text/html; charset=utf-8", indexPage(), head_only);
+            return;
+        }
+        boost::system::error_code ec;
+        bool local = socket.remote_endpoint(ec).address().is_loopback() && !ec;
+        if(name == "/stats" && local) {
+            // for the operator on the booth itself: what it holds in memory, and how it is doing
+            std::string stats = "--- memory ---\n" + MemoryBudget::instance().report() +
+                    "--- metrics ---\n" + Metrics::instance().report();
+            sendResponse("200 OK", "text/plain; charset=utf-8", stats, head_only);
+            return;
+        }
+
+        // only the links of the QR codes, nothing that can be listed or guessed
+        name.erase(0, 1);
+        if(!is_web_name(name)) {
+            sendResponse("404 Not Found", "text/plain", "", head_only);
+            return;
+        }
+
+        serveFile(directory + name, if_none_match, head_only);
+    }
+
+    std::string indexPage() const
+    {
+        std::vector<std::pair<time_t, std::string>> images;
+        DIR* dir = opendir(directory.c_str());
+        if(dir) {
+            while(struct dirent* entry = readdir(dir)) {
+                std::string name = entry->d_name;
+                struct stat file_stat;
+                if(is_web_name(name) && stat((directory + name).c_str(), &file_stat) == 0) {
+                    images.push_back(std::make_pair(file_stat.st_mtime, name));
+                }
+            }
+            closedir(dir);
+        }
+        // the names say nothing about the capture, newest first
+        std::sort(images.rbegin(), images.rend());
+
+        std::ostringstream html;
+        html << "<!DOCTYPE html><html><head><meta name=\"viewport\" content=\"width=device-width\">"
+             << "<title>Photobox</title></head><body style=\"margin:0;background:#000\">";
+        for(const auto& entry : images) {
+            const std::string& image = entry.second;
+            html << "<a href=\"" << image << "\" download><img src=\"" << image
+                 << "\" loading=\"lazy\" style=\"width:100%\"></a>";
+        }
+        html << "</body></html>";
+        return html.str();
+    }
+
+    void sendResponse(const std::string& status, const std::string& content_type,
+                      const std::string& body, bool head_only)
+    {
+        std::ostringstream out;
+        out << "HTTP/1.1 " << status << "\r\n"
+            << "Content-Type: " << content_type << "\r\n"
+            << "Content-Length: " << body.size() << "\r\n"
+            << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+        if(!head_only) {
+            out << body;
+        }
+        response = out.str();
+
+        startDeadline(RESPONSE_TIMEOUT_S);
+        auto self = shared_from_this();
+        boost::asio::async_write(socket, boost::asio::buffer(response),
+                                 strand.wrap([this, self](const boost::system::error_code& ec, std::size_t) {
+            deadline.cancel();
+            if(!ec) {
+                finish();
+            }
+        }));
+    }
+
+    void serveFile(const std::string& path, const std::string& if_none_match, bool head_only)
+    {
+        fd = open(path.c_str(), O_RDONLY);
+        struct stat file_stat;
+        if(fd < 0 || fstat(fd, &file_stat) != 0) {
+            closeFile();
+            sendResponse("404 Not Found", "text/plain", "", head_only);
+            return;
+        }
+
+        std::ostringstream etag;
+        etag << "\"" << std::hex << file_stat.st_ino << "-" << file_stat.st_size
+             << "-" << file_stat.st_mtime << "\"";
+
+        if(if_none_match == etag.str()) {
+            closeFile();
+            std::ostringstream out;
+            out << "HTTP/1.1 304 Not Modified\r\n"
+                << "ETag: " << etag.str() << "\r\n"
+                << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+            response = out.str();
+
+        } else {
+            std::ostringstream out;
+            out << "HTTP/1.1 200 OK\r\n"
+                << "Content-Type: image/jpeg\r\n"
+                << "Content-Length: " << file_stat.st_size << "\r\n"
+                << "ETag: " << etag.str() << "\r\n"
+                << "Cache-Control: public, max-age=86400\r\n"
+                << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+            response = out.str();
+
+            offset = 0;
+            remaining = head_only ? 0 : file_stat.st_size;
+        }
+
+        startDeadline(RESPONSE_TIMEOUT_S);
+        auto self = shared_from_this();
+        boost::asio::async_write(socket, boost::asio::buffer(response),
+                                 strand.wrap([this, self](const boost::system::error_code& ec, std::size_t) {
+            if(ec) {
+                deadline.cancel();
+                return;
+            }
+            socket.native_non_blocking(true);
+            sendFileBody();
+        }));
+    }
+
+    void sendFileBody()
+    {
+        while(remaining > 0) {
+            ssize_t n = ::sendfile(socket.native_handle(), fd, &offset, remaining);
+            if(n > 0) {
+                remaining -= n;
+
+            } else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // wait until the socket can take more data, without blocking an io thread
+                auto self = shared_from_this();
+                socket.async_write_some(boost::asio::null_buffers(),
+                                        strand.wrap([this, self](const boost::system::error_code& ec, std::size_t) {
+                    if(!ec) {
+                        sendFileBody();
+                    } else {
+                        deadline.cancel();
+                    }
+                }));
+                return;
+
+            } else {
+                deadline.cancel();
+                closeFile();
+                return;
+            }
+        }
+
+        deadline.cancel();
+        closeFile();
+        finish();
+    }
+
+    void finish()
+    {
+        if(keep_alive) {
+            readRequest();
+        } else {
+            boost::system::error_code ignored;
+            socket.shutdown(tcp::socket::shutdown_both, ignored);
+        }
+    }
+
+    void closeFile()
+    {
+        if(fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+private:
+    const std::string directory;
+    const bool with_index;
+
+    boost::asio::io_service::strand strand;
+    boost::asio::steady_timer deadline;
+
+    boost::asio::streambuf request_buffer;
+    std::string response;
+
+    int fd;
+    off_t offset;
+    std::size_t remaining;
+
+    bool keep_alive;
+};
+
+}
+
+GalleryServer::GalleryServer(const std::string& output_directory, unsigned short port, bool with_index, int threads)
+    : output_directory(output_directory), port(port), with_index(with_index), thread_count(threads),
+      host(local_address()),
+      acceptor(io)
+{
+}
+
+GalleryServer::~GalleryServer()
+{
+    stop();
+}
+
+std::string GalleryServer::baseUrl() const
+{
+    return "http://" + host + ":" + std::to_string(port) + "/";
+}
+
+void GalleryServer::start()
+{
+    boost::system::error_code ec;
+    tcp::endpoint endpoint(tcp::v4(), port);
+    acceptor.open(endpoint.protocol(), ec);
+    if(!ec) acceptor.set_option(tcp::acceptor::reuse_address(true), ec);
+    if(!ec) acceptor.bind(endpoint, ec);
+    if(!ec) acceptor.listen(boost::asio::socket_base::max_connections, ec);
+    if(ec) {
+        fprintf(stderr, "cannot start gallery server on port %d: %s\n", port, ec.message().c_str());
+        return;
+    }
+
+    printf("Gallery available at %s%s\n", baseUrl().c_str(), with_index ? "" : " (no index page)");
+
+    accept();
+
+    io_work.reset(new boost::asio::io_service::work(io));
+    for(int i = 0; i < thread_count; ++i) {
+        threads.emplace_back([this]() {
+            io.run();
+        });
+    }
+
+    derivative_work.reset(new boost::asio::io_service::work(derivative_io));
+    derivative_thread = std::thread([this]() {
+        ThreadTopology::enter(ThreadTopology::BACKGROUND);
+        derivative_io.run();
+    });
+}
+
+void GalleryServer::stop()
+{
+    io_work.reset();
+    io.stop();
+    for(std::thread& t : threads) {
+        t.join();
+    }
+    threads.clear();
+
+    derivative_work.reset();
+    derivative_io.stop();
+    if(derivative_thread.joinable()) {
+        derivative_thread.join();
+    }
+}
+
+void GalleryServer::accept()
+{
+    std::shared_ptr<HttpSession> session = std::make_shared<HttpSession>(io, output_directory, with_index);
+    acceptor.async_accept(session->socket, [this, session](const boost::system::error_code& ec) {
+        if(!ec) {
+            session->start();
+        }
+        if(acceptor.is_open()) {
+            accept();
+        }
+    });
+}
+
+void GalleryServer::addImage(QString path)
+{
+    std::string file = path.toStdString();
+    derivative_io.post([this, file]() {
+        createWebImage(file);
+    });
+}
+
+void GalleryServer::createWebImage(const std::string& path)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    std::vector<unsigned char> jpeg((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    // no more pixels than the web copy needs, decoded on the background workers
+    Stopwatch decode_time;
+    int scale = jpeg::scaleFor(jpeg.data(), jpeg.size(), WEB_IMAGE_SIZE, WEB_IMAGE_SIZE);
+    QImage image = jpeg::decodeParallel(jpeg.data(), jpeg.size(), scale, QImage::Format_RGB32);
+    Metrics::instance().sample("gallery.decode_ms", decode_time.elapsedMs());
+    if(image.isNull()) {
+        fprintf(stderr, "cannot read %s for the gallery\n", path.c_str());
+        return;
+    }
+
+    std::string name = random_web_name();
+    std::string target = output_directory + name;
+    std::string partial = target + ".part";
+
+    // write under a temporary name, so that a download never sees half a file
+    QImage web = image.scaled(WEB_IMAGE_SIZE, WEB_IMAGE_SIZE, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    if(!web.save(QString::fromStdString(partial), "JPG", 85) ||
+            rename(partial.c_str(), target.c_str()) != 0) {
+        fprintf(stderr, "cannot write %s\n", target.c_str());
+        return;
+    }
+
+    emit imageAvailable(QString::fromStdString(path), QString::fromStdString(baseUrl() + name));
+}
+
+#include "moc_gallery_server.cpp"
@@ -0,0 +1,62 @@
+#ifndef GALLERY_SERVER_H
+#define GALLERY_SERVER_H
+
+#include <QObject>
+#include <QString>
+#include <boost/asio.hpp>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/*
+ * Minimal HTTP server that lets guests download their pictures over the local network.
+ *
+ * For every new capture a web sized JPEG is derived once, downloads are then served
+ * straight from the page cache with sendfile() and can be revalidated with ETags.
+ * All work happens on the server's own threads, never on the camera or GUI thread.
+ * Only the web copies are served, under random names that the QR codes carry; the page
+ * that lists all of them is for private events and has to be asked for.
+ */
+class GalleryServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    GalleryServer(const std::string& output_directory, unsigned short port, bool with_index = false, int threads = 2);
+    ~GalleryServer();
+
+    void start();
+    void stop();
+
+    std::string baseUrl() const;
+
+public slots:
+    void addImage(QString path);
+
+signals:
+    /* path is the file given to addImage() */
+    void imageAvailable(QString path, QString url);
+
+private:
+    void accept();
+    void createWebImage(const std::string& path);
+
+private:
+    const std::string output_directory;
+    const unsigned short port;
+    const bool with_index;
+    const int thread_count;
+
+    std::string host;
+
+    boost::asio::io_service io;
+    std::unique_ptr<boost::asio::io_service::work> io_work;
+    boost::asio::ip::tcp::acceptor acceptor;
+    std::vector<std::thread> threads;
+
+    boost::asio::io_service derivative_io;
+    std::unique_ptr<boost::asio::io_service::work> derivative_work;
+    std::thread derivative_thread;
+};
+
+#endif // GALLERY_SERVER_H
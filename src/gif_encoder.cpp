@@ -0,0 +1,345 @@
+#include "gif_encoder.h"
+
+#include "image_ops.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+
+namespace {
+
+const int BINS = 32 * 32 * 32;
+const int MIN_CODE_SIZE = 8;
+const int MAX_CODE = 4096;
+
+/* the hash table of the classic compress(1), a prime a bit larger than MAX_CODE */
+const int HASH_SIZE = 5003;
+
+struct Color
+{
+    int bin;
+    uint32_t count;
+
+    int channel(int axis) const
+    {
+        return (bin >> (10 - 5 * axis)) & 31;
+    }
+};
+
+struct Box
+{
+    std::size_t begin;
+    std::size_t end;
+    uint64_t population;
+    int longest_axis;
+    int range;
+};
+
+void measure(const std::vector<Color>& colors, Box& box)
+{
+    int low[3] = { 31, 31, 31 };
+    int high[3] = { 0, 0, 0 };
+    box.population = 0;
+    for(std::size_t i = box.begin; i < box.end; ++i) {
+        for(int axis = 0; axis < 3; ++axis) {
+            low[axis] = std::min(low[axis], colors[i].channel(axis));
+            high[axis] = std::max(high[axis], colors[i].channel(axis));
+        }
+        box.population += colors[i].count;
+    }
+    box.longest_axis = 0;
+    for(int axis = 1; axis < 3; ++axis) {
+        if(high[axis] - low[axis] > high[box.longest_axis] - low[box.longest_axis]) {
+            box.longest_axis = axis;
+        }
+    }
+    box.range = high[box.longest_axis] - low[box.longest_axis];
+}
+
+/* variable length codes, least significant bit first, as GIF wants them */
+class BitPacker
+{
+public:
+    BitPacker(std::vector<uint8_t>& out)
+        : out(out), accumulator(0), bits(0)
+    {
+    }
+
+    void put(int code, int size)
+    {
+        accumulator |= uint32_t(code) << bits;
+        bits += size;
+        while(bits >= 8) {
+            out.push_back(accumulator & 0xff);
+            accumulator >>= 8;
+            bits -= 8;
+        }
+    }
+
+    void flush()
+    {
+        if(bits > 0) {
+            out.push_back(accumulator & 0xff);
+        }
+        accumulator = 0;
+        bits = 0;
+    }
+
+private:
+    std::vector<uint8_t>& out;
+    uint32_t accumulator;
+    int bits;
+};
+
+std::vector<uint8_t> lzw_compress(const std::vector<uint8_t>& indices)
+{
+    std::vector<uint8_t> out;
+    out.reserve(indices.size() / 2);
+    if(indices.empty()) {
+        return out;
+    }
+    BitPacker packer(out);
+
+    const int clear = 1 << MIN_CODE_SIZE;
+    const int end_of_information = clear + 1;
+
+    std::vector<int32_t> keys(HASH_SIZE, -1);
+    std::vector<uint16_t> codes(HASH_SIZE);
+
+    int code_size = MIN_CODE_SIZE + 1;
+    int next_code = end_of_information + 1;
+    packer.put(clear, code_size);
+
+    int prefix = indices[0];
+    for(std::size_t i = 1; i < indices.size(); ++i) {
+        const int c = indices[i];
+        const int32_t key = (c << 12) | prefix;
+
+        int h = ((c << 4) ^ prefix) % HASH_SIZE;
+        const int step = h == 0 ? 1 : HASH_SIZE - h;
+        while(keys[h] != -1 && keys[h] != key) {
+            h -= step;
+            if(h < 0) {
+                h += HASH_SIZE;
+            }
+        }
+        if(keys[h] == key) {
+            prefix = codes[h];
+            continue;
+        }
+
+        packer.put(prefix, code_size);
+        if(next_code < MAX_CODE) {
+            // the decoder learns each code one step later, it widens at the same point
+            if(next_code == (1 << code_size)) {
+                ++code_size;
+            }
+            keys[h] = key;
+            codes[h] = next_code++;
+        } else {
+            packer.put(clear, code_size);
+            std::fill(keys.begin(), keys.end(), -1);
+            code_size = MIN_CODE_SIZE + 1;
+            next_code = end_of_information + 1;
+        }
+        prefix = c;
+    }
+
+    packer.put(prefix, code_size);
+    if(next_code < MAX_CODE && next_code == (1 << code_size)) {
+        ++code_size;
+    }
+    packer.put(end_of_information, code_size);
+    packer.flush();
+    return out;
+}
+
+void put_short(std::vector<uint8_t>& out, int value)
+{
+    out.push_back(value & 0xff);
+    out.push_back((value >> 8) & 0xff);
+}
+
+}
+
+GifEncoder::GifEncoder()
+    : palette_size(0), lookup(BINS, 0)
+{
+    std::fill(&palette[0][0], &palette[0][0] + sizeof(palette), 0);
+}
+
+int GifEncoder::bin(int red, int green, int blue)
+{
+    return ((red >> 3) << 10) | ((green >> 3) << 5) | (blue >> 3);
+}
+
+void GifEncoder::buildPalette(const std::vector<QImage>& frames)
+{
+    std::vector<uint32_t> histogram(BINS, 0);
+    for(const QImage& frame : frames) {
+        ImageView view(frame);
+        for(int y = 0; y < view.height; y += 2) {
+            const unsigned char* p = view.data + y * view.bytes_per_line;
+            for(int x = 0; x < view.width; x += 2, p += 2 * view.bytes_per_pixel) {
+                ++histogram[bin(p[view.red], p[view.green], p[view.blue])];
+            }
+        }
+    }
+
+    std::vector<Color> colors;
+    for(int i = 0; i < BINS; ++i) {
+        if(histogram[i] > 0) {
+            colors.push_back(Color { i, histogram[i] });
+        }
+    }
+    if(colors.empty()) {
+        colors.push_back(Color { 0, 1 });
+    }
+
+    // median cut: split the most populated box along its longest axis until there are enough
+    std::vector<Box> boxes(1);
+    boxes[0].begin = 0;
+    boxes[0].end = colors.size();
+    measure(colors, boxes[0]);
+    while(boxes.size() < 256) {
+        int split = -1;
+        for(std::size_t i = 0; i < boxes.size(); ++i) {
+            if(boxes[i].range > 0 && (split < 0 || boxes[i].population > boxes[split].population)) {
+                split = i;
+            }
+        }
+        if(split < 0) {
+            break;
+        }
+
+        Box& box = boxes[split];
+        const int axis = box.longest_axis;
+        std::sort(colors.begin() + box.begin, colors.begin() + box.end, [axis](const Color& a, const Color& b) {
+            return a.channel(axis) < b.channel(axis);
+        });
+
+        uint64_t half = 0;
+        std::size_t median = box.begin;
+        while(median < box.end - 1 && half + colors[median].count <= box.population / 2) {
+            half += colors[median++].count;
+        }
+        median = std::max(median, box.begin + 1);
+
+        Box upper;
+        upper.begin = median;
+        upper.end = box.end;
+        box.end = median;
+        measure(colors, box);
+        measure(colors, upper);
+        boxes.push_back(upper);
+    }
+
+    palette_size = boxes.size();
+    for(int i = 0; i < palette_size; ++i) {
+        uint64_t sum[3] = { 0, 0, 0 };
+        uint64_t total = 0;
+        for(std::size_t c = boxes[i].begin; c < boxes[i].end; ++c) {
+            for(int axis = 0; axis < 3; ++axis) {
+                sum[axis] += uint64_t(colors[c].channel(axis) * 8 + 4) * colors[c].count;
+            }
+            total += colors[c].count;
+        }
+        for(int axis = 0; axis < 3; ++axis) {
+            palette[i][axis] = total > 0 ? sum[axis] / total : 0;
+        }
+    }
+
+    // nearest palette entry for every bin, also for colors that were not sampled
+    image_ops::forEachBand(BINS, [this](int first, int last) {
+        for(int b = first; b < last; ++b) {
+            int red = ((b >> 10) & 31) * 8 + 4;
+            int green = ((b >> 5) & 31) * 8 + 4;
+            int blue = (b & 31) * 8 + 4;
+            int best = 0;
+            int best_distance = std::numeric_limits<int>::max();
+            for(int i = 0; i < palette_size; ++i) {
+                int dr = red - palette[i][0], dg = green - palette[i][1], db = blue - palette[i][2];
+                int distance = 2 * dr * dr + 4 * dg * dg + db * db;
+                if(distance < best_distance) {
+                    best_distance = distance;
+                    best = i;
+                }
+            }
+            lookup[b] = best;
+        }
+    });
+}
+
+std::vector<uint8_t> GifEncoder::encodeFrame(const QImage& frame) const
+{
+    ImageView view(frame);
+    std::vector<uint8_t> indices(view.width * view.height);
+    for(int y = 0; y < view.height; ++y) {
+        const unsigned char* p = view.data + y * view.bytes_per_line;
+        uint8_t* out = &indices[y * view.width];
+        for(int x = 0; x < view.width; ++x, p += view.bytes_per_pixel) {
+            out[x] = lookup[bin(p[view.red], p[view.green], p[view.blue])];
+        }
+    }
+    return lzw_compress(indices);
+}
+
+bool GifEncoder::write(const std::string& path, int width, int height,
+                       const std::vector<std::vector<uint8_t> >& frames, int delay_cs) const
+{
+    std::vector<uint8_t> out;
+    const char* signature = "GIF89a";
+    out.insert(out.end(), signature, signature + 6);
+
+    // logical screen with a global color table of 256 entries
+    put_short(out, width);
+    put_short(out, height);
+    out.push_back(0xf7);
+    out.push_back(0);
+    out.push_back(0);
+    out.insert(out.end(), &palette[0][0], &palette[0][0] + sizeof(palette));
+
+    // loop forever
+    const uint8_t netscape[] = { 0x21, 0xff, 0x0b, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0',
+                                 0x03, 0x01, 0x00, 0x00, 0x00 };
+    out.insert(out.end(), netscape, netscape + sizeof(netscape));
+
+    for(const std::vector<uint8_t>& data : frames) {
+        // graphic control extension: leave the frame in place, no transparency
+        out.push_back(0x21);
+        out.push_back(0xf9);
+        out.push_back(0x04);
+        out.push_back(0x04);
+        put_short(out, delay_cs);
+        out.push_back(0);
+        out.push_back(0);
+
+        out.push_back(0x2c);
+        put_short(out, 0);
+        put_short(out, 0);
+        put_short(out, width);
+        put_short(out, height);
+        out.push_back(0);
+
+        out.push_back(MIN_CODE_SIZE);
+        for(std::size_t i = 0; i < data.size(); i += 255) {
+            std::size_t n = std::min<std::size_t>(255, data.size() - i);
+            out.push_back(n);
+            out.insert(out.end(), data.begin() + i, data.begin() + i + n);
+        }
+        out.push_back(0);
+    }
+    out.push_back(0x3b);
+
+    FILE* f = fopen(path.c_str(), "wb");
+    if(f == NULL) {
+        fprintf(stderr, "cannot write %s\n", path.c_str());
+        return false;
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    ok = fclose(f) == 0 && ok;
+    if(!ok) {
+        fprintf(stderr, "writing %s failed\n", path.c_str());
+    }
+    return ok;
+}
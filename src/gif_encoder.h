@@ -0,0 +1,40 @@
+#ifndef GIF_ENCODER_H
+#define GIF_ENCODER_H
+
+#include <QImage>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Animated GIF with one palette for all frames.
+ *
+ * The palette is made by median cut over the colors of all frames.
+ * Afterwards every frame can be quantized and LZW compressed on its own,
+ * so encodeFrame() may run in parallel for different frames.
+ */
+class GifEncoder
+{
+public:
+    GifEncoder();
+
+    void buildPalette(const std::vector<QImage>& frames);
+
+    /* palette indices of the frame, LZW compressed */
+    std::vector<uint8_t> encodeFrame(const QImage& frame) const;
+
+    /* writes an endlessly looping animation, delay in 1/100 s */
+    bool write(const std::string& path, int width, int height,
+               const std::vector<std::vector<uint8_t> >& frames, int delay_cs) const;
+
+private:
+    /* 5 bits per channel */
+    static int bin(int red, int green, int blue);
+
+private:
+    unsigned char palette[256][3];
+    int palette_size;
+    std::vector<uint8_t> lookup;
+};
+
+#endif // GIF_ENCODER_H
@@ -0,0 +1,81 @@
+#include "image_cache.h"
+
+#include "memory_budget.h"
+#include "metrics.h"
+
+#include <algorithm>
+
+namespace {
+const char* SUBSYSTEM = "image_cache";
+}
+
+ImageCache::ImageCache(std::size_t capacity_bytes)
+    : capacity(capacity_bytes), used_bytes(0)
+{
+}
+
+void ImageCache::insert(const std::string& path, const QImage& image)
+{
+    if(image.isNull()) {
+        return;
+    }
+    std::size_t bytes = std::size_t(image.bytesPerLine()) * image.height();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    auto pos = index.find(path);
+    if(pos != index.end()) {
+        used_bytes -= pos->second->bytes;
+        entries.erase(pos->second);
+        index.erase(pos);
+    }
+
+    std::size_t limit = std::min(capacity, MemoryBudget::instance().available(SUBSYSTEM));
+    if(bytes > limit) {
+        Metrics::instance().count("image_cache.rejected");
+        evict(limit);
+        return;
+    }
+    evict(limit - bytes);
+
+    entries.push_front(Entry { path, image, bytes });
+    index[path] = entries.begin();
+    used_bytes += bytes;
+    MemoryBudget::instance().set(SUBSYSTEM, used_bytes);
+}
+
+bool ImageCache::find(const std::string& path, QImage& image)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto pos = index.find(path);
+    if(pos == index.end()) {
+        Metrics::instance().count("image_cache.misses");
+        return false;
+    }
+    entries.splice(entries.begin(), entries, pos->second);
+    image = pos->second->image;
+    Metrics::instance().count("image_cache.hits");
+    return true;
+}
+
+std::size_t ImageCache::size() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+std::size_t ImageCache::bytes() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return used_bytes;
+}
+
+void ImageCache::evict(std::size_t limit)
+{
+    while(used_bytes > limit && !entries.empty()) {
+        used_bytes -= entries.back().bytes;
+        index.erase(entries.back().path);
+        entries.pop_back();
+        Metrics::instance().count("image_cache.evictions");
+    }
+    MemoryBudget::instance().set(SUBSYSTEM, used_bytes);
+}
@@ -0,0 +1,47 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <QImage>
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+ * The most recently used captures at screen resolution, by file name.
+ *
+ * Holds at most capacity bytes, and never more than the memory budget leaves for it.
+ * The least recently used pictures are dropped first. Thread safe.
+ */
+class ImageCache
+{
+public:
+    ImageCache(std::size_t capacity_bytes);
+
+    void insert(const std::string& path, const QImage& image);
+    bool find(const std::string& path, QImage& image);
+
+    std::size_t size() const;
+    std::size_t bytes() const;
+
+private:
+    struct Entry
+    {
+        std::string path;
+        QImage image;
+        std::size_t bytes;
+    };
+
+    void evict(std::size_t limit);
+
+private:
+    const std::size_t capacity;
+
+    mutable std::mutex mutex;
+    std::list<Entry> entries;       // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::size_t used_bytes;
+};
+
+#endif // IMAGE_CACHE_H
@@ -0,0 +1,268 @@
+#include "image_ops.h"
+
+#include "thread_topology.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+ImageView::ImageView(const unsigned char* data, int width, int height, int bytes_per_line, QImage::Format format)
+    : data(data), width(width), height(height), bytes_per_line(bytes_per_line)
+{
+    switch(format) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        // 0xffRRGGBB in native byte order
+        bytes_per_pixel = 4;
+        red = 2;
+        green = 1;
+        blue = 0;
+        break;
+    case QImage::Format_Grayscale8:
+        bytes_per_pixel = 1;
+        red = green = blue = 0;
+        break;
+    default:
+        bytes_per_pixel = 3;
+        red = 0;
+        green = 1;
+        blue = 2;
+        break;
+    }
+}
+
+ImageView::ImageView(const QImage& image)
+    : ImageView(image.constBits(), image.width(), image.height(), image.bytesPerLine(), image.format())
+{
+}
+
+Histogram::Histogram()
+{
+    clear();
+}
+
+void Histogram::clear()
+{
+    std::fill(luma, luma + 256, 0);
+    std::fill(red, red + 256, 0);
+    std::fill(green, green + 256, 0);
+    std::fill(blue, blue + 256, 0);
+    samples = 0;
+}
+
+double Histogram::meanLuma() const
+{
+    if(samples == 0) {
+        return 0.0;
+    }
+    uint64_t sum = 0;
+    for(int i = 0; i < 256; ++i) {
+        sum += (uint64_t) i * luma[i];
+    }
+    return sum / (double) samples;
+}
+
+double Histogram::fractionAbove(int level) const
+{
+    if(samples == 0) {
+        return 0.0;
+    }
+    uint64_t count = 0;
+    for(int i = std::max(0, level); i < 256; ++i) {
+        count += luma[i];
+    }
+    return count / (double) samples;
+}
+
+namespace {
+
+void luma_row(const ImageView& image, int x, int y, int width, int16_t* out)
+{
+    const unsigned char* p = image.data + y * image.bytes_per_line + x * image.bytes_per_pixel;
+    if(image.bytes_per_pixel == 1) {
+        std::copy(p, p + width, out);
+        return;
+    }
+    const int step = image.bytes_per_pixel;
+    const int r = image.red, g = image.green, b = image.blue;
+    for(int i = 0; i < width; ++i, p += step) {
+        out[i] = (77 * p[r] + 150 * p[g] + 29 * p[b]) >> 8;
+    }
+}
+
+/* sum and sum of squares of the 4-neighbour Laplacian of one row */
+void laplacian_row(const int16_t* up, const int16_t* center, const int16_t* down, int width,
+                   int64_t& sum, int64_t& sum_sq)
+{
+    int i = 1;
+#ifdef __SSE2__
+    __m128i ones = _mm_set1_epi16(1);
+    __m128i acc = _mm_setzero_si128();
+    __m128i acc_sq = _mm_setzero_si128();
+    for(; i + 8 <= width - 1; i += 8) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(center + i));
+        __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(center + i - 1));
+        __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(center + i + 1));
+        __m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up + i));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(down + i));
+
+        __m128i lap = _mm_sub_epi16(_mm_slli_epi16(c, 2),
+                                    _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d)));
+
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(lap, ones));
+        acc_sq = _mm_add_epi32(acc_sq, _mm_madd_epi16(lap, lap));
+    }
+    int32_t lanes[4], lanes_sq[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes_sq), acc_sq);
+    for(int k = 0; k < 4; ++k) {
+        sum += lanes[k];
+        sum_sq += lanes_sq[k];
+    }
+#endif
+    for(; i < width - 1; ++i) {
+        int lap = 4 * center[i] - center[i - 1] - center[i + 1] - up[i] - down[i];
+        sum += lap;
+        sum_sq += lap * lap;
+    }
+}
+
+}
+
+namespace image_ops
+{
+
+double sharpness(const ImageView& image, int x, int y, int width, int height)
+{
+    x = std::max(0, x);
+    y = std::max(0, y);
+    width = std::min(width, image.width - x);
+    height = std::min(height, image.height - y);
+    if(width < 3 || height < 3) {
+        return 0.0;
+    }
+
+    // three rolling luma rows
+    std::vector<int16_t> rows(3 * width);
+    int16_t* up = &rows[0];
+    int16_t* center = &rows[width];
+    int16_t* down = &rows[2 * width];
+
+    luma_row(image, x, y, width, up);
+    luma_row(image, x, y + 1, width, center);
+
+    int64_t sum = 0;
+    int64_t sum_sq = 0;
+    for(int row = 1; row < height - 1; ++row) {
+        luma_row(image, x, y + row + 1, width, down);
+        laplacian_row(up, center, down, width, sum, sum_sq);
+
+        int16_t* recycled = up;
+        up = center;
+        center = down;
+        down = recycled;
+    }
+
+    double n = double(width - 2) * (height - 2);
+    double mean = sum / n;
+    return sum_sq / n - mean * mean;
+}
+
+void accumulateHistogram(const ImageView& image, int y, Histogram& histogram, int step)
+{
+    const unsigned char* p = image.data + y * image.bytes_per_line;
+    const int stride = step * image.bytes_per_pixel;
+    const int r = image.red, g = image.green, b = image.blue;
+
+    int n = 0;
+    for(int x = 0; x < image.width; x += step, p += stride, ++n) {
+        int red = p[r], green = p[g], blue = p[b];
+        ++histogram.red[red];
+        ++histogram.green[green];
+        ++histogram.blue[blue];
+        ++histogram.luma[(77 * red + 150 * green + 29 * blue) >> 8];
+    }
+    histogram.samples += n;
+}
+
+double centerSharpness(const ImageView& image)
+{
+    return sharpness(image, image.width / 3, image.height / 3, image.width / 3, image.height / 3);
+}
+
+void downscaleLuma(const ImageView& image, int factor, unsigned char* out, int bytes_per_line)
+{
+    const int width = image.width / factor;
+    const int height = image.height / factor;
+    const int bpp = image.bytes_per_pixel;
+    const int r = image.red, g = image.green, b = image.blue;
+    const int cell = 256 * factor * factor;
+
+    for(int y = 0; y < height; ++y) {
+        const unsigned char* row = image.data + y * factor * image.bytes_per_line;
+        unsigned char* o = out + y * bytes_per_line;
+        for(int x = 0; x < width; ++x, row += factor * bpp) {
+            int red = 0, green = 0, blue = 0;
+            for(int dy = 0; dy < factor; ++dy) {
+                const unsigned char* p = row + dy * image.bytes_per_line;
+                for(int dx = 0; dx < factor; ++dx, p += bpp) {
+                    red += p[r];
+                    green += p[g];
+                    blue += p[b];
+                }
+            }
+            o[x] = (77 * red + 150 * green + 29 * blue) / cell;
+        }
+    }
+}
+
+void mirrorRow(const unsigned char* in, unsigned char* out, int width, int bytes_per_pixel)
+{
+    if(bytes_per_pixel == 4) {
+        const uint32_t* src = reinterpret_cast<const uint32_t*>(in);
+        uint32_t* dst = reinterpret_cast<uint32_t*>(out);
+        int x = 0;
+#ifdef __SSE2__
+        // the last four pixels of the input become the first four of the output, reversed
+        for(; x + 4 <= width; x += 4) {
+            __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + width - x - 4));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_shuffle_epi32(pixels, _MM_SHUFFLE(0, 1, 2, 3)));
+        }
+#endif
+        for(; x < width; ++x) {
+            dst[x] = src[width - 1 - x];
+        }
+        return;
+    }
+
+    for(int x = 0; x < width; ++x) {
+        const unsigned char* p = in + (width - 1 - x) * bytes_per_pixel;
+        for(int c = 0; c < bytes_per_pixel; ++c) {
+            out[x * bytes_per_pixel + c] = p[c];
+        }
+    }
+}
+
+void forEachBand(int height, const std::function<void(int first, int last)>& work)
+{
+    WorkerPool& workers = ThreadTopology::instance().workers(ThreadTopology::current());
+    int threads = workers.concurrency();
+    int band = (height + threads - 1) / threads;
+    if(threads == 1 || band >= height) {
+        work(0, height);
+        return;
+    }
+
+    // the calling thread does its share too
+    workers.run((height + band - 1) / band, [&work, band, height](int index) {
+        work(index * band, std::min((index + 1) * band, height));
+    });
+}
+
+}
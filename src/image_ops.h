@@ -0,0 +1,86 @@
+#ifndef IMAGE_OPS_H
+#define IMAGE_OPS_H
+
+#include <QImage>
+#include <cstdint>
+#include <functional>
+
+/*
+ * Pixel kernels that run on every decoded frame.
+ * They work on raw scanlines, so that the camera thread can use them
+ * on buffers that are not (yet) owned by a QImage.
+ */
+struct ImageView
+{
+    ImageView(const unsigned char* data, int width, int height, int bytes_per_line, QImage::Format format);
+    explicit ImageView(const QImage& image);
+
+    const unsigned char* data;
+    int width;
+    int height;
+    int bytes_per_line;
+
+    // layout of one pixel
+    int bytes_per_pixel;
+    int red;
+    int green;
+    int blue;
+};
+
+struct Histogram
+{
+    Histogram();
+
+    void clear();
+
+    double meanLuma() const;
+    double fractionAbove(int level) const;
+
+    uint32_t luma[256];
+    uint32_t red[256];
+    uint32_t green[256];
+    uint32_t blue[256];
+    uint32_t samples;
+};
+
+namespace image_ops
+{
+/*
+ * Adds every step-th pixel of scanline y to the histogram.
+ * Meant to be called right after a scanline was decoded, while it is still in cache.
+ */
+void accumulateHistogram(const ImageView& image, int y, Histogram& histogram, int step = 2);
+
+/*
+ * Variance of the Laplacian of the luma in the given region.
+ * The higher, the sharper the region.
+ */
+double sharpness(const ImageView& image, int x, int y, int width, int height);
+
+/*
+ * sharpness() of the center third of the image.
+ */
+double centerSharpness(const ImageView& image);
+
+/*
+ * Luma plane reduced by factor, every output pixel averages its whole
+ * factor x factor cell, so that nothing finer than a cell aliases. out has to hold
+ * (height / factor) rows of bytes_per_line bytes.
+ */
+void downscaleLuma(const ImageView& image, int factor, unsigned char* out, int bytes_per_line);
+
+/*
+ * Copies a scanline of width pixels from in to out, flipped horizontally.
+ * 4 byte pixels are reversed four at a time with SSE2.
+ */
+void mirrorRow(const unsigned char* in, unsigned char* out, int width, int bytes_per_pixel);
+
+/*
+ * Runs work(first, last) on horizontal bands of the rows 0 .. height,
+ * one band per core, and waits for all of them. The bands run on the workers
+ * of the calling thread's role, see ThreadTopology::workers().
+ */
+void forEachBand(int height, const std::function<void(int first, int last)>& work);
+}
+
+#endif // IMAGE_OPS_H
@@ -0,0 +1,494 @@
+#include "jpeg_decoder.h"
+
+#include "image_ops.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+namespace {
+
+struct ErrorManager
+{
+    struct jpeg_error_mgr base;
+    jmp_buf jump;
+};
+
+void error_exit(j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    fprintf(stderr, "jpeg decoding failed: %s\n", message);
+
+    ErrorManager* err = reinterpret_cast<ErrorManager*>(cinfo->err);
+    longjmp(err->jump, 1);
+}
+
+bool color_space_for(QImage::Format format, J_COLOR_SPACE& space)
+{
+    switch(format) {
+    case QImage::Format_RGB888:
+        space = JCS_RGB;
+        return true;
+    case QImage::Format_Grayscale8:
+        space = JCS_GRAYSCALE;
+        return true;
+#ifdef JCS_EXTENSIONS
+    case QImage::Format_RGB32:
+        // 0xffRRGGBB in native byte order
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        space = JCS_EXT_BGRX;
+#else
+        space = JCS_EXT_XRGB;
+#endif
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+bool read_file(const std::string& path, std::vector<unsigned char>& data)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if(!in) {
+        fprintf(stderr, "cannot open %s\n", path.c_str());
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+/*
+ * Where the restart intervals of a baseline JPEG are, if they start at MCU rows.
+ * Only the markers are looked at, the entropy coded data is not decoded.
+ */
+struct ScanLayout
+{
+    // SOI up to the end of the SOS segment, without the EXIF and other metadata
+    std::vector<unsigned char> header;
+    std::size_t height_at;          // of the frame, in header
+
+    int width;
+    int height;
+    int rows_per_interval;          // pixel rows
+
+    // the entropy coded data of each interval, without the markers
+    std::vector<std::pair<std::size_t, std::size_t> > intervals;
+};
+
+bool find_intervals(const unsigned char* data, std::size_t size, ScanLayout& layout)
+{
+    if(size < 4 || data[0] != 0xff || data[1] != 0xd8) {
+        return false;
+    }
+    layout.header.assign(data, data + 2);
+
+    int components = 0;
+    int max_h = 1, max_v = 1;
+    int restart_interval = 0;
+    bool has_frame = false;
+    std::size_t pos = 2;
+    std::size_t scan = 0;
+    while(scan == 0) {
+        if(pos + 4 > size || data[pos] != 0xff) {
+            return false;
+        }
+        const unsigned char marker = data[pos + 1];
+        if(marker == 0xff) {
+            // fill byte
+            ++pos;
+            continue;
+        }
+        const std::size_t length = 2 + (data[pos + 2] << 8 | data[pos + 3]);
+        if(pos + length > size) {
+            return false;
+        }
+        const unsigned char* segment = data + pos;
+
+        bool keep = true;
+        switch(marker) {
+        case 0xc0:  // baseline
+        case 0xc1:  // extended sequential, huffman
+            if(length < 10) {
+                return false;
+            }
+            layout.height_at = layout.header.size() + 5;
+            layout.height = segment[5] << 8 | segment[6];
+            layout.width = segment[7] << 8 | segment[8];
+            components = segment[9];
+            if(length < 10 + 3u * components) {
+                return false;
+            }
+            for(int c = 0; c < components; ++c) {
+                max_h = std::max(max_h, segment[11 + 3 * c] >> 4);
+                max_v = std::max(max_v, segment[11 + 3 * c] & 0x0f);
+            }
+            if(components == 1) {
+                // a single component is not interleaved, its MCU is one block
+                max_h = max_v = 1;
+            }
+            has_frame = true;
+            break;
+        case 0xc2: case 0xc3: case 0xc5: case 0xc6: case 0xc7:
+        case 0xc9: case 0xca: case 0xcb: case 0xcd: case 0xce: case 0xcf:
+            // progressive, lossless, hierarchical or arithmetic coded: one piece
+            return false;
+        case 0xdd:
+            if(length < 6) {
+                return false;
+            }
+            restart_interval = segment[4] << 8 | segment[5];
+            break;
+        case 0xda:
+            // all components in one scan, so that it is the only one
+            if(!has_frame || segment[4] != components) {
+                return false;
+            }
+            scan = pos + length;
+            break;
+        case 0xfe:
+            keep = false;
+            break;
+        default:
+            // EXIF and maker notes are big and of no use to the bands, JFIF and Adobe are
+            keep = marker < 0xe1 || marker > 0xef || marker == 0xee;
+        }
+        if(keep) {
+            layout.header.insert(layout.header.end(), segment, segment + length);
+        }
+        pos += length;
+    }
+
+    if(restart_interval == 0 || layout.width == 0 || layout.height == 0) {
+        return false;
+    }
+    const int mcu_width = 8 * max_h;
+    const int mcu_height = 8 * max_v;
+    const int mcus_per_row = (layout.width + mcu_width - 1) / mcu_width;
+    if(restart_interval % mcus_per_row != 0) {
+        return false;
+    }
+    layout.rows_per_interval = restart_interval / mcus_per_row * mcu_height;
+
+    // the markers are the only 0xff bytes not followed by a stuffed zero
+    std::size_t start = scan;
+    pos = scan;
+    while(true) {
+        const unsigned char* next = (const unsigned char*) memchr(data + pos, 0xff, size - pos);
+        if(next == NULL || next + 1 >= data + size) {
+            // cut off
+            return false;
+        }
+        pos = next - data;
+        const unsigned char marker = data[pos + 1];
+        if(marker == 0x00 || marker == 0xff) {
+            pos += marker == 0x00 ? 2 : 1;
+            continue;
+        }
+        layout.intervals.push_back(std::make_pair(start, pos - start));
+        if(marker < 0xd0 || marker > 0xd7) {
+            // another scan follows unless this is the end
+            if(marker != 0xd9) {
+                return false;
+            }
+            break;
+        }
+        pos += 2;
+        start = pos;
+    }
+
+    const std::size_t expected = (layout.height + layout.rows_per_interval - 1) / layout.rows_per_interval;
+    return layout.intervals.size() == expected && expected > 1;
+}
+
+/*
+ * Decodes intervals [first, last) into their rows of the image, as a JPEG of their own:
+ * the header with the height of the band, the intervals with their markers numbered from RST0 again, and EOI.
+ * Smooth chroma upsampling looks at the chroma rows next to each row, so at full size the neighbouring
+ * intervals are decoded as well and thrown away, which makes the bands match a decode in one piece.
+ */
+bool decode_band(const unsigned char* data, const ScanLayout& layout, int first, int last,
+                 int scale, J_COLOR_SPACE space, QImage& image)
+{
+    const int context = scale == 1 ? 1 : 0;
+    const int from = std::max(0, first - context);
+    const int to = std::min<int>(layout.intervals.size(), last + context);
+    const int top = from * layout.rows_per_interval;
+    const int rows = std::min(to * layout.rows_per_interval, layout.height) - top;
+
+    std::vector<unsigned char> band(layout.header);
+    band[layout.height_at] = rows >> 8;
+    band[layout.height_at + 1] = rows & 0xff;
+    for(int i = from; i < to; ++i) {
+        if(i > from) {
+            band.push_back(0xff);
+            band.push_back(0xd0 + (i - from - 1) % 8);
+        }
+        const std::pair<std::size_t, std::size_t>& interval = layout.intervals[i];
+        band.insert(band.end(), data + interval.first, data + interval.first + interval.second);
+    }
+    band.push_back(0xff);
+    band.push_back(0xd9);
+
+    // bands other than the last are a multiple of 8 rows high, so they scale exactly
+    const int skip = (first - from) * layout.rows_per_interval / scale;
+    const int image_top = first * layout.rows_per_interval / scale;
+    const int image_bottom = std::min(last * layout.rows_per_interval / scale, image.height());
+    std::vector<unsigned char> discarded;
+
+    struct jpeg_decompress_struct cinfo;
+    ErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.base);
+    jerr.base.error_exit = error_exit;
+
+    if(setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, band.data(), band.size());
+    jpeg_read_header(&cinfo, TRUE);
+
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+    cinfo.out_color_space = space;
+    if(scale > 1) {
+        cinfo.dct_method = JDCT_IFAST;
+        cinfo.do_fancy_upsampling = FALSE;
+    }
+
+    jpeg_start_decompress(&cinfo);
+
+    if((int) cinfo.output_width != image.width() || (int) cinfo.output_height < skip + image_bottom - image_top) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    discarded.resize(image.bytesPerLine());
+    while((int) cinfo.output_scanline < skip + image_bottom - image_top) {
+        int y = cinfo.output_scanline - skip;
+        JSAMPROW row = y < 0 ? discarded.data() : image.scanLine(image_top + y);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    // the rows below belong to the next band
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+}
+
+namespace jpeg
+{
+
+QImage decode(const unsigned char* data, std::size_t size, int scale, QImage::Format format)
+{
+    J_COLOR_SPACE space;
+    if(!color_space_for(format, space)) {
+        fprintf(stderr, "jpeg: unsupported output format %d\n", format);
+        return QImage();
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    ErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.base);
+    jerr.base.error_exit = error_exit;
+
+    QImage image;
+    if(setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return QImage();
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), size);
+    jpeg_read_header(&cinfo, TRUE);
+
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+    cinfo.out_color_space = space;
+    if(scale > 1) {
+        // nobody looks at reduced images closely
+        cinfo.dct_method = JDCT_IFAST;
+        cinfo.do_fancy_upsampling = FALSE;
+    }
+
+    jpeg_start_decompress(&cinfo);
+
+    image = QImage(cinfo.output_width, cinfo.output_height, format);
+    while(cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = image.scanLine(cinfo.output_scanline);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    return image;
+}
+
+QImage decodeFile(const std::string& path, int scale, QImage::Format format)
+{
+    std::vector<unsigned char> data;
+    if(!read_file(path, data)) {
+        return QImage();
+    }
+    return decode(data.data(), data.size(), scale, format);
+}
+
+QImage decodeParallel(const unsigned char* data, std::size_t size, int scale, QImage::Format format)
+{
+    ScanLayout layout;
+    J_COLOR_SPACE space;
+    if(!color_space_for(format, space) || !find_intervals(data, size, layout)) {
+        Metrics::instance().count("jpeg.decoded_in_one_piece");
+        return decode(data, size, scale, format);
+    }
+
+    QImage image((layout.width + scale - 1) / scale, (layout.height + scale - 1) / scale, format);
+    if(image.isNull()) {
+        return QImage();
+    }
+
+    std::atomic<bool> failed(false);
+    image_ops::forEachBand(layout.intervals.size(), [&](int first, int last) {
+        if(!decode_band(data, layout, first, last, scale, space, image)) {
+            failed = true;
+        }
+    });
+    if(failed) {
+        // libjpeg has said what is wrong, the whole image may still be readable
+        Metrics::instance().count("jpeg.band_failed");
+        return decode(data, size, scale, format);
+    }
+    return image;
+}
+
+QImage decodeFileParallel(const std::string& path, int scale, QImage::Format format)
+{
+    std::vector<unsigned char> data;
+    if(!read_file(path, data)) {
+        return QImage();
+    }
+    return decodeParallel(data.data(), data.size(), scale, format);
+}
+
+bool isSplittable(const unsigned char* data, std::size_t size)
+{
+    ScanLayout layout;
+    return find_intervals(data, size, layout);
+}
+
+bool decodeRows(const unsigned char* data, std::size_t size, QImage::Format format, bool mirror,
+                const std::function<unsigned char*(int width, int height, int bytes_per_line)>& begin,
+                const std::function<void(int y, unsigned char* scanline)>& row)
+{
+    J_COLOR_SPACE space;
+    if(!color_space_for(format, space)) {
+        fprintf(stderr, "jpeg: unsupported output format %d\n", format);
+        return false;
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    ErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.base);
+    jerr.base.error_exit = error_exit;
+
+    // a mirrored scanline is decoded here and flipped into place while it is in L1
+    std::vector<unsigned char> scratch;
+    if(setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), size);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = space;
+    jpeg_start_decompress(&cinfo);
+
+    const int width = cinfo.output_width;
+    const int bytes_per_pixel = cinfo.output_components;
+    const int bytes_per_line = width * bytes_per_pixel;
+    unsigned char* image = begin(width, cinfo.output_height, bytes_per_line);
+    if(image == NULL) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    if(mirror) {
+        scratch.resize(bytes_per_line);
+    }
+
+    while(cinfo.output_scanline < cinfo.output_height) {
+        int y = cinfo.output_scanline;
+        unsigned char* scanline = image + y * bytes_per_line;
+        JSAMPROW target = mirror ? scratch.data() : scanline;
+        jpeg_read_scanlines(&cinfo, &target, 1);
+        if(mirror) {
+            image_ops::mirrorRow(scratch.data(), scanline, width, bytes_per_pixel);
+        }
+        row(y, scanline);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+bool readSize(const unsigned char* data, std::size_t size, int& width, int& height)
+{
+    struct jpeg_decompress_struct cinfo;
+    ErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.base);
+    jerr.base.error_exit = error_exit;
+
+    if(setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), size);
+    jpeg_read_header(&cinfo, TRUE);
+    width = cinfo.image_width;
+    height = cinfo.image_height;
+
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+int scaleFor(const unsigned char* data, std::size_t size, int width, int height)
+{
+    struct jpeg_decompress_struct cinfo;
+    ErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.base);
+    jerr.base.error_exit = error_exit;
+
+    if(setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return 1;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), size);
+    jpeg_read_header(&cinfo, TRUE);
+
+    int scale = 8;
+    while(scale > 1 && ((int) cinfo.image_width / scale < width || (int) cinfo.image_height / scale < height)) {
+        scale /= 2;
+    }
+
+    jpeg_destroy_decompress(&cinfo);
+    return scale;
+}
+
+}
@@ -0,0 +1,65 @@
+#ifndef JPEG_DECODER_H
+#define JPEG_DECODER_H
+
+#include <QImage>
+#include <cstddef>
+#include <functional>
+#include <string>
+
+/*
+ * Thin wrapper around libjpeg(-turbo) for the places that need more control
+ * than QImage's loader: decoding at a reduced size right in the DCT
+ * and decoding straight into the pixel format the consumer wants.
+ *
+ * Corrupt data results in a null image instead of libjpeg's exit().
+ */
+namespace jpeg
+{
+/*
+ * Decodes a JPEG reduced by 1/scale (1, 2, 4 or 8).
+ * Supported formats are Format_RGB888, Format_RGB32 and Format_Grayscale8.
+ */
+QImage decode(const unsigned char* data, std::size_t size, int scale = 1,
+              QImage::Format format = QImage::Format_RGB888);
+
+QImage decodeFile(const std::string& path, int scale = 1,
+                  QImage::Format format = QImage::Format_RGB888);
+
+/*
+ * Like decode(), on the workers of the calling thread's role, for full resolution captures.
+ * If the encoder put restart markers at the start of MCU rows, the scan is cut at the markers
+ * into bands that are decoded at the same time, each straight into its rows of the image.
+ * Other JPEGs (no markers, progressive, several scans) are decoded by decode() in one piece.
+ */
+QImage decodeParallel(const unsigned char* data, std::size_t size, int scale = 1,
+                      QImage::Format format = QImage::Format_RGB888);
+
+QImage decodeFileParallel(const std::string& path, int scale = 1,
+                          QImage::Format format = QImage::Format_RGB888);
+
+/* whether decodeParallel() can split the JPEG */
+bool isSplittable(const unsigned char* data, std::size_t size);
+
+/*
+ * Decodes into memory of the caller, one scanline at a time, for work that wants each row while it is in cache.
+ * begin(width, height, bytes_per_line) says where the image goes (NULL cancels),
+ * row(y, scanline) is called for every scanline as soon as it is there.
+ * With mirror the scanlines are flipped horizontally on the way.
+ * Returns false if the data is corrupt or there was no memory.
+ */
+bool decodeRows(const unsigned char* data, std::size_t size, QImage::Format format, bool mirror,
+                const std::function<unsigned char*(int width, int height, int bytes_per_line)>& begin,
+                const std::function<void(int y, unsigned char* scanline)>& row);
+
+/*
+ * The size of the image, from the header only.
+ */
+bool readSize(const unsigned char* data, std::size_t size, int& width, int& height);
+
+/*
+ * The largest DCT scale at which the image is still at least width x height.
+ */
+int scaleFor(const unsigned char* data, std::size_t size, int width, int height);
+}
+
+#endif // JPEG_DECODER_H
@@ -0,0 +1,61 @@
+#include "jpeg_ring.h"
+
+#include "metrics.h"
+
+#include <cstring>
+
+JpegRing::JpegRing(int slot_count, std::size_t slot_bytes)
+    : slot_bytes(slot_bytes), buffers(slot_count), next(0), count(0)
+{
+    for(Slot& slot : buffers) {
+        slot.size = 0;
+        slot.timestamp_us = 0;
+    }
+}
+
+void JpegRing::add(const char* data, std::size_t size, uint64_t timestamp_us)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    Slot& slot = buffers[next];
+    if(slot.data.empty()) {
+        slot.data.resize(slot_bytes);
+    }
+    if(size > slot.data.size()) {
+        Metrics::instance().count("loop.frames_too_large");
+        return;
+    }
+
+    std::memcpy(slot.data.data(), data, size);
+    slot.size = size;
+    slot.timestamp_us = timestamp_us;
+
+    next = (next + 1) % buffers.size();
+    if(count < (int) buffers.size()) {
+        ++count;
+    }
+}
+
+std::vector<JpegRing::Frame> JpegRing::snapshot() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::vector<Frame> frames(count);
+    for(int i = 0; i < count; ++i) {
+        const Slot& slot = buffers[(next - count + i + buffers.size()) % buffers.size()];
+        frames[i].jpeg.assign(slot.data.begin(), slot.data.begin() + slot.size);
+        frames[i].timestamp_us = slot.timestamp_us;
+    }
+    return frames;
+}
+
+int JpegRing::size() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return count;
+}
+
+void JpegRing::clear()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    next = 0;
+    count = 0;
+}
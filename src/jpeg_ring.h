@@ -0,0 +1,51 @@
+#ifndef JPEG_RING_H
+#define JPEG_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/*
+ * The last few live view frames as they came from the camera, still JPEG compressed.
+ *
+ * Each buffer is allocated when its slot is first used, afterwards adding
+ * a frame is a single copy. Frames that do not fit into a slot are dropped.
+ */
+class JpegRing
+{
+public:
+    struct Frame
+    {
+        std::vector<char> jpeg;
+        uint64_t timestamp_us;
+    };
+
+public:
+    JpegRing(int slot_count, std::size_t slot_bytes);
+
+    void add(const char* data, std::size_t size, uint64_t timestamp_us);
+
+    /* copies the frames out, oldest first */
+    std::vector<Frame> snapshot() const;
+
+    int size() const;
+    void clear();
+
+private:
+    struct Slot
+    {
+        std::vector<char> data;
+        std::size_t size;
+        uint64_t timestamp_us;
+    };
+
+    const std::size_t slot_bytes;
+
+    mutable std::mutex mutex;
+    std::vector<Slot> buffers;
+    int next;
+    int count;
+};
+
+#endif // JPEG_RING_H
@@ -0,0 +1,136 @@
+#include "loop_encoder.h"
+
+#include "gif_encoder.h"
+#include "image_ops.h"
+#include "jpeg_decoder.h"
+#include "memory_budget.h"
+#include "metrics.h"
+#include "thread_topology.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+/* the live view is about 1056x704, half of it is plenty for a phone */
+const int DECODE_SCALE = 2;
+}
+
+LoopEncoder::LoopEncoder(const std::string& output_directory)
+    : output_directory(output_directory), busy(false)
+{
+}
+
+LoopEncoder::~LoopEncoder()
+{
+    if(worker.joinable()) {
+        worker.join();
+    }
+}
+
+bool LoopEncoder::isBusy() const
+{
+    return busy;
+}
+
+bool LoopEncoder::encode(std::vector<JpegRing::Frame> frames, bool boomerang)
+{
+    if(frames.size() < 2) {
+        return false;
+    }
+    bool expected = false;
+    if(!busy.compare_exchange_strong(expected, true)) {
+        fprintf(stderr, "still encoding the last loop\n");
+        return false;
+    }
+
+    if(worker.joinable()) {
+        worker.join();
+    }
+    worker = std::thread(&LoopEncoder::run, this, std::move(frames), boomerang);
+    return true;
+}
+
+void LoopEncoder::run(std::vector<JpegRing::Frame> frames, bool boomerang)
+{
+    ThreadTopology::enter(ThreadTopology::BACKGROUND);
+
+    Stopwatch encode_time;
+    const int count = frames.size();
+
+    std::size_t held = 0;
+    for(const JpegRing::Frame& frame : frames) {
+        held += frame.jpeg.size();
+    }
+    MemoryBudget::instance().set("loop_encoder", held);
+
+    std::vector<QImage> images(count);
+    image_ops::forEachBand(count, [&frames, &images](int first, int last) {
+        for(int i = first; i < last; ++i) {
+            const std::vector<char>& jpeg = frames[i].jpeg;
+            images[i] = jpeg::decode(reinterpret_cast<const unsigned char*>(jpeg.data()), jpeg.size(),
+                                     DECODE_SCALE, QImage::Format_RGB888);
+        }
+    });
+    // corrupt frames, or frames from before the live view size changed, are left out
+    const QImage last = images.back();
+    std::vector<uint64_t> timestamps;
+    std::size_t kept = 0;
+    for(int i = 0; i < count; ++i) {
+        const QImage& image = images[i];
+        if(i < count - 1 && (image.isNull() || image.width() != last.width() || image.height() != last.height())) {
+            continue;
+        }
+        images[kept++] = image;
+        timestamps.push_back(frames[i].timestamp_us);
+    }
+    images.resize(kept);
+    for(const QImage& image : images) {
+        held += std::size_t(image.bytesPerLine()) * image.height();
+    }
+    MemoryBudget::instance().set("loop_encoder", held);
+    if(images.size() < 2 || images.back().isNull()) {
+        fprintf(stderr, "not enough live view frames for a loop\n");
+        MemoryBudget::instance().set("loop_encoder", 0);
+        busy = false;
+        return;
+    }
+
+    GifEncoder gif;
+    gif.buildPalette(images);
+
+    std::vector<std::vector<uint8_t> > encoded(images.size());
+    image_ops::forEachBand(images.size(), [&gif, &images, &encoded](int first, int last) {
+        for(int i = first; i < last; ++i) {
+            encoded[i] = gif.encodeFrame(images[i]);
+        }
+    });
+
+    // play back at the speed of the live view, over the frames that are in the loop
+    double seconds = (timestamps.back() - timestamps.front()) / 1e6;
+    int delay_cs = std::max(2, int(seconds * 100 / (images.size() - 1) + 0.5));
+
+    if(boomerang) {
+        for(int i = encoded.size() - 2; i > 0; --i) {
+            encoded.push_back(encoded[i]);
+        }
+    }
+
+    long now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    std::string path = output_directory + std::to_string(now) + ".loop.gif";
+    bool written = gif.write(path, images[0].width(), images[0].height(), encoded, delay_cs);
+
+    double ms = encode_time.elapsedMs();
+    Metrics::instance().sample("loop.encode_ms", ms);
+    Metrics::instance().sample("loop.encode_fps", images.size() * 1000.0 / ms);
+    printf("encoded %d frame loop in %.0f ms (%.1f frames/s)\n", int(images.size()), ms, images.size() * 1000.0 / ms);
+
+    MemoryBudget::instance().set("loop_encoder", 0);
+    busy = false;
+    if(written) {
+        emit loopAvailable(QString::fromStdString(path));
+    }
+}
+
+#include "moc_loop_encoder.cpp"
@@ -0,0 +1,44 @@
+#ifndef LOOP_ENCODER_H
+#define LOOP_ENCODER_H
+
+#include <QObject>
+#include <QString>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "jpeg_ring.h"
+
+/*
+ * Turns the last seconds of live view into an animated GIF, optionally as a boomerang.
+ *
+ * Decoding, quantizing and compressing run on all cores, but on a low priority
+ * background thread (and its helpers), so the live view is never held up.
+ * Only one loop is encoded at a time, requests while busy are rejected.
+ */
+class LoopEncoder : public QObject
+{
+    Q_OBJECT
+
+public:
+    LoopEncoder(const std::string& output_directory);
+    ~LoopEncoder();
+
+    bool isBusy() const;
+    bool encode(std::vector<JpegRing::Frame> frames, bool boomerang);
+
+signals:
+    void loopAvailable(QString path);
+
+private:
+    void run(std::vector<JpegRing::Frame> frames, bool boomerang);
+
+private:
+    const std::string output_directory;
+
+    std::thread worker;
+    std::atomic<bool> busy;
+};
+
+#endif // LOOP_ENCODER_H
@@ -0,0 +1,112 @@
+#include "memory_budget.h"
+
+#include "metrics.h"
+
+#include <unistd.h>
+#include <stdio.h>
+
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+namespace {
+/* a Raspberry Pi class booth with 1 GB, leaving room for the desktop */
+const std::size_t DEFAULT_LIMIT = 512ul * 1024 * 1024;
+const double MB = 1024.0 * 1024.0;
+}
+
+MemoryBudget& MemoryBudget::instance()
+{
+    static MemoryBudget budget;
+    return budget;
+}
+
+MemoryBudget::MemoryBudget()
+    : limit_bytes(DEFAULT_LIMIT)
+{
+}
+
+void MemoryBudget::setLimit(std::size_t bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    limit_bytes = bytes;
+}
+
+std::size_t MemoryBudget::limit() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return limit_bytes;
+}
+
+void MemoryBudget::set(const std::string& subsystem, std::size_t bytes)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        usage[subsystem] = bytes;
+    }
+    Metrics::instance().set("memory." + subsystem + "_mb", bytes / MB);
+}
+
+std::size_t MemoryBudget::used(const std::string& subsystem) const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto pos = usage.find(subsystem);
+    return pos != usage.end() ? pos->second : 0;
+}
+
+std::size_t MemoryBudget::total() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::size_t sum = 0;
+    for(const auto& entry : usage) {
+        sum += entry.second;
+    }
+    return sum;
+}
+
+std::size_t MemoryBudget::available(const std::string& subsystem) const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::size_t others = 0;
+    for(const auto& entry : usage) {
+        if(entry.first != subsystem) {
+            others += entry.second;
+        }
+    }
+    return others < limit_bytes ? limit_bytes - others : 0;
+}
+
+std::size_t MemoryBudget::residentBytes()
+{
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(f == NULL) {
+        return 0;
+    }
+    unsigned long pages_total = 0, pages_resident = 0;
+    int n = fscanf(f, "%lu %lu", &pages_total, &pages_resident);
+    fclose(f);
+    return n == 2 ? pages_resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+std::string MemoryBudget::report() const
+{
+    std::size_t resident = residentBytes();
+    std::size_t accounted = total();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    for(const auto& entry : usage) {
+        out << std::left << std::setw(40) << entry.first << std::right
+            << std::setw(10) << entry.second / MB << " MB\n";
+    }
+    out << std::left << std::setw(40) << "accounted" << std::right << std::setw(10) << accounted / MB << " MB\n"
+        << std::left << std::setw(40) << "resident" << std::right << std::setw(10) << resident / MB << " MB\n"
+        << std::left << std::setw(40) << "limit" << std::right << std::setw(10) << limit_bytes / MB << " MB\n";
+    return out.str();
+}
+
+void MemoryBudget::print() const
+{
+    std::cout << "--- memory ---\n" << report() << std::flush;
+}
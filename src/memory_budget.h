@@ -0,0 +1,47 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+
+/*
+ * How much memory the process may use, and what each subsystem holds of it.
+ *
+ * Subsystems with fixed buffers (the preview ring, the loop frames) report their size once,
+ * workers report what they hold while they run. Caches grow only into what is left,
+ * see available().
+ */
+class MemoryBudget
+{
+public:
+    static MemoryBudget& instance();
+
+    void setLimit(std::size_t bytes);
+    std::size_t limit() const;
+
+    /* replaces what the subsystem reported before */
+    void set(const std::string& subsystem, std::size_t bytes);
+
+    std::size_t used(const std::string& subsystem) const;
+    std::size_t total() const;
+    /* what the subsystem may hold without the process going over the limit */
+    std::size_t available(const std::string& subsystem) const;
+
+    /* resident set size of the whole process, from /proc */
+    static std::size_t residentBytes();
+
+    std::string report() const;
+    void print() const;
+
+private:
+    MemoryBudget();
+
+private:
+    mutable std::mutex mutex;
+    std::size_t limit_bytes;
+    std::map<std::string, std::size_t> usage;
+};
+
+#endif // MEMORY_BUDGET_H
@@ -0,0 +1,107 @@
+#include "metrics.h"
+
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+Metrics::Stat::Stat()
+    : kind(COUNTER), count(0), last(0), min(std::numeric_limits<double>::max()),
+      max(std::numeric_limits<double>::lowest()), sum(0)
+{
+}
+
+Metrics::Metrics()
+{
+}
+
+Metrics& Metrics::instance()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+void Metrics::count(const std::string& name, long n)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    Stat& stat = stats[name];
+    stat.kind = COUNTER;
+    stat.count += n;
+    stat.last = stat.count;
+    stat.sum = stat.count;
+}
+
+void Metrics::sample(const std::string& name, double value)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    Stat& stat = stats[name];
+    stat.kind = SAMPLE;
+    ++stat.count;
+    stat.last = value;
+    stat.sum += value;
+    if(value < stat.min) stat.min = value;
+    if(value > stat.max) stat.max = value;
+}
+
+void Metrics::set(const std::string& name, double value)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    Stat& stat = stats[name];
+    stat.kind = GAUGE;
+    stat.count = 1;
+    stat.last = value;
+    stat.sum = value;
+    stat.min = value;
+    stat.max = value;
+}
+
+Metrics::Stat Metrics::get(const std::string& name) const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto pos = stats.find(name);
+    return pos != stats.end() ? pos->second : Stat();
+}
+
+std::string Metrics::report() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2);
+    for(const auto& entry : stats) {
+        const Stat& stat = entry.second;
+        out << std::left << std::setw(40) << entry.first << std::right;
+        if(stat.kind == SAMPLE) {
+            out << " last " << std::setw(10) << stat.last
+                << " avg " << std::setw(10) << stat.sum / stat.count
+                << " min " << std::setw(10) << stat.min
+                << " max " << std::setw(10) << stat.max
+                << " n " << stat.count;
+        } else {
+            out << " " << stat.last;
+        }
+        out << "\n";
+    }
+    return out.str();
+}
+
+void Metrics::print() const
+{
+    std::cout << "--- metrics ---\n" << report() << std::flush;
+}
+
+
+Stopwatch::Stopwatch()
+    : start(std::chrono::steady_clock::now())
+{
+}
+
+void Stopwatch::restart()
+{
+    start = std::chrono::steady_clock::now();
+}
+
+double Stopwatch::elapsedMs() const
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,69 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+/*
+ * Process wide collection of counters and timings.
+ * Cheap enough to be updated from the camera, worker and GUI threads.
+ */
+class Metrics
+{
+public:
+    enum Kind {
+        COUNTER,
+        SAMPLE,
+        GAUGE
+    };
+
+    struct Stat
+    {
+        Stat();
+
+        Kind kind;
+        long count;
+        double last;
+        double min;
+        double max;
+        double sum;
+    };
+
+public:
+    static Metrics& instance();
+
+    void count(const std::string& name, long n = 1);
+    void sample(const std::string& name, double value);
+    void set(const std::string& name, double value);
+
+    Stat get(const std::string& name) const;
+
+    std::string report() const;
+    void print() const;
+
+private:
+    Metrics();
+
+private:
+    mutable std::mutex mutex;
+    std::map<std::string, Stat> stats;
+};
+
+/*
+ * Measures the milliseconds since construction or the last restart().
+ */
+class Stopwatch
+{
+public:
+    Stopwatch();
+
+    void restart();
+    double elapsedMs() const;
+
+private:
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif // METRICS_H
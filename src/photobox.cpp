@@ -3,14 +3,54 @@
 #include <iostream>
 #include "camera.h"
 #include "director.h"
-#include <QtConcurrent/QtConcurrentRun>
+#include "timelapse_writer.h"
+#include "preview_ring.h"
+#include "frame_pacer.h"
 #include "arduino_button.h"
+#include "gallery_server.h"
+#include "chroma_key.h"
+#include "color_filter.h"
+#include "loop_encoder.h"
+#include "collage_builder.h"
+#include "image_cache.h"
+#include "memory_budget.h"
+#include "metrics.h"
+#include "thread_topology.h"
+#include "replay_driver.h"
+#include "exporter.h"
+#include <QScreen>
+#include <QTimer>
+#include <cstdlib>
 #include <thread>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #define USE_BUTTON 0
+#define BUTTON_RETRY_S 5
+#define USE_GALLERY 1
+#define USE_PREARM_AUTOFOCUS 0
+#define USE_FOCUS_ASSIST 1
+#define USE_AUTO_EXPOSURE 0
+#define USE_BLUR_CHECK 1
+#define USE_CHROMA_KEY 0
+#define CHROMA_KEY_BACKGROUND "background.jpg"
+#define CHROMA_KEY_COLOR qRgb(0, 177, 64)
+#define USE_LOOPS 1
+#define LOOP_AS_BOOMERANG 1
+#define USE_COLLAGE 1
+#define COLLAGE_LAYOUT CollageLayout::strip()
+#define COLLAGE_TEXT "Photobox"
+#define COLLAGE_LOGO "logo.png"
+#define GALLERY_PORT 8080
+#define GALLERY_INDEX 0
+#define MEMORY_LIMIT_MB 512
+#define IMAGE_CACHE_MB 128
+#define USE_THREAD_PLACEMENT 1
+#define USE_TIMELAPSE 0
+#define TIMELAPSE_INTERVAL_S 10
+#define TIMELAPSE_FPS 25
+#define USE_EXPORT 1
 
 static bool is_writable_directory(const std::string& path)
 {
@@ -19,10 +59,49 @@ static bool is_writable_directory(const std::string& path)
     return S_ISDIR(path_stat.st_mode) && (access(path.c_str(), W_OK) == 0);
 }
 
+/*
+ * The booth PCs have four cores: the GUI and the button share core 0, the camera has core 1
+ * and its decode helpers cores 1 and 2, loops, collages and gallery copies stay on core 3.
+ * SCHED_FIFO needs an rtprio limit for the user (/etc/security/limits.conf), otherwise
+ * the camera and the button run at the normal priority.
+ */
+static void place_threads()
+{
+    if(std::thread::hardware_concurrency() < 4) {
+        return;
+    }
+    ThreadTopology& topology = ThreadTopology::instance();
+    topology.configure(ThreadTopology::INPUT, ThreadTopology::Placement({0}, 20, 0));
+    topology.configure(ThreadTopology::CAMERA_IO, ThreadTopology::Placement({1}, 10, 0));
+    topology.configure(ThreadTopology::DECODE, ThreadTopology::Placement({1, 2}, 0, 0));
+    topology.configure(ThreadTopology::BACKGROUND, ThreadTopology::Placement({3}, 0, 10));
+}
+
 int main(int argc, char *argv[])
 {
-    if(argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " output-directory" << "\nWhere the output-directory argument must be a valid directory." << std::endl;
+    // startup.first_preview_ms includes everything up to the window
+    Stopwatch startup_time;
+    std::string record_path;
+    std::string replay_path;
+    std::string export_path;
+    double replay_speed = 1.0;
+    bool usage_ok = argc == 2;
+    if(argc == 4 && std::string(argv[2]) == "--record") {
+        record_path = argv[3];
+        usage_ok = true;
+    } else if((argc == 4 || argc == 5) && std::string(argv[2]) == "--replay") {
+        replay_path = argv[3];
+        replay_speed = argc == 5 ? atof(argv[4]) : 1.0;
+        usage_ok = replay_speed > 0;
+    } else if(argc == 4 && std::string(argv[2]) == "--export") {
+        export_path = argv[3];
+        usage_ok = true;
+    }
+    if(!usage_ok) {
+        std::cerr << "Usage: " << argv[0] << " output-directory [--record trace | --replay trace [speed] | --export target]"
+                  << "\nWhere the output-directory argument must be a valid directory."
+                  << "\n--record logs all camera calls to the trace file, --replay plays such a trace instead of using a camera,"
+                  << "\nspeed times faster than recorded. --export copies the pictures to the target directory and exits." << std::endl;
         return 1;
     }
 
@@ -35,37 +114,158 @@ int main(int argc, char *argv[])
         output_dir += "/";
     }
 
+    if(!export_path.empty()) {
+        Exporter exporter(output_dir);
+        Exporter::Result result = exporter.run(export_path);
+        Metrics::instance().print();
+        return result.failed == 0 ? 0 : 1;
+    }
+
+#if USE_THREAD_PLACEMENT
+    place_threads();
+#endif
+    std::cout << ThreadTopology::instance().report();
+
+    // the window first, it is up while the camera connects
+    QApplication app(argc, argv);
+    PhotoboxWindow box(startup_time);
+
+    MemoryBudget::instance().setLimit(MEMORY_LIMIT_MB * 1024ul * 1024);
+    ImageCache image_cache(IMAGE_CACHE_MB * 1024ul * 1024);
+
     EOSCamera camera(output_dir);
+    camera.setImageCache(&image_cache);
+    if(!record_path.empty() && !camera.trace().startRecording(record_path)) {
+        return 1;
+    }
+    if(!replay_path.empty() && !camera.trace().startReplay(replay_path, replay_speed)) {
+        return 1;
+    }
+
+    QSize screen = QGuiApplication::primaryScreen()->size();
+    camera.setDisplaySize(screen.width(), screen.height());
+
+    FramePacer frame_pacer(QGuiApplication::primaryScreen()->refreshRate());
+    camera.setFramePacer(&frame_pacer);
+    box.setFramePacer(&frame_pacer);
+
+    PreviewRing preview_ring("/photobox_preview", PreviewRing::WRITER);
+    if(preview_ring.isOpen()) {
+        camera.setPreviewRing(&preview_ring);
+    }
 
     QThread director_thread;
     Director director(camera);
+    director.setAutoFocusOnPrearm(USE_PREARM_AUTOFOCUS);
+    director.setFocusAssist(USE_FOCUS_ASSIST);
+    director.setAutoExposure(USE_AUTO_EXPOSURE);
+    director.setFramePacer(&frame_pacer);
+#if USE_LOOPS
+    LoopEncoder loop_encoder(output_dir);
+    director.setLoopEncoder(&loop_encoder, LOOP_AS_BOOMERANG);
+#endif
+#if USE_TIMELAPSE
+    TimelapseWriter timelapse(output_dir, TIMELAPSE_FPS);
+    director.setTimelapse(&timelapse, TIMELAPSE_INTERVAL_S * 1000);
+#endif
     director.moveToThread(&director_thread);
+    // prearm() and takePicture() run there, they talk to the camera as well
+    QObject::connect(&director_thread, &QThread::started, []() {
+        ThreadTopology::enter(ThreadTopology::CAMERA_IO);
+    });
 
 
-    QApplication app(argc, argv);
-    PhotoboxWindow box;
+    ColorFilter color_filter;
+    camera.setColorFilter(&color_filter);
+    box.setColorFilter(&color_filter);
+
+#if USE_CHROMA_KEY
+    ChromaKey chroma_key;
+    chroma_key.setKeyColor(CHROMA_KEY_COLOR);
+    if(chroma_key.setBackground(QImage(CHROMA_KEY_BACKGROUND))) {
+        camera.setChromaKey(&chroma_key);
+    } else {
+        std::cerr << "cannot load chroma key background " << CHROMA_KEY_BACKGROUND << std::endl;
+    }
+#endif
 
-    QtConcurrent::run([&director]() {
+    std::thread camera_thread([&director]() {
+        ThreadTopology::enter(ThreadTopology::CAMERA_IO);
         director.run();
     });
     director_thread.start();
 
-    QObject::connect(&camera, SIGNAL(newPreview(QImage)), &box, SLOT(showPreview(QImage)));
     QObject::connect(&camera, SIGNAL(newImage(QImage)), &box, SLOT(showImage(QImage)));
+    QObject::connect(&camera, SIGNAL(newFullImage(QImage)), &box, SLOT(showFullImage(QImage)));
 
     QObject::connect(&box, SIGNAL(takePicture()), &box, SLOT(startPictureTakingAnimations()));
 
-    QObject::connect(&box, SIGNAL(endPictureTakingAnimations()), &director, SLOT(takePicture()), Qt::QueuedConnection);
+    QObject::connect(&box, SIGNAL(focusRequested()), &director, SLOT(focus()), Qt::DirectConnection);
+    QObject::connect(&box, SIGNAL(countdownStarted(int)), &director, SLOT(prearm(int)), Qt::QueuedConnection);
+    QObject::connect(&box, SIGNAL(guestsPresent(bool)), &director, SLOT(setGuestsPresent(bool)), Qt::DirectConnection);
+    QObject::connect(&box, SIGNAL(endPictureTakingAnimations(qint64)), &director, SLOT(takePicture(qint64)), Qt::QueuedConnection);
     QObject::connect(&director, SIGNAL(doneTakingPicture()), &box, SLOT(allowTakingPicture()));
+    QObject::connect(&director, SIGNAL(exposureInfo(QImage,QString)), &box, SLOT(showExposure(QImage,QString)));
+    QObject::connect(&director, SIGNAL(cameraLost()), &box, SLOT(showCameraLost()));
+    QObject::connect(&director, SIGNAL(cameraReconnected()), &box, SLOT(showCameraReconnected()));
+#if USE_BLUR_CHECK
+    QObject::connect(&camera, SIGNAL(imageBlurred(double)), &box, SLOT(showBlurWarning(double)));
+#endif
+#if USE_LOOPS
+    QObject::connect(&box, SIGNAL(loopRequested()), &director, SLOT(recordLoop()), Qt::QueuedConnection);
+    QObject::connect(&loop_encoder, SIGNAL(loopAvailable(QString)), &box, SLOT(showLoop(QString)));
+#endif
+
+#if USE_EXPORT
+    Exporter exporter(output_dir);
+    QObject::connect(&box, SIGNAL(exportRequested()), &exporter, SLOT(exportToRemovableMedia()));
+    QObject::connect(&exporter, SIGNAL(progress(QString)), &box, SLOT(showExportProgress(QString)));
+    QObject::connect(&exporter, SIGNAL(finished(QString)), &box, SLOT(showExportFinished(QString)));
+#endif
 
     QObject::connect(&app, SIGNAL(lastWindowClosed()), &app, SLOT(quit()));
 
+    // the guests of the recording press the button, the metrics on exit are the result
+    ReplayDriver replay_driver(camera.trace());
+    if(camera.trace().isReplaying()) {
+        QObject::connect(&replay_driver, SIGNAL(pictureRequested()), &box, SLOT(startPictureTakingAnimations()));
+        QObject::connect(&replay_driver, SIGNAL(finished()), &app, SLOT(quit()));
+        replay_driver.start();
+    }
+
+#if USE_COLLAGE
+    CollageLayout collage_layout = COLLAGE_LAYOUT;
+    collage_layout.text = COLLAGE_TEXT;
+    collage_layout.logo = COLLAGE_LOGO;
+    CollageBuilder collage_builder(output_dir, collage_layout);
+    collage_builder.setImageCache(&image_cache);
+    // only hands the file over, the page is laid out on the builder's thread
+    QObject::connect(&camera, SIGNAL(newImageFile(QString)), &collage_builder, SLOT(addImage(QString)), Qt::DirectConnection);
+    QObject::connect(&box, SIGNAL(guestsPresent(bool)), &collage_builder, SLOT(setGuestsPresent(bool)));
+#endif
+
+#if USE_GALLERY
+    GalleryServer gallery(output_dir, GALLERY_PORT, GALLERY_INDEX);
+    QObject::connect(&camera, SIGNAL(newImageFile(QString)), &box, SLOT(setReviewFile(QString)));
+    QObject::connect(&camera, SIGNAL(newImageFile(QString)), &gallery, SLOT(addImage(QString)), Qt::DirectConnection);
+    QObject::connect(&gallery, SIGNAL(imageAvailable(QString,QString)), &box, SLOT(showDownloadCode(QString,QString)));
+#if USE_COLLAGE
+    QObject::connect(&collage_builder, SIGNAL(collageAvailable(QString)), &gallery, SLOT(addImage(QString)), Qt::DirectConnection);
+#endif
+
+    gallery.start();
+#endif
+
 
 #if USE_BUTTON
     ArduinoButton button;
     QObject::connect(&button, SIGNAL(buttonPressed()), &box, SLOT(startPictureTakingAnimations()));
 
     button.run();
+    // after the button was unplugged, until it is back
+    QTimer button_retry;
+    QObject::connect(&button_retry, &QTimer::timeout, [&button]() { button.run(); });
+    button_retry.start(BUTTON_RETRY_S * 1000);
 #endif
 
     box.show();
@@ -76,8 +276,25 @@ int main(int argc, char *argv[])
     button.stop();
 #endif
 
+#if USE_GALLERY
+    gallery.stop();
+#endif
+#if USE_EXPORT
+    // the next export continues at the last checkpoint
+    exporter.cancel();
+#endif
+
     director.stop();
     director_thread.quit();
+    camera_thread.join();
+    director_thread.wait();
+    camera.trace().close();
+#if USE_TIMELAPSE
+    timelapse.finish();
+#endif
+
+    Metrics::instance().print();
+    MemoryBudget::instance().print();
 
     return 0;
 }
@@ -1,23 +1,76 @@
 #include "photobox_window.h"
+#include "color_filter.h"
+#include "frame_pacer.h"
 #include <iostream>
 #include <QGraphicsPixmapItem>
 #include <QPropertyAnimation>
 #include <QEasingCurve>
 #include <QTimer>
 #include <QKeyEvent>
+#include <QMovie>
 #include <QGraphicsBlurEffect>
 #include <QGraphicsDropShadowEffect>
 #include <QtConcurrent/QtConcurrent>
 #include <thread>
 #include <chrono>
+#include <algorithm>
+#include <cmath>
 #include <QTextBlockFormat>
 #include <QTextCursor>
 
-PhotoboxWindow::PhotoboxWindow(QWidget *parent)
+#ifdef HAVE_QRENCODE
+#include <qrencode.h>
+#endif
+
+namespace {
+/* how long a loop plays before the live view is back */
+const int LOOP_SHOW_MS = 8000;
+/* how long a picture is shown */
+const int REVIEW_MS = 8000;
+const int TICK_MS = 100;
+/* how long the result of an export stays on the screen */
+const int EXPORT_RESULT_MS = 10000;
+
+QImage make_qr_code(const QString& text)
+{
+#ifdef HAVE_QRENCODE
+    QRcode* code = QRcode_encodeString(text.toUtf8().constData(), 0, QR_ECLEVEL_M, QR_MODE_8, 1);
+    if(code == nullptr) {
+        return QImage();
+    }
+
+    const int border = 4;
+    QImage image(code->width + 2 * border, code->width + 2 * border, QImage::Format_RGB32);
+    image.fill(Qt::white);
+    for(int y = 0; y < code->width; ++y) {
+        for(int x = 0; x < code->width; ++x) {
+            if(code->data[y * code->width + x] & 1) {
+                image.setPixel(x + border, y + border, qRgb(0, 0, 0));
+            }
+        }
+    }
+    QRcode_free(code);
+
+    return image;
+#else
+    Q_UNUSED(text);
+    return QImage();
+#endif
+}
+}
+
+PhotoboxWindow::PhotoboxWindow(const Stopwatch& startup_time, QWidget *parent)
     : QMainWindow(parent),
       ui(new Ui::Photobox),
-      last_image(nullptr), preview(nullptr), time_left_text(nullptr), can_take_picture(true),
-      image_display_timer(new QTimer)
+      last_image(nullptr), preview(nullptr), frozen_preview(nullptr),
+      session(REVIEW_MS), session_tick_ms(0), session_ticks(0), guests_present(false), frame_pacer(nullptr),
+      startup_time(startup_time), status_text(nullptr), camera_connected(false),
+      time_left_text(nullptr),
+      download_code(nullptr), download_text(nullptr), blur_text(nullptr),
+      color_filter(nullptr), filter_text(nullptr),
+      loop_movie(nullptr), loop_view(nullptr),
+      show_exposure(false), exposure_histogram(nullptr), exposure_text(nullptr),
+      export_text(nullptr)
 {
     ui->setupUi(this);
 
@@ -28,20 +81,87 @@ PhotoboxWindow::PhotoboxWindow(QWidget *parent)
 
     shot_effect = new QGraphicsBlurEffect;
 
+    // the camera takes a few seconds to connect, until the first live view frame
+    showStatus("Kamera wird verbunden …");
+
+    loop_timer.setSingleShot(true);
+    QObject::connect(&loop_timer, SIGNAL(timeout()), this, SLOT(hideLoop()));
+
+    export_timer.setSingleShot(true);
+    QObject::connect(&export_timer, SIGNAL(timeout()), this, SLOT(hideExportStatus()));
+
+    QObject::connect(&tick_timer, SIGNAL(timeout()), this, SLOT(tick()));
+    tick_timer.start(TICK_MS);
+
     showFullScreen();
 }
 
 PhotoboxWindow::~PhotoboxWindow()
 {
     delete ui;
-    delete image_display_timer;
+    delete loop_movie;
+}
+
+void PhotoboxWindow::setColorFilter(ColorFilter* filter)
+{
+    color_filter = filter;
+}
+
+void PhotoboxWindow::setFramePacer(FramePacer* pacer)
+{
+    frame_pacer = pacer;
+    present_timer.setTimerType(Qt::PreciseTimer);
+    QObject::connect(&present_timer, SIGNAL(timeout()), this, SLOT(presentFrame()));
+    present_timer.start(std::max(1, (int) std::round(pacer->refreshIntervalMs())));
 }
 
 void PhotoboxWindow::keyReleaseEvent(QKeyEvent *e)
 {
+    if(frame_pacer) {
+        frame_pacer->markActivity(FramePacer::Clock::now());
+    }
     if(e->key() == Qt::Key_Space) {
         emit takePicture();
+    } else if(e->key() == Qt::Key_F) {
+        emit focusRequested();
+    } else if(e->key() == Qt::Key_H) {
+        show_exposure = !show_exposure;
+        if(exposure_histogram) {
+            exposure_histogram->setVisible(show_exposure);
+            exposure_text->setVisible(show_exposure);
+        }
+    } else if(e->key() >= Qt::Key_1 && e->key() < Qt::Key_1 + ColorFilter::PRESET_COUNT) {
+        selectFilter(e->key() - Qt::Key_1);
+    } else if(e->key() == Qt::Key_G) {
+        emit loopRequested();
+    } else if(e->key() == Qt::Key_C && color_filter) {
+        selectFilter((color_filter->selected() + 1) % ColorFilter::PRESET_COUNT);
+    } else if(e->key() == Qt::Key_E) {
+        emit exportRequested();
+    }
+}
+
+void PhotoboxWindow::selectFilter(int preset)
+{
+    if(color_filter == nullptr) {
+        return;
     }
+    color_filter->select(ColorFilter::Preset(preset));
+
+    auto scene = ui->graphicsView->scene();
+    if(filter_text == nullptr) {
+        filter_text = new QGraphicsTextItem;
+        filter_text->setFont(QFont("Arial", 16, QFont::Bold));
+        filter_text->setDefaultTextColor(Qt::white);
+        filter_text->setZValue(10);
+        scene->addItem(filter_text);
+    }
+
+    // the live view shows the look right away, the name is just a reminder
+    QRectF rect = scene->sceneRect();
+    filter_text->setPlainText(QString::fromUtf8(ColorFilter::name(ColorFilter::Preset(preset))));
+    filter_text->setPos(rect.right() - filter_text->boundingRect().width() - 10, rect.top() + 10);
+    filter_text->setVisible(preset != ColorFilter::NONE);
 }
 
 QParallelAnimationGroup * PhotoboxWindow::addTextAnimation(const std::string& txt, double scale)
@@ -139,23 +259,29 @@ QParallelAnimationGroup* PhotoboxWindow::hideTextAnimation(const std::string &tx
 
 void PhotoboxWindow::allowTakingPicture()
 {
-    std::unique_lock<std::mutex> lock(state_mutex);
-    can_take_picture = true;
+    if(session.captureDone()) {
+        // the capture failed, don't leave the frozen frame standing
+        if(frozen_preview) {
+            frozen_preview->hide();
+        }
+    }
 }
 
 void PhotoboxWindow::startPictureTakingAnimations()
 {
-    {
-        std::unique_lock<std::mutex> lock(state_mutex);
-        if(!can_take_picture) {
-            return;
-        }
-        can_take_picture = false;
+    if(frame_pacer) {
+        frame_pacer->markActivity(FramePacer::Clock::now());
     }
-
-    if(time_left_text && time_left_text->isVisible()) {
-        done();
+    if(!camera_connected) {
+        return;
+    }
+    if(session.state() == Session::REVIEWING) {
+        endReview();
     }
+    if(!session.startCountdown()) {
+        return;
+    }
+    hideLoop();
 
     ui->graphicsView->viewport()->update();
 
@@ -195,9 +321,11 @@ void PhotoboxWindow::startPictureTakingAnimations()
     sequence->addPause(100);
     sequence->addAnimation(addTextAnimation("Bitte in die Kamera lächeln!", 100));
 
-    sequence->start();
+    QObject::connect(sequence, SIGNAL(finished()), this, SLOT(countdownOver()));
+    sequence->start(QAbstractAnimation::DeleteWhenStopped);
 
-    QObject::connect(sequence, SIGNAL(finished()), this, SIGNAL(endPictureTakingAnimations()));
+    countdown_end = Session::Clock::now() + std::chrono::milliseconds(sequence->totalDuration());
+    emit countdownStarted(sequence->totalDuration());
 
 
     //    QtConcurrent::run([this]() {
@@ -205,18 +333,79 @@ void PhotoboxWindow::startPictureTakingAnimations()
     //    });
 }
 
+void PhotoboxWindow::countdownOver()
+{
+    if(!session.countdownOver()) {
+        return;
+    }
+    freezePreview();
+    // the shutter delay counts from here, including a late animation and the queue to the director
+    emit endPictureTakingAnimations(std::chrono::duration_cast<std::chrono::microseconds>(
+                                        countdown_end.time_since_epoch()).count());
+}
+
+double PhotoboxWindow::msSinceCountdownEnd() const
+{
+    return std::chrono::duration<double, std::milli>(Session::Clock::now() - countdown_end).count();
+}
+
+void PhotoboxWindow::freezePreview()
+{
+    if(preview == nullptr) {
+        return;
+    }
+
+    // Keep the last live view frame on screen until the real picture arrives,
+    // later preview frames would not show what the camera captured anyway.
+    if(frozen_preview == nullptr) {
+        frozen_preview = new Pixmap;
+        ui->graphicsView->scene()->addItem(frozen_preview);
+    }
+    frozen_preview->setPixmap(preview->pixmap());
+    frozen_preview->setPos(preview->pos());
+    frozen_preview->setZValue(preview->zValue() + 1);
+    frozen_preview->setOpacity(1.0);
+    frozen_preview->show();
+
+    for(auto t : text) {
+        t.second->hide();
+    }
+
+    ui->graphicsView->viewport()->repaint();
+
+    double first_pixels = msSinceCountdownEnd();
+    Metrics::instance().sample("capture.first_pixels_ms", first_pixels);
+}
+
+void PhotoboxWindow::presentFrame()
+{
+    QImage frame;
+    if(frame_pacer->take(FramePacer::Clock::now(), frame)) {
+        showPreview(frame);
+    }
+}
+
 void PhotoboxWindow::showPreview(QImage image)
 {
     auto view = ui->graphicsView;
+    // the camera delivers the frames mirrored and in the pixel format of the screen
+    Stopwatch upload_time;
     if(preview == nullptr) {
-        preview = new Pixmap(QPixmap::fromImage(image.mirrored(true, false)));
+        double first_preview = startup_time.elapsedMs();
+        Metrics::instance().sample("startup.first_preview_ms", first_preview);
+        std::cout << "first live view frame " << first_preview << " ms after start" << std::endl;
+        status_text->hide();
+        camera_connected = true;
+
+        preview = new Pixmap(QPixmap::fromImage(image));
         view->scene()->addItem(preview);
         shot_effect->setBlurHints(QGraphicsBlurEffect::AnimationHint | QGraphicsBlurEffect::QualityHint);
         preview->setGraphicsEffect(shot_effect);
 
     } else {
-        preview->setPixmap(QPixmap::fromImage(image.mirrored(true, false)));
+        preview->setPixmap(QPixmap::fromImage(image));
     }
+    Metrics::instance().sample("preview.upload_ms", upload_time.elapsedMs());
 
     shot_effect->setBlurRadius(0);
 
@@ -238,11 +427,89 @@ void PhotoboxWindow::showImage(QImage image)
     for(auto t : text) {
         t.second->hide();
     }
+    if(download_code) {
+        download_code->hide();
+    }
+    if(download_text) {
+        download_text->hide();
+    }
+    if(blur_text) {
+        blur_text->hide();
+    }
 
     double scale = preview->pixmap().width() / (double) last_image->pixmap().width(); //0.2;
     last_image->setScale(scale);
     last_image->setPos(0,0);
 
+    if(frozen_preview && frozen_preview->isVisible()) {
+        last_image->setZValue(frozen_preview->zValue() + 1);
+        last_image->setOpacity(0.0);
+
+        QParallelAnimationGroup* cross_fade = new QParallelAnimationGroup;
+
+        QPropertyAnimation* fade_in = new QPropertyAnimation(last_image, "opacity");
+        fade_in->setDuration(300);
+        fade_in->setStartValue(0.0);
+        fade_in->setEndValue(1.0);
+        cross_fade->addAnimation(fade_in);
+
+        QPropertyAnimation* fade_out = new QPropertyAnimation(frozen_preview, "opacity");
+        fade_out->setDuration(300);
+        fade_out->setStartValue(1.0);
+        fade_out->setEndValue(0.0);
+        cross_fade->addAnimation(fade_out);
+
+        QObject::connect(cross_fade, SIGNAL(finished()), frozen_preview, SLOT(hide()));
+        cross_fade->start(QAbstractAnimation::DeleteWhenStopped);
+    } else {
+        last_image->setOpacity(1.0);
+    }
+
+    if(session.state() == Session::CAPTURING) {
+        double final_image = msSinceCountdownEnd();
+        Metrics::instance().sample("capture.final_image_ms", final_image);
+        std::cout << "capture latency: first pixels " << Metrics::instance().get("capture.first_pixels_ms").last
+                  << " ms, final image " << final_image << " ms" << std::endl;
+    }
+
+    session.pictureShown(Session::Clock::now());
+
+    view->fitInView(view->scene()->sceneRect(), Qt::KeepAspectRatio);
+
+    if(time_left_text == nullptr) {
+        time_left_text = new QGraphicsTextItem("Time left");
+
+        QFont serifFont("Arial", 64, QFont::Bold);
+        time_left_text->setFont(serifFont);
+        time_left_text->setDefaultTextColor(Qt::white);
+
+        time_left_text->setPos(0, 0);
+
+        ui->graphicsView->scene()->addItem(time_left_text);
+    }
+    time_left_text->setPlainText(QString::number(REVIEW_MS / 1000));
+    time_left_text->show();
+}
+
+void PhotoboxWindow::showFullImage(QImage image)
+{
+    if(last_image == nullptr || session.state() != Session::REVIEWING) {
+        // the guests have moved on, the gallery still gets it
+        Metrics::instance().count("capture.full_image_late");
+        return;
+    }
+    std::cout << "show full image of size " << image.width() << "x" << image.height() << std::endl;
+    last_image->setPixmap(QPixmap::fromImage(image));
+    last_image->setScale(preview->pixmap().width() / (double) last_image->pixmap().width());
+    Metrics::instance().sample("capture.full_image_ms", msSinceCountdownEnd());
+}
+
+void PhotoboxWindow::hideImage()
+{
+    if(last_image == nullptr) {
+        return;
+    }
+
     QPropertyAnimation* animation = new QPropertyAnimation(last_image, "scale");
     animation->setDuration(1000);
     animation->setStartValue(last_image->scale());
@@ -250,59 +517,249 @@ void PhotoboxWindow::showImage(QImage image)
 
     animation->setEasingCurve(QEasingCurve::OutBounce);
 
-    show_time = 8000;
+    animation->start(QAbstractAnimation::DeleteWhenStopped);
+}
+
+void PhotoboxWindow::showCameraLost()
+{
+    camera_connected = false;
+    showStatus("Kamera getrennt, wird neu verbunden …");
+}
+
+void PhotoboxWindow::showCameraReconnected()
+{
+    camera_connected = true;
+    status_text->hide();
+}
+
+void PhotoboxWindow::showStatus(const QString& message)
+{
+    if(status_text == nullptr) {
+        status_text = new QGraphicsTextItem;
+        status_text->setFont(QFont("Arial", 32, QFont::Bold));
+        status_text->setDefaultTextColor(Qt::white);
+        status_text->setPos(20, 20);
+        status_text->setZValue(10);
+        ui->graphicsView->scene()->addItem(status_text);
+    }
+    status_text->setPlainText(message);
+    status_text->show();
+}
 
-    image_display_timer->setSingleShot(true);
-    image_display_timer->setInterval(show_time);
+void PhotoboxWindow::setReviewFile(QString path)
+{
+    if(session.state() == Session::REVIEWING) {
+        review_file = path;
+    }
+}
 
-    QObject::connect(image_display_timer, SIGNAL(timeout()), animation, SLOT(start()));
-    QObject::connect(animation, SIGNAL(finished()), animation, SLOT(deleteLater()));
+void PhotoboxWindow::showDownloadCode(QString path, QString url)
+{
+    if(session.state() != Session::REVIEWING || path != review_file) {
+        // the next guests must not get the last guests' picture
+        Metrics::instance().count("gallery.code_dropped");
+        return;
+    }
 
-    image_display_timer->start();
+    auto scene = ui->graphicsView->scene();
+    QRectF rect = scene->sceneRect();
 
-    view->fitInView(view->scene()->sceneRect(), Qt::KeepAspectRatio);
+    QImage code = make_qr_code(url);
+
+    if(download_text == nullptr) {
+        download_text = new QGraphicsTextItem;
+        download_text->setFont(QFont("Arial", 16, QFont::Bold));
+        download_text->setDefaultTextColor(Qt::white);
+        scene->addItem(download_text);
+    }
+
+    int size = rect.height() / 3;
+    if(!code.isNull()) {
+        QPixmap pixmap = QPixmap::fromImage(code.scaled(size, size, Qt::KeepAspectRatio, Qt::FastTransformation));
+        if(download_code == nullptr) {
+            download_code = new Pixmap(pixmap);
+            scene->addItem(download_code);
+        } else {
+            download_code->setPixmap(pixmap);
+        }
+        download_code->setPos(rect.right() - pixmap.width() - 10, rect.bottom() - pixmap.height() - 10);
+        download_code->setZValue(10);
+        download_code->show();
+
+        download_text->setPlainText("Foto aufs Handy:");
+        download_text->setPos(download_code->pos().x(), download_code->pos().y() - 40);
+    } else {
+        // no QR code support, at least show where to get the picture
+        download_text->setPlainText(url);
+        download_text->setPos(rect.left() + 10, rect.bottom() - 50);
+    }
+    download_text->setZValue(10);
+    download_text->show();
+}
 
-    delete time_left_text;
-    time_left_text = new QGraphicsTextItem("Time left");
+void PhotoboxWindow::showBlurWarning(double sharpness)
+{
+    std::cout << "blurred capture, sharpness " << sharpness << std::endl;
+    if(session.state() != Session::REVIEWING) {
+        // too late to offer a retake
+        return;
+    }
 
-    QFont serifFont("Arial", 64, QFont::Bold);
-    time_left_text->setFont(serifFont);
-    time_left_text->setDefaultTextColor(Qt::white);
+    auto scene = ui->graphicsView->scene();
+    if(blur_text == nullptr) {
+        blur_text = new QGraphicsTextItem("Verwackelt? Leertaste für ein neues Foto!");
+        blur_text->setFont(QFont("Arial", 24, QFont::Bold));
+        blur_text->setDefaultTextColor(Qt::white);
+        blur_text->setZValue(10);
+        scene->addItem(blur_text);
+    }
 
-    time_left_text->setPos(0, 0);
+    QRectF rect = scene->sceneRect();
+    blur_text->setPos(rect.center().x() - blur_text->boundingRect().width() / 2, rect.top() + 10);
+    blur_text->show();
+}
 
-    ui->graphicsView->scene()->addItem(time_left_text);
+void PhotoboxWindow::showLoop(QString path)
+{
+    std::cout << "show loop " << path.toStdString() << std::endl;
 
-    time_left_timer.start(100);
-    time_left_timer.setSingleShot(false);
+    if(loop_view == nullptr) {
+        loop_view = new Pixmap;
+        loop_view->setZValue(5);
+        ui->graphicsView->scene()->addItem(loop_view);
+    }
 
-    start_time = QDateTime::currentMSecsSinceEpoch();
-    QObject::connect(&time_left_timer, SIGNAL(timeout()), this, SLOT(updateTime()));
+    delete loop_movie;
+    loop_movie = new QMovie(path);
+    QObject::connect(loop_movie, SIGNAL(frameChanged(int)), this, SLOT(showLoopFrame(int)));
+    loop_movie->start();
 
-    QObject::connect(animation, SIGNAL(finished()), this, SLOT(done()));
+    loop_view->show();
+    loop_timer.start(LOOP_SHOW_MS);
 }
 
-void PhotoboxWindow::updateTime()
+void PhotoboxWindow::showLoopFrame(int frame)
 {
-    uint64_t now  = QDateTime::currentMSecsSinceEpoch();
-    int64_t dt = now - start_time;
+    Q_UNUSED(frame);
+    QPixmap pixmap = loop_movie->currentPixmap();
+    loop_view->setPixmap(pixmap);
+    loop_view->setScale(ui->graphicsView->scene()->sceneRect().width() / pixmap.width());
+}
 
-    double seconds = (show_time - dt) / 1000.0;
+void PhotoboxWindow::hideLoop()
+{
+    if(loop_movie) {
+        loop_movie->stop();
+    }
+    if(loop_view) {
+        loop_view->hide();
+    }
+}
 
-    if(seconds >= 0) {
-        time_left_text->setPlainText(QString::number((int) std::round(seconds)));
-    } else {
-        time_left_text->hide();
+void PhotoboxWindow::showExportProgress(QString message)
+{
+    auto scene = ui->graphicsView->scene();
+    if(export_text == nullptr) {
+        export_text = new QGraphicsTextItem;
+        export_text->setFont(QFont("Arial", 16, QFont::Bold));
+        export_text->setDefaultTextColor(Qt::white);
+        export_text->setZValue(10);
+        scene->addItem(export_text);
+    }
+
+    QRectF rect = scene->sceneRect();
+    export_text->setPlainText(message);
+    export_text->setPos(rect.right() - export_text->boundingRect().width() - 10,
+                        rect.bottom() - export_text->boundingRect().height() - 10);
+    export_text->show();
+    export_timer.stop();
+}
+
+void PhotoboxWindow::showExportFinished(QString message)
+{
+    showExportProgress(message);
+    export_timer.start(EXPORT_RESULT_MS);
+}
+
+void PhotoboxWindow::hideExportStatus()
+{
+    if(export_text) {
+        export_text->hide();
+    }
+}
+
+void PhotoboxWindow::showExposure(QImage histogram, QString settings)
+{
+    if(!show_exposure) {
+        return;
+    }
+
+    auto scene = ui->graphicsView->scene();
+    if(exposure_histogram == nullptr) {
+        exposure_histogram = new Pixmap;
+        exposure_histogram->setZValue(20);
+        scene->addItem(exposure_histogram);
+
+        exposure_text = new QGraphicsTextItem;
+        exposure_text->setFont(QFont("Arial", 12, QFont::Bold));
+        exposure_text->setDefaultTextColor(Qt::white);
+        exposure_text->setZValue(20);
+        scene->addItem(exposure_text);
     }
+
+    QRectF rect = scene->sceneRect();
+    exposure_histogram->setPixmap(QPixmap::fromImage(histogram));
+    exposure_histogram->setPos(rect.left() + 10, rect.bottom() - histogram.height() - 10);
+    exposure_text->setPlainText(settings);
+    exposure_text->setPos(rect.left() + 10, rect.bottom() - histogram.height() - 40);
 }
 
-void PhotoboxWindow::done()
+void PhotoboxWindow::tick()
 {
-    time_left_timer.stop();
+    // the same small amount of work every tick, however many guests came before
+    Stopwatch tick_time;
+    if(session.state() == Session::REVIEWING) {
+        auto now = Session::Clock::now();
+        if(session.tick(now)) {
+            endReview();
+        } else {
+            time_left_text->setPlainText(QString::number(session.secondsLeft(now)));
+        }
+    }
+    bool present = session.state() != Session::IDLE;
+    if(present != guests_present) {
+        guests_present = present;
+        emit guestsPresent(present);
+    }
+    double ms = tick_time.elapsedMs();
+    session_tick_ms += ms;
+    ++session_ticks;
+    Metrics::instance().sample("gui.tick_ms", ms);
+}
+
+void PhotoboxWindow::endReview()
+{
+    session.endReview();
+    hideImage();
+    review_file.clear();
+
+    // soak: the average tick of every session, it has to stay flat over thousands of guests
+    if(session_ticks > 0) {
+        Metrics::instance().sample("soak.session_tick_ms", session_tick_ms / session_ticks);
+        Metrics::instance().count("soak.sessions");
+    }
+    session_tick_ms = 0;
+    session_ticks = 0;
+
     time_left_text->hide();
 
-    if(image_display_timer->isActive()) {
-        image_display_timer->stop();
-        QMetaObject::invokeMethod(image_display_timer, "timeout");
+    if(download_code) {
+        download_code->hide();
+    }
+    if(download_text) {
+        download_text->hide();
+    }
+    if(blur_text) {
+        blur_text->hide();
     }
 }
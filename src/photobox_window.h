@@ -4,39 +4,83 @@
 #include <QMainWindow>
 #include "ui_photobox.h"
 #include "pixmap.hpp"
+#include "metrics.h"
+#include "session.h"
 #include <QTimer>
-#include <mutex>
 
 class QGraphicsBlurEffect;
 class QParallelAnimationGroup;
+class ColorFilter;
+class QMovie;
+class FramePacer;
 
 class PhotoboxWindow : public QMainWindow
 {
     Q_OBJECT
 
 public:
-    explicit PhotoboxWindow(QWidget *parent = 0);
+    /* startup_time runs since the process started, for startup.first_preview_ms */
+    explicit PhotoboxWindow(const Stopwatch& startup_time, QWidget *parent = 0);
     ~PhotoboxWindow();
 
+    void setColorFilter(ColorFilter* filter);
+    /* live view frames are taken from the pacer on every display refresh */
+    void setFramePacer(FramePacer* pacer);
+
 signals:
-    void endPictureTakingAnimations();
+    void countdownStarted(int duration_ms);
+    /* when the countdown was due to end, in steady_clock microseconds */
+    void endPictureTakingAnimations(qint64 countdown_end_us);
     void takePicture();
+    void focusRequested();
+    void loopRequested();
+    /* a session began, or the booth is idle again */
+    void guestsPresent(bool present);
+    /* copy the pictures to a USB stick */
+    void exportRequested();
 
 public slots:
     void showPreview(QImage image);
+    void presentFrame();
     void showImage(QImage image);
+    /* replaces the camera's small picture, if it is still being reviewed */
+    void showFullImage(QImage image);
 
     void keyReleaseEvent(QKeyEvent* e);
 
     void startPictureTakingAnimations();
-    void done();
-    void updateTime();
+    void countdownOver();
+    void tick();
 
     void allowTakingPicture();
 
+    void freezePreview();
+    double msSinceCountdownEnd() const;
+
+    /* the file of the picture under review, the only one a download code is shown for */
+    void setReviewFile(QString path);
+    void showDownloadCode(QString path, QString url);
+    void showExposure(QImage histogram, QString settings);
+    void showBlurWarning(double sharpness);
+
+    void showCameraLost();
+    void showCameraReconnected();
+
+    void showLoop(QString path);
+    void showLoopFrame(int frame);
+    void hideLoop();
+
+    void showExportProgress(QString message);
+    void showExportFinished(QString message);
+    void hideExportStatus();
+
 private:
     QParallelAnimationGroup * addTextAnimation(const std::string &text, double scale = 80);
     QParallelAnimationGroup * hideTextAnimation(const std::string &text);
+    void selectFilter(int preset);
+    void showStatus(const QString& message);
+    void endReview();
+    void hideImage();
 
 private:
     Ui::Photobox* ui;
@@ -45,20 +89,48 @@ private:
 
     Pixmap* last_image;
     Pixmap* preview;
+    Pixmap* frozen_preview;
 
-    std::map<std::string, QGraphicsTextItem*> text;
+    /* the one timer of the capture and review cycle */
+    Session session;
+    QTimer tick_timer;
+    double session_tick_ms;
+    long session_ticks;
+    bool guests_present;
 
-    int64_t show_time;
+    // the capture latencies count from here, when the guests expect the picture
+    Session::Clock::time_point countdown_end;
+
+    FramePacer* frame_pacer;
+    QTimer present_timer;
+
+    Stopwatch startup_time;
+    QGraphicsTextItem* status_text;
+    bool camera_connected;
+
+    std::map<std::string, QGraphicsTextItem*> text;
 
-    u_int64_t start_time;
-    QTimer time_left_timer;
     QGraphicsTextItem* time_left_text;
 
-    std::mutex state_mutex;
-    bool can_take_picture;
+    QString review_file;
+    Pixmap* download_code;
+    QGraphicsTextItem* download_text;
+
+    QGraphicsTextItem* blur_text;
+
+    ColorFilter* color_filter;
+    QGraphicsTextItem* filter_text;
+
+    QMovie* loop_movie;
+    Pixmap* loop_view;
+    QTimer loop_timer;
 
+    bool show_exposure;
+    Pixmap* exposure_histogram;
+    QGraphicsTextItem* exposure_text;
 
-    QTimer* image_display_timer;
+    QGraphicsTextItem* export_text;
+    QTimer export_timer;
 };
 
 #endif // PHOTOBOXWINDOW_H
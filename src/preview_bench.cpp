@@ -0,0 +1,106 @@
+#include "jpeg_decoder.h"
+#include "metrics.h"
+
+#include <QImage>
+
+#include <jpeglib.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+/*
+ * Decodes live view frames the way the booth used to and the way it does now and reports
+ * the time per frame up to the image that QPixmap::fromImage() takes without converting.
+ *
+ *   ./preview_bench snapshot.jpg [frames]
+ *
+ * before: RGB888, QImage::mirrored() and the conversion to RGB32 that QPixmap did on upload
+ * after:  decoded into RGB32 and mirrored while the scanline is in the cache
+ */
+namespace {
+double before(const std::vector<char>& jpeg, QImage& result)
+{
+    Stopwatch time;
+    QImage decoded;
+    jpeg::decodeRows((const unsigned char*) jpeg.data(), jpeg.size(), QImage::Format_RGB888, false,
+                     [&](int width, int height, int) {
+        decoded = QImage(width, height, QImage::Format_RGB888);
+        return decoded.bits();
+    }, [](int, unsigned char*) {});
+    result = decoded.mirrored(true, false).convertToFormat(QImage::Format_RGB32);
+    return time.elapsedMs();
+}
+
+double after(const std::vector<char>& jpeg, QImage& result)
+{
+    Stopwatch time;
+    jpeg::decodeRows((const unsigned char*) jpeg.data(), jpeg.size(), QImage::Format_RGB32, true,
+                     [&](int width, int height, int) {
+        result = QImage(width, height, QImage::Format_RGB32);
+        return result.bits();
+    }, [](int, unsigned char*) {});
+    return time.elapsedMs();
+}
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " live-view-frame.jpg [frames]" << std::endl;
+        return 1;
+    }
+#ifndef JCS_EXTENSIONS
+    std::cerr << "this libjpeg cannot decode to RGB32, both paths convert" << std::endl;
+#endif
+
+    std::ifstream in(argv[1], std::ios::binary);
+    std::vector<char> jpeg((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if(jpeg.empty()) {
+        std::cerr << "cannot read " << argv[1] << std::endl;
+        return 1;
+    }
+    const int frames = argc > 2 ? std::max(1, atoi(argv[2])) : 300;
+
+    QImage old_frame, new_frame;
+    // warm up the allocator and the caches
+    before(jpeg, old_frame);
+    after(jpeg, new_frame);
+
+    double before_ms = 0, after_ms = 0, before_max = 0, after_max = 0;
+    for(int i = 0; i < frames; ++i) {
+        double ms = before(jpeg, old_frame);
+        before_ms += ms;
+        before_max = std::max(before_max, ms);
+
+        ms = after(jpeg, new_frame);
+        after_ms += ms;
+        after_max = std::max(after_max, ms);
+    }
+
+    // both paths have to end up with the same pixels, up to rounding of the color conversion
+    long differing = 0;
+    if(old_frame.size() != new_frame.size()) {
+        differing = -1;
+    } else {
+        for(int y = 0; y < old_frame.height(); ++y) {
+            const QRgb* a = (const QRgb*) old_frame.constScanLine(y);
+            const QRgb* b = (const QRgb*) new_frame.constScanLine(y);
+            for(int x = 0; x < old_frame.width(); ++x) {
+                if(a[x] != b[x]) {
+                    ++differing;
+                }
+            }
+        }
+    }
+
+    printf("%dx%d, %d frames\n", new_frame.width(), new_frame.height(), frames);
+    printf("before  %6.2f ms per frame  (slowest %6.2f ms)\n", before_ms / frames, before_max);
+    printf("after   %6.2f ms per frame  (slowest %6.2f ms)\n", after_ms / frames, after_max);
+    printf("%ld pixels differ\n", differing);
+    return differing == 0 ? 0 : 2;
+}
@@ -0,0 +1,276 @@
+#include "preview_ring.h"
+
+#include "memory_budget.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+
+namespace {
+const uint32_t MAGIC = 0x50425052; // "PBPR"
+const uint32_t VERSION = 1;
+const std::size_t PAGE = 4096;
+
+std::size_t page_align(std::size_t size)
+{
+    return (size + PAGE - 1) / PAGE * PAGE;
+}
+}
+
+struct PreviewRing::Header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+    uint64_t slot_stride;
+
+    std::atomic<uint64_t> frames_written;
+};
+
+struct PreviewRing::SlotHeader
+{
+    std::atomic<uint64_t> sequence;
+
+    int32_t width;
+    int32_t height;
+    int32_t bytes_per_line;
+    int32_t format;
+    uint64_t jpeg_size;
+
+    uint64_t frame_number;
+    uint64_t timestamp_us;
+};
+
+namespace {
+const std::size_t HEADER_SIZE = PAGE;
+const std::size_t SLOT_HEADER_SIZE = PAGE;
+const std::size_t SLOT_STRIDE = page_align(SLOT_HEADER_SIZE
+                                           + PreviewRing::MAX_PIXEL_BYTES
+                                           + PreviewRing::MAX_JPEG_BYTES);
+}
+
+PreviewRing::PreviewRing(const std::string& name, Mode mode)
+    : name(name), mode(mode), memory(nullptr), memory_size(HEADER_SIZE + SLOTS * SLOT_STRIDE),
+      header(nullptr), writing_slot(-1), writing_sequence(0)
+{
+    int fd;
+    if(mode == WRITER) {
+        fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+    } else {
+        fd = shm_open(name.c_str(), O_RDONLY, 0);
+    }
+    if(fd < 0) {
+        fprintf(stderr, "shm_open(%s) failed: %s\n", name.c_str(), strerror(errno));
+        return;
+    }
+
+    if(mode == WRITER && ftruncate(fd, memory_size) != 0) {
+        fprintf(stderr, "ftruncate(%s) failed: %s\n", name.c_str(), strerror(errno));
+        close(fd);
+        return;
+    }
+
+    int prot = mode == WRITER ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    void* mem = mmap(nullptr, memory_size, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED) {
+        fprintf(stderr, "mmap(%s) failed: %s\n", name.c_str(), strerror(errno));
+        return;
+    }
+
+    memory = mem;
+    header = static_cast<Header*>(memory);
+
+    if(mode == WRITER) {
+        MemoryBudget::instance().set("preview_ring", memory_size);
+        header->magic = MAGIC;
+        header->version = VERSION;
+        header->slots = SLOTS;
+        header->slot_stride = SLOT_STRIDE;
+        header->frames_written.store(0, std::memory_order_release);
+        for(int i = 0; i < SLOTS; ++i) {
+            slotHeader(i)->sequence.store(0, std::memory_order_relaxed);
+        }
+
+    } else if(header->magic != MAGIC || header->version != VERSION ||
+              header->slots != SLOTS || header->slot_stride != SLOT_STRIDE) {
+        fprintf(stderr, "%s is not a compatible preview ring\n", name.c_str());
+        munmap(memory, memory_size);
+        memory = nullptr;
+        header = nullptr;
+    }
+}
+
+PreviewRing::~PreviewRing()
+{
+    if(memory) {
+        munmap(memory, memory_size);
+    }
+    if(mode == WRITER) {
+        shm_unlink(name.c_str());
+    }
+}
+
+bool PreviewRing::isOpen() const
+{
+    return header != nullptr;
+}
+
+PreviewRing::SlotHeader* PreviewRing::slotHeader(int slot) const
+{
+    char* base = static_cast<char*>(memory) + HEADER_SIZE + slot * SLOT_STRIDE;
+    return reinterpret_cast<SlotHeader*>(base);
+}
+
+unsigned char* PreviewRing::slotPixels(int slot) const
+{
+    return reinterpret_cast<unsigned char*>(slotHeader(slot)) + SLOT_HEADER_SIZE;
+}
+
+char* PreviewRing::slotJpeg(int slot) const
+{
+    return reinterpret_cast<char*>(slotPixels(slot)) + MAX_PIXEL_BYTES;
+}
+
+unsigned char* PreviewRing::beginFrame(int width, int height, int bytes_per_line, int format)
+{
+    if(!header || mode != WRITER) {
+        return nullptr;
+    }
+    if(width > MAX_WIDTH || height > MAX_HEIGHT ||
+            (std::size_t) bytes_per_line * height > MAX_PIXEL_BYTES) {
+        return nullptr;
+    }
+
+    uint64_t n = header->frames_written.load(std::memory_order_relaxed);
+    writing_slot = n % SLOTS;
+
+    SlotHeader* slot = slotHeader(writing_slot);
+    // odd sequence: the slot is being written (it may still be odd from an aborted frame)
+    writing_sequence = (slot->sequence.load(std::memory_order_relaxed) + 1) | 1;
+    slot->sequence.store(writing_sequence, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->width = width;
+    slot->height = height;
+    slot->bytes_per_line = bytes_per_line;
+    slot->format = format;
+    slot->jpeg_size = 0;
+
+    return slotPixels(writing_slot);
+}
+
+void PreviewRing::setJpeg(const char* data, std::size_t size)
+{
+    if(writing_slot < 0 || size > MAX_JPEG_BYTES) {
+        return;
+    }
+    memcpy(slotJpeg(writing_slot), data, size);
+    slotHeader(writing_slot)->jpeg_size = size;
+}
+
+void PreviewRing::commitFrame()
+{
+    if(writing_slot < 0) {
+        return;
+    }
+
+    uint64_t n = header->frames_written.load(std::memory_order_relaxed);
+
+    SlotHeader* slot = slotHeader(writing_slot);
+    slot->frame_number = n;
+    slot->timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    // even sequence: the slot is consistent again
+    slot->sequence.store(writing_sequence + 1, std::memory_order_release);
+    header->frames_written.store(n + 1, std::memory_order_release);
+
+    writing_slot = -1;
+}
+
+void PreviewRing::abortFrame()
+{
+    if(writing_slot < 0) {
+        return;
+    }
+
+    // the pixels are half overwritten, the slot stays odd so that readers skip it
+    // and the next frame writes to it again
+    writing_slot = -1;
+}
+
+uint64_t PreviewRing::framesWritten() const
+{
+    return header ? header->frames_written.load(std::memory_order_acquire) : 0;
+}
+
+bool PreviewRing::latest(Frame& frame) const
+{
+    if(!header) {
+        return false;
+    }
+
+    uint64_t n = header->frames_written.load(std::memory_order_acquire);
+
+    // the newest slot may already be overwritten again, walk back through the ring
+    for(uint64_t back = 1; back <= SLOTS && back <= n; ++back) {
+        int s = (n - back) % SLOTS;
+        const SlotHeader* slot = slotHeader(s);
+
+        uint64_t seq = slot->sequence.load(std::memory_order_acquire);
+        if(seq & 1) {
+            continue;
+        }
+
+        frame.slot = s;
+        frame.sequence = seq;
+        frame.width = slot->width;
+        frame.height = slot->height;
+        frame.bytes_per_line = slot->bytes_per_line;
+        frame.format = slot->format;
+        frame.jpeg_size = slot->jpeg_size;
+        frame.frame_number = slot->frame_number;
+        frame.timestamp_us = slot->timestamp_us;
+        frame.pixels = slotPixels(s);
+        frame.jpeg = frame.jpeg_size > 0 ? slotJpeg(s) : nullptr;
+
+        if(stillValid(frame)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool PreviewRing::stillValid(const Frame& frame) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slotHeader(frame.slot)->sequence.load(std::memory_order_relaxed) == frame.sequence;
+}
+
+bool PreviewRing::copyLatest(Frame& frame, unsigned char* pixels, std::size_t pixel_capacity) const
+{
+    for(int attempt = 0; attempt < 3; ++attempt) {
+        if(!latest(frame)) {
+            return false;
+        }
+        std::size_t size = (std::size_t) frame.bytes_per_line * frame.height;
+        if(size > pixel_capacity) {
+            return false;
+        }
+        memcpy(pixels, frame.pixels, size);
+        if(stillValid(frame)) {
+            frame.pixels = pixels;
+            frame.jpeg = nullptr;
+            return true;
+        }
+    }
+    return false;
+}
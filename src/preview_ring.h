@@ -0,0 +1,95 @@
+#ifndef PREVIEW_RING_H
+#define PREVIEW_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+/*
+ * A ring of decoded live view frames in POSIX shared memory.
+ *
+ * The camera thread is the only writer and never waits for anybody:
+ * each slot is protected by a sequence counter (seqlock), readers check
+ * the counter before and after looking at a frame and simply retry
+ * (or skip to a newer frame) if the writer got in between.
+ * Readers can be in this process or in any other local process that
+ * opens the same name, e.g. a signage display.
+ * The frames are mirrored like the booth shows them, in RGB32 if libjpeg can decode to it.
+ */
+class PreviewRing
+{
+public:
+    enum Mode {
+        WRITER,
+        READER
+    };
+
+    enum {
+        SLOTS = 4,
+        MAX_WIDTH = 1920,
+        MAX_HEIGHT = 1280,
+        MAX_PIXEL_BYTES = MAX_WIDTH * MAX_HEIGHT * 4,
+        MAX_JPEG_BYTES = 2 * 1024 * 1024
+    };
+
+    struct Frame
+    {
+        const unsigned char* pixels;
+        const char* jpeg;
+
+        int width;
+        int height;
+        int bytes_per_line;
+        int format;     // QImage::Format of the pixel data
+        std::size_t jpeg_size;
+
+        uint64_t frame_number;
+        uint64_t timestamp_us;
+
+        // private to the ring, used by stillValid()
+        int slot;
+        uint64_t sequence;
+    };
+
+public:
+    PreviewRing(const std::string& name, Mode mode);
+    ~PreviewRing();
+
+    bool isOpen() const;
+
+    /* writer side */
+    unsigned char* beginFrame(int width, int height, int bytes_per_line, int format);
+    void setJpeg(const char* data, std::size_t size);
+    void commitFrame();
+    void abortFrame();      // after beginFrame() if the frame could not be decoded
+
+    /* reader side */
+    bool latest(Frame& frame) const;
+    bool stillValid(const Frame& frame) const;
+    bool copyLatest(Frame& frame, unsigned char* pixels, std::size_t pixel_capacity) const;
+
+    uint64_t framesWritten() const;
+
+private:
+    struct SlotHeader;
+    struct Header;
+
+    SlotHeader* slotHeader(int slot) const;
+    unsigned char* slotPixels(int slot) const;
+    char* slotJpeg(int slot) const;
+
+private:
+    const std::string name;
+    const Mode mode;
+
+    void* memory;
+    std::size_t memory_size;
+
+    Header* header;
+
+    int writing_slot;
+    uint64_t writing_sequence;
+};
+
+#endif // PREVIEW_RING_H
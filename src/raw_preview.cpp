@@ -0,0 +1,365 @@
+#include "raw_preview.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <set>
+#include <vector>
+
+namespace {
+const uint16_t TAG_COMPRESSION = 0x103;
+const uint16_t TAG_STRIP_OFFSETS = 0x111;
+const uint16_t TAG_ORIENTATION = 0x112;
+const uint16_t TAG_STRIP_BYTE_COUNTS = 0x117;
+const uint16_t TAG_SUB_IFDS = 0x14a;
+const uint16_t TAG_JPEG_OFFSET = 0x201;
+const uint16_t TAG_JPEG_LENGTH = 0x202;
+const uint16_t TAG_EXIF_IFD = 0x8769;
+
+const uint16_t TYPE_SHORT = 3;
+const uint16_t TYPE_LONG = 4;
+const uint16_t TYPE_IFD = 13;
+
+/* a corrupt file must not send us in circles */
+const int MAX_IFDS = 64;
+const int MAX_DEPTH = 4;
+
+class Tiff
+{
+public:
+    Tiff(const unsigned char* data, std::size_t size)
+        : data(data), size(size), big_endian(false)
+    {
+    }
+
+    bool readHeader(uint32_t& first_ifd)
+    {
+        if(size < 8) {
+            return false;
+        }
+        if(data[0] == 'I' && data[1] == 'I') {
+            big_endian = false;
+        } else if(data[0] == 'M' && data[1] == 'M') {
+            big_endian = true;
+        } else {
+            return false;
+        }
+        return u16(2) == 42 && u32(4, first_ifd);
+    }
+
+    uint16_t u16(std::size_t at) const
+    {
+        if(at + 2 > size) {
+            return 0;
+        }
+        return big_endian ? (data[at] << 8 | data[at + 1]) : (data[at + 1] << 8 | data[at]);
+    }
+
+    bool u32(std::size_t at, uint32_t& value) const
+    {
+        if(at + 4 > size) {
+            return false;
+        }
+        const unsigned char* p = data + at;
+        value = big_endian ? uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3]
+                           : uint32_t(p[3]) << 24 | p[2] << 16 | p[1] << 8 | p[0];
+        return true;
+    }
+
+    /* the first value of an entry, SHORT or LONG */
+    uint32_t value(std::size_t entry) const
+    {
+        uint16_t type = u16(entry + 2);
+        uint32_t count = 0;
+        u32(entry + 4, count);
+        if(count == 0) {
+            return 0;
+        }
+        if(type == TYPE_SHORT) {
+            return u16(entry + 8);
+        }
+        uint32_t result = 0;
+        u32(entry + 8, result);
+        return result;
+    }
+
+    /* all values of a LONG or IFD entry, inline or at the offset */
+    void values(std::size_t entry, std::vector<uint32_t>& result) const
+    {
+        uint16_t type = u16(entry + 2);
+        uint32_t count = 0;
+        u32(entry + 4, count);
+        if((type != TYPE_LONG && type != TYPE_IFD) || count == 0 || count > MAX_IFDS) {
+            return;
+        }
+        uint32_t at = entry + 8;
+        if(count > 1 && !u32(entry + 8, at)) {
+            return;
+        }
+        for(uint32_t i = 0; i < count; ++i) {
+            uint32_t value;
+            if(u32(at + 4 * i, value)) {
+                result.push_back(value);
+            }
+        }
+    }
+
+    const unsigned char* data;
+    const std::size_t size;
+    bool big_endian;
+};
+
+/* the size from the frame header; false for what QImage cannot show, like the lossless raw data */
+bool jpeg_frame(const unsigned char* data, std::size_t size, int& width, int& height)
+{
+    if(size < 4 || data[0] != 0xff || data[1] != 0xd8) {
+        return false;
+    }
+    std::size_t at = 2;
+    while(at + 4 <= size) {
+        if(data[at] != 0xff) {
+            return false;
+        }
+        unsigned char marker = data[at + 1];
+        if(marker == 0xff) {
+            // fill byte
+            ++at;
+            continue;
+        }
+        std::size_t length = data[at + 2] << 8 | data[at + 3];
+        if(marker == 0xc0 || marker == 0xc1 || marker == 0xc2) {
+            if(at + 9 > size) {
+                return false;
+            }
+            height = data[at + 5] << 8 | data[at + 6];
+            width = data[at + 7] << 8 | data[at + 8];
+            return width > 0 && height > 0;
+        }
+        bool other_frame = marker >= 0xc3 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+        if(other_frame || marker == 0xda || marker == 0xd9 || length < 2) {
+            return false;
+        }
+        at += 2 + length;
+    }
+    return false;
+}
+
+class Walker
+{
+public:
+    Walker(const Tiff& tiff, raw::Preview& best)
+        : tiff(tiff), best(best), ifds(0), found(false)
+    {
+    }
+
+    void walk(uint32_t offset, int depth, bool first)
+    {
+        // IFDs chain through their last field, SubIFDs and EXIF branch off
+        while(offset != 0 && depth <= MAX_DEPTH && ifds < MAX_IFDS && visited.insert(offset).second) {
+            ++ifds;
+            uint16_t count = tiff.u16(offset);
+            std::size_t entries = offset + 2;
+            if(count == 0 || entries + 12ul * count + 4 > tiff.size) {
+                return;
+            }
+
+            uint32_t jpeg_offset = 0, jpeg_length = 0, strip_offset = 0, strip_length = 0;
+            uint32_t compression = 0;
+            std::vector<uint32_t> children;
+            for(uint16_t i = 0; i < count; ++i) {
+                std::size_t entry = entries + 12 * i;
+                switch(tiff.u16(entry)) {
+                case TAG_COMPRESSION:
+                    compression = tiff.value(entry);
+                    break;
+                case TAG_JPEG_OFFSET:
+                    jpeg_offset = tiff.value(entry);
+                    break;
+                case TAG_JPEG_LENGTH:
+                    jpeg_length = tiff.value(entry);
+                    break;
+                case TAG_STRIP_OFFSETS:
+                    strip_offset = tiff.value(entry);
+                    break;
+                case TAG_STRIP_BYTE_COUNTS:
+                    strip_length = tiff.value(entry);
+                    break;
+                case TAG_ORIENTATION:
+                    if(first) {
+                        best.orientation = tiff.value(entry);
+                    }
+                    break;
+                case TAG_SUB_IFDS:
+                case TAG_EXIF_IFD:
+                    tiff.values(entry, children);
+                    break;
+                }
+            }
+
+            consider(jpeg_offset, jpeg_length);
+            // old style and new style JPEG, the frame header tells the rest
+            if(compression == 6 || compression == 7) {
+                consider(strip_offset, strip_length);
+            }
+            for(uint32_t child : children) {
+                walk(child, depth + 1, false);
+            }
+
+            first = false;
+            uint32_t next = 0;
+            tiff.u32(entries + 12ul * count, next);
+            offset = next;
+        }
+    }
+
+    bool foundAny() const
+    {
+        return found;
+    }
+
+private:
+    void consider(uint32_t offset, uint32_t length)
+    {
+        if(offset == 0 || length == 0 || offset >= tiff.size || length > tiff.size - offset) {
+            return;
+        }
+        int width, height;
+        if(!jpeg_frame(tiff.data + offset, length, width, height)) {
+            return;
+        }
+        if(found && uint64_t(width) * height <= uint64_t(best.width) * best.height) {
+            return;
+        }
+        best.data = tiff.data + offset;
+        best.size = length;
+        best.width = width;
+        best.height = height;
+        found = true;
+    }
+
+private:
+    const Tiff& tiff;
+    raw::Preview& best;
+    std::set<uint32_t> visited;
+    int ifds;
+    bool found;
+};
+}
+
+namespace raw
+{
+
+Preview::Preview()
+    : data(nullptr), size(0), width(0), height(0), orientation(1)
+{
+}
+
+bool findPreview(const unsigned char* data, std::size_t size, Preview& preview)
+{
+    preview = Preview();
+    Tiff tiff(data, size);
+    uint32_t first_ifd;
+    if(!tiff.readHeader(first_ifd)) {
+        return false;
+    }
+    Walker walker(tiff, preview);
+    walker.walk(first_ifd, 0, true);
+    if(preview.orientation < 1 || preview.orientation > 8) {
+        preview.orientation = 1;
+    }
+    return walker.foundAny();
+}
+
+int jpegOrientation(const unsigned char* data, std::size_t size)
+{
+    if(size < 4 || data[0] != 0xff || data[1] != 0xd8) {
+        return 0;
+    }
+    // the EXIF segment comes right after the start of the image, before the frame
+    std::size_t at = 2;
+    while(at + 4 <= size && data[at] == 0xff) {
+        unsigned char marker = data[at + 1];
+        std::size_t length = data[at + 2] << 8 | data[at + 3];
+        if(marker == 0xda || marker == 0xd9 || length < 2 || at + 2 + length > size) {
+            return 0;
+        }
+        const unsigned char* segment = data + at + 4;
+        std::size_t segment_size = length - 2;
+        if(marker == 0xe1 && segment_size > 6 && std::memcmp(segment, "Exif\0\0", 6) == 0) {
+            Tiff tiff(segment + 6, segment_size - 6);
+            uint32_t ifd;
+            if(!tiff.readHeader(ifd)) {
+                return 0;
+            }
+            uint16_t count = tiff.u16(ifd);
+            for(uint16_t i = 0; i < count && ifd + 2 + 12ul * (i + 1) <= tiff.size; ++i) {
+                std::size_t entry = ifd + 2 + 12 * i;
+                if(tiff.u16(entry) == TAG_ORIENTATION) {
+                    uint32_t orientation = tiff.value(entry);
+                    return orientation >= 1 && orientation <= 8 ? orientation : 0;
+                }
+            }
+            return 0;
+        }
+        at += 2 + length;
+    }
+    return 0;
+}
+
+MappedFile::MappedFile()
+    : mapping(nullptr), length(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string& path)
+{
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void* memory = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps the file
+    ::close(fd);
+    if(memory == MAP_FAILED) {
+        return false;
+    }
+    mapping = memory;
+    length = file_stat.st_size;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if(mapping) {
+        munmap(mapping, length);
+        mapping = nullptr;
+        length = 0;
+    }
+}
+
+const unsigned char* MappedFile::data() const
+{
+    return static_cast<const unsigned char*>(mapping);
+}
+
+std::size_t MappedFile::size() const
+{
+    return length;
+}
+
+}
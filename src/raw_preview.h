@@ -0,0 +1,52 @@
+#ifndef RAW_PREVIEW_H
+#define RAW_PREVIEW_H
+
+#include <cstddef>
+#include <string>
+
+/*
+ * The JPEG a camera embeds in its raw files, found without decoding the sensor data.
+ *
+ * CR2 (and most other TIFF based raws: NEF, ARW, DNG, PEF) store a full or nearly full size
+ * JPEG next to the raw image. findPreview() walks the IFDs of the file, including SubIFDs and EXIF,
+ * and returns the largest baseline or progressive JPEG it finds, as a view into the file.
+ * The lossless JPEG of the raw data itself is skipped.
+ */
+namespace raw
+{
+struct Preview
+{
+    Preview();
+
+    const unsigned char* data;      // into the file, valid as long as it is
+    std::size_t size;
+    int width;
+    int height;
+    int orientation;                // EXIF orientation, 1 is upright
+};
+
+bool findPreview(const unsigned char* data, std::size_t size, Preview& preview);
+
+/* the EXIF orientation of a JPEG, 0 if it has none */
+int jpegOrientation(const unsigned char* data, std::size_t size);
+
+/* a file mapped read only, for findPreview() without copying it */
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool open(const std::string& path);
+    void close();
+
+    const unsigned char* data() const;
+    std::size_t size() const;
+
+private:
+    void* mapping;
+    std::size_t length;
+};
+}
+
+#endif // RAW_PREVIEW_H
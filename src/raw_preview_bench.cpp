@@ -0,0 +1,115 @@
+#include "raw_preview.h"
+#include "metrics.h"
+
+#include <libraw/libraw.h>
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+ * Gets the embedded JPEG out of the raw files in a folder the way the booth used to
+ * (LibRaw with unpack()), with LibRaw's thumbnail alone and with raw::findPreview(),
+ * and reports how long each took.
+ *
+ *   ./raw_preview_bench folder-with-raws [runs]
+ *
+ * The page cache is warm after the first run, as it is for a file the booth has just written.
+ */
+namespace {
+bool is_raw(const std::string& name)
+{
+    std::string lower = name;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    const char* suffixes[] = { ".cr2", ".nef", ".arw", ".dng", ".pef" };
+    for(const char* suffix : suffixes) {
+        std::size_t length = strlen(suffix);
+        if(lower.size() > length && lower.compare(lower.size() - length, length, suffix) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+double time_ms(int runs, const std::function<bool()>& extract)
+{
+    double total = 0;
+    for(int run = 0; run < runs; ++run) {
+        Stopwatch time;
+        bool ok = extract();
+        total += time.elapsedMs();
+        if(!ok) {
+            return -1;
+        }
+    }
+    return total / runs;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " raw-directory [runs]" << std::endl;
+        return 1;
+    }
+    const std::string directory = argv[1];
+    const int runs = argc > 2 ? std::max(1, atoi(argv[2])) : 5;
+
+    std::vector<std::string> files;
+    if(DIR* dir = opendir(directory.c_str())) {
+        while(struct dirent* entry = readdir(dir)) {
+            if(is_raw(entry->d_name)) {
+                files.push_back(entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    std::sort(files.begin(), files.end());
+    if(files.empty()) {
+        std::cerr << "no raw files in " << directory << std::endl;
+        return 1;
+    }
+
+    printf("%d runs each, times in ms\n", runs);
+    printf("%-28s %11s %10s %10s  %s\n", "", "unpack", "thumbnail", "find", "preview");
+
+    double sums[3] = { 0, 0, 0 };
+    for(const std::string& file : files) {
+        const std::string path = directory + "/" + file;
+
+        double times[3];
+        // what takePicture() did before
+        times[0] = time_ms(runs, [&]() {
+            LibRaw processor;
+            return processor.open_file(path.c_str()) == LIBRAW_SUCCESS && processor.unpack() == LIBRAW_SUCCESS &&
+                    processor.unpack_thumb() == LIBRAW_SUCCESS;
+        });
+        times[1] = time_ms(runs, [&]() {
+            LibRaw processor;
+            return processor.open_file(path.c_str()) == LIBRAW_SUCCESS && processor.unpack_thumb() == LIBRAW_SUCCESS;
+        });
+        raw::Preview preview;
+        times[2] = time_ms(runs, [&]() {
+            raw::MappedFile capture;
+            return capture.open(path) && raw::findPreview(capture.data(), capture.size(), preview);
+        });
+
+        printf("%-28s %11.2f %10.2f %10.3f  %dx%d, %zu KB, orientation %d\n", file.c_str(),
+               times[0], times[1], times[2], preview.width, preview.height, preview.size / 1024, preview.orientation);
+        for(int i = 0; i < 3; ++i) {
+            sums[i] += times[i];
+        }
+    }
+
+    const int count = files.size();
+    printf("%-28s %11.2f %10.2f %10.3f\n", "average", sums[0] / count, sums[1] / count, sums[2] / count);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include "replay_driver.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+namespace {
+const int FINISH_CHECK_MS = 500;
+}
+
+ReplayDriver::ReplayDriver(CameraTrace& trace)
+    : trace(trace), next(0)
+{
+    picture_timer.setSingleShot(true);
+    picture_timer.setTimerType(Qt::PreciseTimer);
+    QObject::connect(&picture_timer, SIGNAL(timeout()), this, SLOT(requestPicture()));
+    QObject::connect(&finish_timer, SIGNAL(timeout()), this, SLOT(checkFinished()));
+}
+
+void ReplayDriver::start()
+{
+    countdowns = trace.marks(CameraTrace::PREARM);
+    next = 0;
+    printf("replaying %d pictures\n", int(countdowns.size()));
+
+    clock.restart();
+    scheduleNext();
+    finish_timer.start(FINISH_CHECK_MS);
+}
+
+void ReplayDriver::scheduleNext()
+{
+    if(next >= countdowns.size()) {
+        return;
+    }
+    double due_ms = countdowns[next].start_us / 1000.0 / trace.speed();
+    picture_timer.start(std::max(0, int(due_ms - clock.elapsedMs())));
+}
+
+void ReplayDriver::requestPicture()
+{
+    Metrics::instance().count("trace.pictures");
+    ++next;
+    emit pictureRequested();
+    scheduleNext();
+}
+
+void ReplayDriver::checkFinished()
+{
+    if(!trace.isFinished()) {
+        return;
+    }
+    finish_timer.stop();
+    printf("replay finished after %.0f ms\n", clock.elapsedMs());
+    emit finished();
+}
+
+#include "moc_replay_driver.cpp"
@@ -0,0 +1,46 @@
+#ifndef REPLAY_DRIVER_H
+#define REPLAY_DRIVER_H
+
+#include <QObject>
+#include <QTimer>
+#include <vector>
+
+#include "camera_trace.h"
+#include "metrics.h"
+
+/*
+ * Plays the guests of a recorded session: starts each countdown at the time it started
+ * in the recording (divided by the replay speed), and says when the trace is over.
+ */
+class ReplayDriver : public QObject
+{
+    Q_OBJECT
+
+public:
+    ReplayDriver(CameraTrace& trace);
+
+    void start();
+
+signals:
+    void pictureRequested();
+    void finished();
+
+private slots:
+    void requestPicture();
+    void checkFinished();
+
+private:
+    void scheduleNext();
+
+private:
+    CameraTrace& trace;
+
+    std::vector<CameraTrace::Record> countdowns;
+    std::size_t next;
+
+    Stopwatch clock;
+    QTimer picture_timer;
+    QTimer finish_timer;
+};
+
+#endif // REPLAY_DRIVER_H
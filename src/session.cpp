@@ -0,0 +1,101 @@
+#include "session.h"
+
+#include "metrics.h"
+
+#include <cmath>
+#include <string>
+
+Session::Session(int review_ms)
+    : review_ms(review_ms), current(IDLE)
+{
+}
+
+Session::State Session::state() const
+{
+    return current;
+}
+
+const char* Session::name(State state)
+{
+    switch(state) {
+    case COUNTDOWN:
+        return "countdown";
+    case CAPTURING:
+        return "capturing";
+    case REVIEWING:
+        return "reviewing";
+    default:
+        return "idle";
+    }
+}
+
+bool Session::startCountdown()
+{
+    if(current != IDLE && current != REVIEWING) {
+        return false;
+    }
+    enter(COUNTDOWN);
+    return true;
+}
+
+bool Session::countdownOver()
+{
+    if(current != COUNTDOWN) {
+        return false;
+    }
+    enter(CAPTURING);
+    return true;
+}
+
+bool Session::pictureShown(Clock::time_point now)
+{
+    // a picture that comes late, after the camera gave up, is shown all the same
+    if(current != CAPTURING && current != IDLE) {
+        return false;
+    }
+    review_end = now + std::chrono::milliseconds(review_ms);
+    enter(REVIEWING);
+    return true;
+}
+
+bool Session::captureDone()
+{
+    if(current != CAPTURING) {
+        return false;
+    }
+    Metrics::instance().count("session.captures_failed");
+    enter(IDLE);
+    return true;
+}
+
+bool Session::tick(Clock::time_point now)
+{
+    if(current != REVIEWING || now < review_end) {
+        return false;
+    }
+    enter(IDLE);
+    return true;
+}
+
+bool Session::endReview()
+{
+    if(current != REVIEWING) {
+        return false;
+    }
+    enter(IDLE);
+    return true;
+}
+
+int Session::secondsLeft(Clock::time_point now) const
+{
+    if(current != REVIEWING || now >= review_end) {
+        return 0;
+    }
+    return std::round(std::chrono::duration<double>(review_end - now).count());
+}
+
+void Session::enter(State next)
+{
+    current = next;
+    Metrics::instance().count(std::string("session.") + name(next));
+}
@@ -0,0 +1,54 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <chrono>
+
+/*
+ * What the booth is doing for the current guests.
+ *
+ *   IDLE -> COUNTDOWN -> CAPTURING -> REVIEWING -> IDLE
+ *
+ * A new countdown may also start while a picture is being reviewed,
+ * a capture without picture goes straight back to IDLE.
+ * Only the GUI thread drives it, so there is no locking.
+ */
+class Session
+{
+public:
+    enum State {
+        IDLE,
+        COUNTDOWN,
+        CAPTURING,
+        REVIEWING
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+public:
+    Session(int review_ms);
+
+    State state() const;
+    static const char* name(State state);
+
+    bool startCountdown();
+    bool countdownOver();
+    /* the picture is on screen, it stays for review_ms */
+    bool pictureShown(Clock::time_point now);
+    /* the camera is done, returns true if no picture came */
+    bool captureDone();
+    /* returns true when the review is over */
+    bool tick(Clock::time_point now);
+    bool endReview();
+
+    int secondsLeft(Clock::time_point now) const;
+
+private:
+    void enter(State next);
+
+private:
+    const int review_ms;
+    State current;
+    Clock::time_point review_end;
+};
+
+#endif // SESSION_H
@@ -0,0 +1,47 @@
+#include "task_thread.h"
+
+#include "thread_topology.h"
+
+TaskThread::TaskThread(int role)
+    : role(role), running(true)
+{
+    thread = std::thread(&TaskThread::run, this);
+}
+
+TaskThread::~TaskThread()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        running = false;
+        cond_task.notify_all();
+    }
+    thread.join();
+}
+
+void TaskThread::post(const std::function<void()>& task)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.push_back(task);
+    cond_task.notify_all();
+}
+
+void TaskThread::run()
+{
+    ThreadTopology::enter(ThreadTopology::Role(role));
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        while(running && queue.empty()) {
+            cond_task.wait(lock);
+        }
+        if(queue.empty()) {
+            return;
+        }
+        std::function<void()> task = std::move(queue.front());
+        queue.pop_front();
+
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
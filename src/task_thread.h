@@ -0,0 +1,40 @@
+#ifndef TASK_THREAD_H
+#define TASK_THREAD_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/*
+ * A thread of its own that runs tasks one after the other, in the order they were posted.
+ *
+ * For work that must not hold up the thread that hands it over, like the camera thread
+ * between two live view frames. The thread takes on the placement of its role (see ThreadTopology)
+ * and is not one of the workers, so the tasks can still split their work over the WorkerPool.
+ */
+class TaskThread
+{
+public:
+    TaskThread(int role);
+    /* runs what was posted before, then stops */
+    ~TaskThread();
+
+    void post(const std::function<void()>& task);
+
+private:
+    void run();
+
+private:
+    const int role;
+
+    std::mutex mutex;
+    std::condition_variable cond_task;
+    std::deque<std::function<void()> > queue;
+    bool running;
+
+    std::thread thread;
+};
+
+#endif // TASK_THREAD_H
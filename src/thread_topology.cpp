@@ -0,0 +1,176 @@
+#include "thread_topology.h"
+
+#include "metrics.h"
+#include "worker_pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <sstream>
+#include <thread>
+
+namespace {
+/* background work must never get in the way of the live view, also without configuration */
+const int DEFAULT_BACKGROUND_NICENESS = 10;
+
+thread_local ThreadTopology::Role current_role = ThreadTopology::OTHER;
+
+int core_count(const ThreadTopology::Placement& placement)
+{
+    if(!placement.cpus.empty()) {
+        return placement.cpus.size();
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+}
+
+ThreadTopology::Placement::Placement()
+    : realtime_priority(0), nice(0)
+{
+}
+
+ThreadTopology::Placement::Placement(const std::vector<int>& cpus, int realtime_priority, int nice)
+    : cpus(cpus), realtime_priority(realtime_priority), nice(nice)
+{
+}
+
+ThreadTopology& ThreadTopology::instance()
+{
+    static ThreadTopology topology;
+    return topology;
+}
+
+ThreadTopology::ThreadTopology()
+{
+    placements[BACKGROUND].nice = DEFAULT_BACKGROUND_NICENESS;
+}
+
+ThreadTopology::~ThreadTopology()
+{
+}
+
+void ThreadTopology::configure(Role role, const Placement& placement)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    placements[role] = placement;
+}
+
+ThreadTopology::Placement ThreadTopology::placement(Role role) const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return placements[role];
+}
+
+void ThreadTopology::enter(Role role)
+{
+    current_role = role;
+    Placement placement = instance().placement(role);
+
+    // threads inherit the placement of the thread that started them, e.g. a worker pool
+    // started by the camera thread, so an empty list means every core again
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(!placement.cpus.empty()) {
+        for(int cpu : placement.cpus) {
+            CPU_SET(cpu, &set);
+        }
+    } else {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        for(long cpu = 0; cpu < cpus && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if(result != 0) {
+        Metrics::instance().count("threads.placement_failed");
+        fprintf(stderr, "cannot pin %s thread: %s\n", name(role), strerror(result));
+    }
+
+    sched_param param;
+    if(placement.realtime_priority > 0) {
+        param.sched_priority = placement.realtime_priority;
+        result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if(result == 0) {
+            return;
+        }
+        // needs CAP_SYS_NICE or an rtprio limit, see limits.conf
+        Metrics::instance().count("threads.placement_failed");
+        fprintf(stderr, "no SCHED_FIFO for %s thread (%s), running at nice %d\n",
+                name(role), strerror(result), placement.nice);
+    }
+
+    // an inherited SCHED_FIFO would make the nice value meaningless
+    param.sched_priority = 0;
+    result = pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    if(result != 0) {
+        Metrics::instance().count("threads.placement_failed");
+        fprintf(stderr, "cannot set SCHED_OTHER for %s thread: %s\n", name(role), strerror(result));
+    }
+
+    // on Linux this only affects the calling thread
+    if(setpriority(PRIO_PROCESS, 0, placement.nice) != 0) {
+        Metrics::instance().count("threads.placement_failed");
+        fprintf(stderr, "cannot set nice %d for %s thread\n", placement.nice, name(role));
+    }
+}
+
+ThreadTopology::Role ThreadTopology::current()
+{
+    return current_role;
+}
+
+const char* ThreadTopology::name(Role role)
+{
+    switch(role) {
+    case CAMERA_IO:
+        return "camera_io";
+    case DECODE:
+        return "decode";
+    case BACKGROUND:
+        return "background";
+    case INPUT:
+        return "input";
+    default:
+        return "other";
+    }
+}
+
+WorkerPool& ThreadTopology::workers(Role caller)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::unique_ptr<WorkerPool>& pool = caller == BACKGROUND ? background_workers : decode_workers;
+    Role role = caller == BACKGROUND ? BACKGROUND : DECODE;
+    if(!pool) {
+        // the calling thread takes a part itself
+        pool.reset(new WorkerPool(role, core_count(placements[role]) - 1));
+    }
+    return *pool;
+}
+
+std::string ThreadTopology::report() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::ostringstream out;
+    for(int role = CAMERA_IO; role < ROLE_COUNT; ++role) {
+        const Placement& placement = placements[role];
+        out << name(Role(role)) << ": cpus ";
+        if(placement.cpus.empty()) {
+            out << "any";
+        }
+        for(std::size_t i = 0; i < placement.cpus.size(); ++i) {
+            out << (i > 0 ? "," : "") << placement.cpus[i];
+        }
+        if(placement.realtime_priority > 0) {
+            out << ", SCHED_FIFO " << placement.realtime_priority;
+        } else {
+            out << ", nice " << placement.nice;
+        }
+        out << "\n";
+    }
+    return out.str();
+}
@@ -0,0 +1,72 @@
+#ifndef THREAD_TOPOLOGY_H
+#define THREAD_TOPOLOGY_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class WorkerPool;
+
+/*
+ * Which threads the booth has, and on which cores and at which priority they run.
+ *
+ *   CAMERA_IO   the live view loop and the captures, everything that talks to the camera
+ *   DECODE      the workers that help the camera threads and the GUI with a frame or a picture
+ *   BACKGROUND  loops, collages, gallery copies and their workers
+ *   INPUT       the button
+ *
+ * Each thread calls enter() with its role when it starts. The placement is configured once,
+ * before the threads start; without configuration every role may use every core at nice 0,
+ * except BACKGROUND at nice 10.
+ */
+class ThreadTopology
+{
+public:
+    enum Role {
+        OTHER,          // the GUI thread and anything that never entered a role
+        CAMERA_IO,
+        DECODE,
+        BACKGROUND,
+        INPUT,
+        ROLE_COUNT
+    };
+
+    struct Placement
+    {
+        Placement();
+        Placement(const std::vector<int>& cpus, int realtime_priority, int nice);
+
+        std::vector<int> cpus;      // empty: any core
+        int realtime_priority;      // > 0: SCHED_FIFO at this priority
+        int nice;                   // otherwise, and if SCHED_FIFO is not permitted
+    };
+
+public:
+    static ThreadTopology& instance();
+
+    void configure(Role role, const Placement& placement);
+    Placement placement(Role role) const;
+
+    /* applies the placement of role to the calling thread */
+    static void enter(Role role);
+    static Role current();
+    static const char* name(Role role);
+
+    /* the workers for splitting up the work of a thread: background work stays in the background */
+    WorkerPool& workers(Role caller);
+
+    std::string report() const;
+
+private:
+    ThreadTopology();
+    ~ThreadTopology();
+
+private:
+    mutable std::mutex mutex;
+    Placement placements[ROLE_COUNT];
+    std::unique_ptr<WorkerPool> decode_workers;
+    std::unique_ptr<WorkerPool> background_workers;
+};
+
+#endif // THREAD_TOPOLOGY_H
@@ -0,0 +1,292 @@
+#include "timelapse_writer.h"
+
+#include "jpeg_decoder.h"
+#include "memory_budget.h"
+#include "metrics.h"
+#include "thread_topology.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+namespace {
+/* a few frames in flight are plenty at one frame every few seconds */
+const std::size_t MAX_QUEUED_FRAMES = 8;
+/* AVI 1.0 offsets are 32 bit, and some players give up at 1 GB */
+const uint32_t MAX_FILE_BYTES = 1024u * 1024u * 1024u;
+
+/* where the counts are patched in when the file is completed, see open() */
+const long RIFF_SIZE_AT = 4;
+const long TOTAL_FRAMES_AT = 48;
+const long STREAM_LENGTH_AT = 140;
+const long MOVI_SIZE_AT = 216;
+const uint32_t AVIF_HASINDEX = 0x10;
+const uint32_t AVIIF_KEYFRAME = 0x10;
+/* the file is only complete after close(), until then the export must not take it */
+const std::string PART_SUFFIX = ".part";
+
+void put16(std::vector<char>& out, uint16_t value)
+{
+    out.push_back(char(value & 0xff));
+    out.push_back(char(value >> 8));
+}
+
+void put32(std::vector<char>& out, uint32_t value)
+{
+    put16(out, value & 0xffff);
+    put16(out, value >> 16);
+}
+
+void fourcc(std::vector<char>& out, const char* code)
+{
+    out.insert(out.end(), code, code + 4);
+}
+
+bool patch32(FILE* file, long at, uint32_t value)
+{
+    std::vector<char> bytes;
+    put32(bytes, value);
+    return fseek(file, at, SEEK_SET) == 0 && fwrite(bytes.data(), 1, 4, file) == 4;
+}
+}
+
+TimelapseWriter::TimelapseWriter(const std::string& output_directory, int fps)
+    : output_directory(output_directory), fps(fps), queued_bytes(0), running(true), written(0),
+      file(NULL), movi_offset(0), file_bytes(0)
+{
+    worker = std::thread(&TimelapseWriter::run, this);
+}
+
+TimelapseWriter::~TimelapseWriter()
+{
+    finish();
+}
+
+bool TimelapseWriter::add(const char* jpeg, std::size_t size)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(!running) {
+        return false;
+    }
+    if(queue.size() >= MAX_QUEUED_FRAMES) {
+        Metrics::instance().count("timelapse.dropped");
+        return false;
+    }
+    queue.push_back(std::vector<char>(jpeg, jpeg + size));
+    queued_bytes += size;
+    MemoryBudget::instance().set("timelapse", queued_bytes);
+    cond_frame.notify_all();
+    return true;
+}
+
+void TimelapseWriter::finish()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        running = false;
+        cond_frame.notify_all();
+    }
+    if(worker.joinable()) {
+        worker.join();
+    }
+}
+
+int TimelapseWriter::frames() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return written;
+}
+
+void TimelapseWriter::run()
+{
+    ThreadTopology::enter(ThreadTopology::BACKGROUND);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        while(running && queue.empty()) {
+            cond_frame.wait(lock);
+        }
+        if(queue.empty()) {
+            break;
+        }
+        std::vector<char> jpeg = std::move(queue.front());
+        queue.pop_front();
+        queued_bytes -= jpeg.size();
+        MemoryBudget::instance().set("timelapse", queued_bytes);
+
+        lock.unlock();
+        Stopwatch write_time;
+        // the chunk, and its entry in the index that is written last
+        if(file && uint64_t(file_bytes) + 8 + jpeg.size() + 8 + 16 * (index.size() + 1) > MAX_FILE_BYTES) {
+            close();
+        }
+        bool ok = (file || open(jpeg)) && write(jpeg);
+        if(ok) {
+            Metrics::instance().sample("timelapse.write_ms", write_time.elapsedMs());
+        } else {
+            Metrics::instance().count("timelapse.write_errors");
+        }
+        lock.lock();
+        if(ok) {
+            ++written;
+        }
+    }
+    lock.unlock();
+    close();
+}
+
+bool TimelapseWriter::open(const std::vector<char>& first)
+{
+    int width, height;
+    if(!jpeg::readSize((const unsigned char*) first.data(), first.size(), width, height)) {
+        // the first frame is corrupt, the next one will do
+        return false;
+    }
+
+    long now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    path = output_directory + std::to_string(now) + ".timelapse.avi";
+    file = fopen((path + PART_SUFFIX).c_str(), "wb");
+    if(file == NULL) {
+        fprintf(stderr, "cannot write the timelapse %s%s: %s\n", path.c_str(), PART_SUFFIX.c_str(), strerror(errno));
+        return false;
+    }
+
+    // the counts and sizes are zero for now, close() fills them in
+    std::vector<char> header;
+    fourcc(header, "RIFF");
+    put32(header, 0);
+    fourcc(header, "AVI ");
+
+    fourcc(header, "LIST");
+    put32(header, 192);
+    fourcc(header, "hdrl");
+
+    fourcc(header, "avih");
+    put32(header, 56);
+    put32(header, 1000000 / fps);       // microseconds per frame
+    put32(header, 0);                   // max bytes per second
+    put32(header, 0);                   // padding granularity
+    put32(header, AVIF_HASINDEX);
+    put32(header, 0);                   // total frames
+    put32(header, 0);                   // initial frames
+    put32(header, 1);                   // streams
+    put32(header, 0);                   // suggested buffer size
+    put32(header, width);
+    put32(header, height);
+    for(int i = 0; i < 4; ++i) {
+        put32(header, 0);
+    }
+
+    fourcc(header, "LIST");
+    put32(header, 116);
+    fourcc(header, "strl");
+
+    fourcc(header, "strh");
+    put32(header, 56);
+    fourcc(header, "vids");
+    fourcc(header, "MJPG");
+    put32(header, 0);                   // flags
+    put16(header, 0);                   // priority
+    put16(header, 0);                   // language
+    put32(header, 0);                   // initial frames
+    put32(header, 1);                   // scale
+    put32(header, fps);                 // rate, frames per scale
+    put32(header, 0);                   // start
+    put32(header, 0);                   // length in frames
+    put32(header, 0);                   // suggested buffer size
+    put32(header, 0xffffffff);          // quality
+    put32(header, 0);                   // sample size
+    put16(header, 0);
+    put16(header, 0);
+    put16(header, width);
+    put16(header, height);
+
+    fourcc(header, "strf");
+    put32(header, 40);
+    put32(header, 40);                  // BITMAPINFOHEADER
+    put32(header, width);
+    put32(header, height);
+    put16(header, 1);                   // planes
+    put16(header, 24);                  // bits per pixel
+    fourcc(header, "MJPG");
+    put32(header, width * height * 3);
+    for(int i = 0; i < 4; ++i) {
+        put32(header, 0);
+    }
+
+    fourcc(header, "LIST");
+    put32(header, 0);
+    movi_offset = header.size();
+    fourcc(header, "movi");
+
+    if(fwrite(header.data(), 1, header.size(), file) != header.size()) {
+        fprintf(stderr, "cannot write the timelapse %s\n", path.c_str());
+        fclose(file);
+        file = NULL;
+        return false;
+    }
+    file_bytes = header.size();
+    index.clear();
+    printf("recording the timelapse to %s\n", path.c_str());
+    return true;
+}
+
+bool TimelapseWriter::write(const std::vector<char>& jpeg)
+{
+    std::vector<char> chunk;
+    fourcc(chunk, "00dc");
+    put32(chunk, jpeg.size());
+
+    // chunks start at even offsets
+    bool ok = fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size() &&
+              fwrite(jpeg.data(), 1, jpeg.size(), file) == jpeg.size() &&
+              (jpeg.size() % 2 == 0 || fputc(0, file) != EOF);
+    if(!ok) {
+        return false;
+    }
+
+    IndexEntry entry;
+    entry.offset = file_bytes - movi_offset;
+    entry.size = jpeg.size();
+    index.push_back(entry);
+    file_bytes += chunk.size() + jpeg.size() + jpeg.size() % 2;
+    return true;
+}
+
+void TimelapseWriter::close()
+{
+    if(file == NULL) {
+        return;
+    }
+
+    std::vector<char> idx1;
+    fourcc(idx1, "idx1");
+    put32(idx1, index.size() * 16);
+    for(const IndexEntry& entry : index) {
+        fourcc(idx1, "00dc");
+        put32(idx1, AVIIF_KEYFRAME);
+        put32(idx1, entry.offset);
+        put32(idx1, entry.size);
+    }
+    const uint32_t movi_end = file_bytes;
+    bool ok = fwrite(idx1.data(), 1, idx1.size(), file) == idx1.size();
+    file_bytes += idx1.size();
+
+    ok = patch32(file, RIFF_SIZE_AT, file_bytes - 8) && ok;
+    ok = patch32(file, TOTAL_FRAMES_AT, index.size()) && ok;
+    ok = patch32(file, STREAM_LENGTH_AT, index.size()) && ok;
+    ok = patch32(file, MOVI_SIZE_AT, movi_end - movi_offset) && ok;
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+
+    if(!ok) {
+        fprintf(stderr, "writing the timelapse %s%s failed\n", path.c_str(), PART_SUFFIX.c_str());
+        return;
+    }
+    if(rename((path + PART_SUFFIX).c_str(), path.c_str()) != 0) {
+        fprintf(stderr, "cannot rename the timelapse %s%s: %s\n", path.c_str(), PART_SUFFIX.c_str(), strerror(errno));
+        return;
+    }
+    printf("timelapse %s: %d frames, %.1f s at %d fps\n", path.c_str(), int(index.size()),
+           index.size() / double(fps), fps);
+}
@@ -0,0 +1,65 @@
+#ifndef TIMELAPSE_WRITER_H
+#define TIMELAPSE_WRITER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Streams live view JPEGs into a Motion JPEG AVI, for the ambience of the venue.
+ *
+ * The frames are stored as they come from the camera, nothing is decoded or encoded again.
+ * The file is written on a background thread while the booth runs and completed
+ * (frame count, index) by finish(); past MAX_FILE_BYTES a new file is started.
+ * add() never waits for the disk, if the writer falls behind frames are dropped.
+ */
+class TimelapseWriter
+{
+public:
+    TimelapseWriter(const std::string& output_directory, int fps);
+    ~TimelapseWriter();
+
+    bool add(const char* jpeg, std::size_t size);
+    /* completes the current file, frames added afterwards are dropped */
+    void finish();
+
+    int frames() const;
+
+private:
+    void run();
+    bool open(const std::vector<char>& first);
+    bool write(const std::vector<char>& jpeg);
+    void close();
+
+private:
+    const std::string output_directory;
+    const int fps;
+
+    mutable std::mutex mutex;
+    std::condition_variable cond_frame;
+    std::deque<std::vector<char> > queue;
+    std::size_t queued_bytes;
+    bool running;
+    int written;
+
+    // only touched by the writer thread
+    FILE* file;
+    std::string path;
+    uint32_t movi_offset;
+    uint32_t file_bytes;
+    struct IndexEntry
+    {
+        uint32_t offset;
+        uint32_t size;
+    };
+    std::vector<IndexEntry> index;
+
+    std::thread worker;
+};
+
+#endif // TIMELAPSE_WRITER_H
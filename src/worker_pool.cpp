@@ -0,0 +1,90 @@
+#include "worker_pool.h"
+
+#include "thread_topology.h"
+
+namespace {
+/* parts started from a worker run right there, waiting for the own pool could deadlock */
+thread_local bool is_worker = false;
+}
+
+WorkerPool::WorkerPool(int role, int thread_count)
+    : role(role), running(true)
+{
+    for(int i = 0; i < thread_count; ++i) {
+        threads.emplace_back(&WorkerPool::work, this);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        running = false;
+        cond_work.notify_all();
+    }
+    for(std::thread& t : threads) {
+        t.join();
+    }
+}
+
+int WorkerPool::concurrency() const
+{
+    return threads.size() + 1;
+}
+
+void WorkerPool::run(int count, const std::function<void(int index)>& part)
+{
+    if(count <= 0) {
+        return;
+    }
+    if(threads.empty() || count == 1 || is_worker) {
+        for(int i = 0; i < count; ++i) {
+            part(i);
+        }
+        return;
+    }
+
+    int left = count - 1;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(int i = 1; i < count; ++i) {
+            queue.push_back([this, &part, &left, i]() {
+                part(i);
+                std::unique_lock<std::mutex> lock(mutex);
+                if(--left == 0) {
+                    cond_done.notify_all();
+                }
+            });
+        }
+        cond_work.notify_all();
+    }
+
+    part(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while(left > 0) {
+        cond_done.wait(lock);
+    }
+}
+
+void WorkerPool::work()
+{
+    is_worker = true;
+    ThreadTopology::enter(ThreadTopology::Role(role));
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+        while(running && queue.empty()) {
+            cond_work.wait(lock);
+        }
+        if(queue.empty()) {
+            return;
+        }
+        std::function<void()> job = std::move(queue.front());
+        queue.pop_front();
+
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed set of threads for splitting one piece of work into parts.
+ *
+ * The threads are started once and take on the placement of their role
+ * (see ThreadTopology), so the parts run on the cores and at the priority
+ * meant for them instead of inheriting whatever the caller has.
+ */
+class WorkerPool
+{
+public:
+    /* threads is the number of workers besides the calling thread */
+    WorkerPool(int role, int threads);
+    ~WorkerPool();
+
+    /* how many parts run at the same time, the calling thread included */
+    int concurrency() const;
+
+    /* runs part(0) .. part(count - 1) and returns when all are done; the caller takes part 0 */
+    void run(int count, const std::function<void(int index)>& part);
+
+private:
+    void work();
+
+private:
+    const int role;
+
+    std::mutex mutex;
+    std::condition_variable cond_work;
+    std::condition_variable cond_done;
+    std::deque<std::function<void()> > queue;
+    bool running;
+
+    std::vector<std::thread> threads;
+};
+
+#endif // WORKER_POOL_H